@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include "utils.h"
+#include "remote.h"
+#include "async.h"
+
+/*
+ * A queued expression; the server name is stored right after it.
+ */
+typedef struct VimAsyncQueue_Entry {
+    char *name;
+    /* monotonic_msec() by which the result is no longer waited for */
+    long long deadline;
+    apr_size_t exprLen;
+    char expr[1];
+} VimAsyncQueue_Entry;
+
+struct VimAsyncQueue {
+    server_rec *server_rec;
+    VimAsyncQueue_Send send;
+    void *data;
+
+    /* Ring of "capacity" entries, the "count" oldest of which start at
+     * "head"; guarded by the mutex */
+    VimAsyncQueue_Entry **entries;
+    int capacity;
+    int head;
+    int count;
+    apr_thread_mutex_t *mutex;
+    /* Signalled when an entry is queued or the thread is to stop */
+    apr_thread_cond_t *cond;
+
+    apr_thread_t *thread;
+    int stopping;
+
+    /* Expressions taken in, turned away for want of room, that failed, and
+     * that waited in the queue past their deadline */
+    volatile apr_uint32_t queued;
+    volatile apr_uint32_t dropped;
+    volatile apr_uint32_t failed;
+    volatile apr_uint32_t expired;
+};
+
+/* TRUE for 1, 2, 4, 8, ...; used to log counts without flooding the log */
+#define IS_POWER_OF_TWO(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+static void *APR_THREAD_FUNC senderThread(apr_thread_t *thread, void *data)
+{
+    VimAsyncQueue *queue = data;
+
+    apr_thread_mutex_lock(queue->mutex);
+    while (!queue->stopping) {
+        VimAsyncQueue_Entry *entry;
+        long long remaining;
+
+        if (queue->count == 0) {
+            apr_thread_cond_wait(queue->cond, queue->mutex);
+            continue;
+        }
+        entry = queue->entries[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        apr_thread_mutex_unlock(queue->mutex);
+
+        /* The time spent in the queue counts against the deadline */
+        remaining = entry->deadline - monotonic_msec();
+        if (remaining <= 0) {
+            apr_uint32_t expired = apr_atomic_inc32(&queue->expired) + 1;
+            if (IS_POWER_OF_TWO(expired))
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, queue->server_rec, "Dropped a queued expression for the server %s past its deadline (%u so far)", entry->name, expired);
+        } else if (queue->send(queue->data, entry->name, entry->expr, entry->exprLen, (long)remaining) != VIM_REMOTE_OK) {
+            apr_uint32_t failed = apr_atomic_inc32(&queue->failed) + 1;
+            if (IS_POWER_OF_TWO(failed))
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, queue->server_rec, "Failed to send a queued expression to the server %s (%u failures so far)", entry->name, failed);
+        }
+        free(entry);
+
+        apr_thread_mutex_lock(queue->mutex);
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stopQueue(void *data)
+{
+    VimAsyncQueue *queue = data;
+    apr_status_t rv;
+    int left;
+
+    apr_thread_mutex_lock(queue->mutex);
+    queue->stopping = TRUE;
+    apr_thread_cond_signal(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+    apr_thread_join(&rv, queue->thread);
+
+    left = queue->count;
+    while (queue->count > 0) {
+        free(queue->entries[queue->head]);
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    if (left > 0 || queue->dropped > 0 || queue->expired > 0)
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, queue->server_rec, "Vim async queue: %u queued, %u dropped when full, %u failed, %u expired, %d never sent", queue->queued, queue->dropped, queue->failed, queue->expired, left);
+    return APR_SUCCESS;
+}
+
+/*
+ * Create a queue holding "capacity" expressions at most, and start the
+ * thread sending them with "send".  The thread is stopped when "pool" is
+ * cleared, and whatever is still queued then is dropped.
+ * Returns NULL for error.
+ */
+VimAsyncQueue *VimAsyncQueue_new(server_rec *server_rec, apr_pool_t *pool, int capacity, VimAsyncQueue_Send send, void *data)
+{
+    VimAsyncQueue *queue = apr_pcalloc(pool, sizeof(*queue));
+    apr_status_t status;
+
+    queue->server_rec = server_rec;
+    queue->send = send;
+    queue->data = data;
+    queue->entries = apr_pcalloc(pool, capacity * sizeof(*queue->entries));
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->stopping = FALSE;
+    queue->queued = 0;
+    queue->dropped = 0;
+    queue->failed = 0;
+    queue->expired = 0;
+    if (apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+            || apr_thread_cond_create(&queue->cond, pool))
+        return NULL;
+    if ((status = apr_thread_create(&queue->thread, NULL, senderThread, queue, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot start the Vim async sender");
+        return NULL;
+    }
+    apr_pool_cleanup_register(pool, queue, stopQueue, apr_pool_cleanup_null);
+    return queue;
+}
+
+/*
+ * Queue "expr" to be evaluated on the server "name" by "deadline", in
+ * monotonic_msec() time; it is dropped if still queued by then.
+ * Return 0 for OK, -1 when the queue is full or out of memory.
+ */
+int VimAsyncQueue_push(VimAsyncQueue *queue, const char *name, const char *expr, apr_size_t expr_len, long long deadline)
+{
+    size_t name_len = strlen(name);
+    VimAsyncQueue_Entry *entry = malloc(sizeof(*entry) + expr_len + name_len + 1);
+    apr_uint32_t dropped;
+
+    if (!entry)
+        return -1;
+    memcpy(entry->expr, expr, expr_len);
+    entry->expr[expr_len] = '\0';
+    entry->exprLen = expr_len;
+    entry->name = entry->expr + expr_len + 1;
+    memcpy(entry->name, name, name_len + 1);
+    entry->deadline = deadline;
+
+    apr_thread_mutex_lock(queue->mutex);
+    if (queue->count < queue->capacity) {
+        queue->entries[(queue->head + queue->count) % queue->capacity] = entry;
+        queue->count++;
+        apr_atomic_inc32(&queue->queued);
+        apr_thread_cond_signal(queue->cond);
+        apr_thread_mutex_unlock(queue->mutex);
+        return 0;
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+
+    free(entry);
+    dropped = apr_atomic_inc32(&queue->dropped) + 1;
+    if (IS_POWER_OF_TWO(dropped))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, queue->server_rec, "Vim async queue is full (%u expressions dropped so far)", dropped);
+    return -1;
+}
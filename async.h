@@ -0,0 +1,26 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <httpd.h>
+
+/*
+ * Expressions evaluated without anybody waiting for the result, for
+ * locations answering at once with 202.  They are queued in a bounded
+ * queue drained by a thread of its own, so that a burst doesn't hold up
+ * the workers.  When the queue is full new expressions are dropped and
+ * counted instead, and so are those still queued when their deadline
+ * passes.
+ */
+typedef struct VimAsyncQueue VimAsyncQueue;
+
+/*
+ * Evaluates "expr" on the server "name", throwing the result away, and
+ * waiting "timeout" milliseconds at most if waiting at all.  Returns one of
+ * VIM_REMOTE_*.
+ */
+typedef int (*VimAsyncQueue_Send)(void *data, const char *name, const char *expr, apr_size_t expr_len, long timeout);
+
+VimAsyncQueue *VimAsyncQueue_new(server_rec *server_rec, apr_pool_t *pool, int capacity, VimAsyncQueue_Send send, void *data);
+int VimAsyncQueue_push(VimAsyncQueue *queue, const char *name, const char *expr, apr_size_t expr_len, long long deadline);
+
+#endif /* ASYNC_H */
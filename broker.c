@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <httpd.h>
+#include <http_log.h>
+#include <unixd.h>
+#include <apr_general.h>
+#include <apr_shm.h>
+#include <apr_atomic.h>
+#include <apr_signal.h>
+#include <apr_thread_proc.h>
+#ifndef USE_XCB
+#include <X11/Intrinsic.h>
+#endif
+#include "utils.h"
+#include "remote.h"
+#include "channel.h"
+#include "broker.h"
+
+/*
+ * Life cycle of a slot.  A child claims a free slot, fills in the request
+ * and submits it; the broker thread serving the slot stores the reply and
+ * marks it done; the child copies the reply out and frees the slot.  A
+ * child giving up on the reply marks the slot abandoned instead, and the
+ * broker frees it once the command completes.
+ */
+#define SLOT_FREE       0
+#define SLOT_CLAIMED    1
+#define SLOT_SUBMITTED  2
+#define SLOT_DONE       3
+#define SLOT_ABANDONED  4
+
+/* What a slot asks for */
+#define SLOT_EVAL       0
+#define SLOT_NAMES      1
+
+/* How often the broker checks for its parent and for dead children, msec */
+#define BROKER_HOUSEKEEPING_INTERVAL 1000
+
+/* How often the broker tries again to open the X display, msec */
+#define BROKER_RECONNECT_INTERVAL 10000
+
+typedef struct VimBroker_Slot {
+    /* One of SLOT_*; also the word waited on by both sides */
+    volatile apr_uint32_t state;
+    /* Process that claimed the slot */
+    volatile apr_uint32_t owner;
+    apr_uint32_t kind;
+    /* VIM_REMOTE_* of the reply */
+    apr_int32_t status;
+    /* Milliseconds to wait for the reply, negative for forever */
+    apr_int32_t timeout;
+    /* The request is the NUL terminated server name followed by the
+     * command; the reply is the result */
+    apr_uint32_t nameLen;
+    apr_uint32_t dataLen;
+    char data[1];
+} VimBroker_Slot;
+
+struct VimBroker {
+    server_rec *server_rec;
+    apr_shm_t *shm;
+    char *base;
+    int nslots;
+    apr_size_t slotSize;
+    apr_size_t stride;
+    /* Where this process starts looking for a free slot */
+    volatile apr_uint32_t next;
+
+    /* What the broker talks to Vim through: the channel server if set,
+     * or else an X connection opened with the parameters below */
+    VimChannelServer *channel;
+    const char *vim_version;
+    const char *enc;
+    const char *display;
+    int dispatcher;
+
+    /* Broker process only; set by the main thread once connected */
+    VimRemotingClient * volatile client;
+    volatile int stopping;
+};
+
+static VimBroker_Slot *getSlot(VimBroker *broker, int i)
+{
+    return (VimBroker_Slot *)(broker->base + broker->stride * i);
+}
+
+/*
+ * Sleep while "*word" is "value", "msec" milliseconds at most.  Spurious
+ * wake-ups are fine; the callers look at the word again anyway.
+ */
+static void waitWord(volatile apr_uint32_t *word, apr_uint32_t value, long msec)
+{
+#ifdef __linux__
+    struct timespec ts;
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000;
+    syscall(SYS_futex, word, FUTEX_WAIT, value, msec >= 0 ? &ts: NULL, NULL, 0);
+#else
+    if (*word == value)
+        apr_sleep(apr_time_from_msec(msec >= 0 && msec < 1 ? msec: 1));
+#endif
+}
+
+static void wakeWord(volatile apr_uint32_t *word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/*
+ * Create the shared memory the children and the broker talk through.
+ * Meant to be called before forking.  Returns NULL on failure.
+ */
+VimBroker *VimBroker_new(server_rec *server_rec, apr_pool_t *pool, int nslots, apr_size_t slotSize)
+{
+    apr_status_t status;
+    VimBroker *broker = apr_pcalloc(pool, sizeof(*broker));
+    int i;
+
+    broker->server_rec = server_rec;
+    broker->nslots = nslots;
+    broker->slotSize = slotSize;
+    broker->stride = APR_ALIGN_DEFAULT(offsetof(VimBroker_Slot, data) + slotSize);
+    broker->next = 0;
+    broker->channel = NULL;
+    broker->client = NULL;
+    broker->stopping = FALSE;
+
+    if ((status = apr_shm_create(&broker->shm, broker->stride * nslots, NULL, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot create the shared memory for the Vim broker");
+        return NULL;
+    }
+    broker->base = apr_shm_baseaddr_get(broker->shm);
+    for (i = 0; i < nslots; i++) {
+        VimBroker_Slot *slot = getSlot(broker, i);
+        slot->state = SLOT_FREE;
+        slot->owner = 0;
+    }
+    return broker;
+}
+
+/*
+ * Carry out the request in "slot".
+ */
+static void serveSlot(VimBroker *broker, VimBroker_Slot *slot)
+{
+    char *result = NULL;
+    apr_size_t len;
+
+    if (!broker->channel && !broker->client) {
+        slot->status = VIM_REMOTE_ERROR;
+        slot->dataLen = 0;
+        return;
+    }
+
+    if (slot->kind == SLOT_NAMES) {
+        if (broker->channel)
+            result = VimChannelServer_getNames(broker->channel);
+        else
+            result = serverGetVimNames(broker->client);
+        slot->status = result ? VIM_REMOTE_OK: VIM_REMOTE_ERROR;
+    } else {
+        const char *name = slot->data;
+        const char *cmd = slot->data + slot->nameLen + 1;
+
+        if (broker->channel)
+            slot->status = VimChannelServer_send(broker->channel, name, cmd, slot->dataLen, &result, slot->timeout);
+        else
+            slot->status = serverSendToVim(broker->client, name, cmd, slot->dataLen, &result, slot->timeout);
+    }
+
+    len = result ? strlen(result): 0;
+    if (len > broker->slotSize) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, broker->server_rec, "Reply of %lu bytes doesn't fit in a broker slot (VimBrokerSlotSize)", (unsigned long)len);
+        slot->status = VIM_REMOTE_ERROR;
+        len = 0;
+    }
+    if (len > 0)
+        memcpy(slot->data, result, len);
+    slot->dataLen = len;
+    free(result);
+}
+
+typedef struct VimBroker_Worker {
+    VimBroker *broker;
+    VimBroker_Slot *slot;
+} VimBroker_Worker;
+
+/*
+ * Every slot is served by a thread of its own, so a slow command only
+ * holds up the child that sent it.
+ */
+static void *APR_THREAD_FUNC slotThread(apr_thread_t *thread, void *data)
+{
+    VimBroker_Worker *worker = data;
+    VimBroker *broker = worker->broker;
+    VimBroker_Slot *slot = worker->slot;
+
+    while (!broker->stopping) {
+        apr_uint32_t state = slot->state;
+
+        if (state != SLOT_SUBMITTED) {
+            waitWord(&slot->state, state, BROKER_HOUSEKEEPING_INTERVAL);
+            continue;
+        }
+
+        serveSlot(broker, slot);
+
+        /* the child may have given up in the meantime */
+        if (apr_atomic_cas32(&slot->state, SLOT_DONE, SLOT_SUBMITTED) != SLOT_SUBMITTED) {
+            slot->owner = 0;
+            apr_atomic_set32(&slot->state, SLOT_FREE);
+        }
+        wakeWord(&slot->state);
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * Free the slots held by children that died before collecting the reply.
+ */
+static void reapSlots(VimBroker *broker)
+{
+    int i;
+
+    for (i = 0; i < broker->nslots; i++) {
+        VimBroker_Slot *slot = getSlot(broker, i);
+        apr_uint32_t state = slot->state;
+
+        /* the owner is only set after the slot is claimed */
+        if ((state != SLOT_CLAIMED && state != SLOT_DONE) || slot->owner == 0)
+            continue;
+        if (kill((pid_t)slot->owner, 0) == 0 || errno != ESRCH)
+            continue;
+        /* nobody else changes the slot of a dead child */
+        slot->owner = 0;
+        if (apr_atomic_cas32(&slot->state, SLOT_FREE, state) == state)
+            wakeWord(&slot->state);
+    }
+}
+
+/*
+ * Open the connection to the X display and start its dispatcher thread if
+ * configured.  Until this succeeds, the requests fail.
+ */
+static void connectClient(VimBroker *broker)
+{
+    VimRemotingClient *client;
+
+    client = VimRemotingClient_new(broker->server_rec, broker->vim_version, broker->enc, broker->display);
+    if (!client)
+        return;
+    if (broker->dispatcher && VimRemotingClient_startDispatcher(client))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, broker->server_rec, "The Vim broker goes on without the X dispatcher thread");
+    /* publish the client only after it is set up */
+    apr_atomic_casptr((volatile void **)&broker->client, client, NULL);
+}
+
+/*
+ * The body of the broker process.  Never returns.
+ */
+static void runBroker(VimBroker *broker, pid_t parent)
+{
+    apr_pool_t *pool;
+    int i, x11 = !broker->channel;
+    long long reconnectAt = 0;
+
+    apr_signal(SIGTERM, SIG_DFL);
+    apr_signal(SIGHUP, SIG_DFL);
+    apr_signal(SIGUSR1, SIG_IGN);
+    apr_signal(SIGPIPE, SIG_IGN);
+
+    if (ap_unixd_setup_child())
+        _exit(1);
+
+    if (apr_pool_create(&pool, NULL))
+        _exit(1);
+
+    if (!x11) {
+        if (VimChannelServer_start(broker->channel, pool))
+            broker->channel = NULL;
+    } else {
+#ifndef USE_XCB
+        XInitThreads();
+#endif
+        connectClient(broker);
+        reconnectAt = monotonic_msec() + BROKER_RECONNECT_INTERVAL;
+    }
+
+    for (i = 0; i < broker->nslots; i++) {
+        apr_thread_t *thread;
+        VimBroker_Worker *worker = apr_palloc(pool, sizeof(*worker));
+
+        worker->broker = broker;
+        worker->slot = getSlot(broker, i);
+        if (apr_thread_create(&thread, NULL, slotThread, worker, pool)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, broker->server_rec, "Cannot start the Vim broker threads");
+            _exit(1);
+        }
+    }
+
+    /* Exit along with httpd */
+    while (getppid() == parent) {
+        apr_sleep(apr_time_from_msec(BROKER_HOUSEKEEPING_INTERVAL));
+        reapSlots(broker);
+        /* the X server may come up after httpd */
+        if (x11 && !broker->client && monotonic_msec() >= reconnectAt) {
+            connectClient(broker);
+            reconnectAt = monotonic_msec() + BROKER_RECONNECT_INTERVAL;
+        }
+    }
+    _exit(0);
+}
+
+/*
+ * Fork the broker process.  It is killed when "pool" is cleared, which is
+ * on every restart.
+ * Return 0 for OK, -1 for error.
+ */
+static int forkBroker(VimBroker *broker, apr_pool_t *pool)
+{
+    apr_status_t status;
+    apr_proc_t *proc = apr_pcalloc(pool, sizeof(*proc));
+    pid_t parent = getpid();
+
+    status = apr_proc_fork(proc, pool);
+    if (status == APR_INCHILD)
+        runBroker(broker, parent);
+    if (status != APR_INPARENT) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, broker->server_rec, "Cannot start the Vim broker");
+        return -1;
+    }
+    apr_pool_note_subprocess(pool, proc, APR_KILL_AFTER_TIMEOUT);
+    return 0;
+}
+
+/*
+ * Start a broker talking to Vim through the X display "display".
+ * Return 0 for OK, -1 for error.
+ */
+int VimBroker_start(VimBroker *broker, apr_pool_t *pool, const char *vim_version, const char *enc, const char *display, int dispatcher)
+{
+    broker->vim_version = vim_version;
+    broker->enc = enc;
+    broker->display = display;
+    broker->dispatcher = dispatcher;
+    return forkBroker(broker, pool);
+}
+
+/*
+ * Start a broker serving the connections Vim makes to "channel", which
+ * must be listening already.
+ * Return 0 for OK, -1 for error.
+ */
+int VimBroker_startChannel(VimBroker *broker, apr_pool_t *pool, VimChannelServer *channel)
+{
+    broker->channel = channel;
+    return forkBroker(broker, pool);
+}
+
+/*
+ * Claim a free slot, trying until "deadline".
+ */
+static VimBroker_Slot *claimSlot(VimBroker *broker, long long deadline)
+{
+    for (;;) {
+        apr_uint32_t start = apr_atomic_inc32(&broker->next);
+        int i;
+
+        for (i = 0; i < broker->nslots; i++) {
+            VimBroker_Slot *slot = getSlot(broker, (start + getpid() + i) % broker->nslots);
+            if (apr_atomic_cas32(&slot->state, SLOT_CLAIMED, SLOT_FREE) == SLOT_FREE) {
+                slot->owner = (apr_uint32_t)getpid();
+                return slot;
+            }
+        }
+        if (deadline >= 0 && monotonic_msec() >= deadline)
+            return NULL;
+        apr_sleep(apr_time_from_msec(1));
+    }
+}
+
+/*
+ * Submit the request filled in "slot" and wait for the reply until
+ * "deadline".  On success the slot is left for the caller to read and free.
+ */
+static int submitSlot(VimBroker *broker, VimBroker_Slot *slot, long long deadline)
+{
+    apr_atomic_set32(&slot->state, SLOT_SUBMITTED);
+    wakeWord(&slot->state);
+
+    for (;;) {
+        apr_uint32_t state = slot->state;
+        long long now;
+
+        if (state == SLOT_DONE)
+            return VIM_REMOTE_OK;
+
+        now = monotonic_msec();
+        if (deadline >= 0 && now >= deadline) {
+            /* leave the slot to the broker, unless the reply just came */
+            if (apr_atomic_cas32(&slot->state, SLOT_ABANDONED, SLOT_SUBMITTED) == SLOT_SUBMITTED)
+                return VIM_REMOTE_TIMEOUT;
+            continue;
+        }
+        waitWord(&slot->state, state, deadline >= 0 ? deadline - now: BROKER_HOUSEKEEPING_INTERVAL);
+    }
+}
+
+static void releaseSlot(VimBroker_Slot *slot)
+{
+    slot->owner = 0;
+    apr_atomic_set32(&slot->state, SLOT_FREE);
+}
+
+/*
+ * Counterpart of serverSendToVim() going through the broker.
+ */
+int VimBroker_send(VimBroker *broker, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout)
+{
+    long long deadline = timeout >= 0 ? monotonic_msec() + timeout: -1;
+    apr_size_t name_len = strlen(name);
+    VimBroker_Slot *slot;
+    int retval;
+
+    *result = NULL;
+
+    if (name_len + 1 + cmd_len > broker->slotSize) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, broker->server_rec, "Command of %lu bytes with the server name doesn't fit in a broker slot (VimBrokerSlotSize)", (unsigned long)(name_len + 1 + cmd_len));
+        return VIM_REMOTE_ERROR;
+    }
+
+    slot = claimSlot(broker, deadline);
+    if (!slot) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, broker->server_rec, "No Vim broker slot became free in time");
+        return VIM_REMOTE_TIMEOUT;
+    }
+
+    slot->kind = SLOT_EVAL;
+    slot->timeout = timeout;
+    slot->nameLen = name_len;
+    memcpy(slot->data, name, name_len + 1);
+    memcpy(slot->data + name_len + 1, cmd, cmd_len);
+    slot->dataLen = cmd_len;
+
+    retval = submitSlot(broker, slot, deadline);
+    if (retval != VIM_REMOTE_OK)
+        return retval;
+
+    retval = slot->status;
+    if (slot->status == VIM_REMOTE_OK || slot->dataLen > 0) {
+        *result = malloc(slot->dataLen + 1);
+        if (*result) {
+            memcpy(*result, slot->data, slot->dataLen);
+            (*result)[slot->dataLen] = '\0';
+        } else {
+            retval = VIM_REMOTE_ERROR;
+        }
+    }
+    releaseSlot(slot);
+    return retval;
+}
+
+/*
+ * Counterpart of serverGetVimNames() going through the broker.
+ */
+char *VimBroker_getNames(VimBroker *broker)
+{
+    long long deadline = monotonic_msec() + BROKER_HOUSEKEEPING_INTERVAL;
+    VimBroker_Slot *slot = claimSlot(broker, deadline);
+    char *result = NULL;
+
+    if (!slot)
+        return NULL;
+
+    slot->kind = SLOT_NAMES;
+    slot->timeout = BROKER_HOUSEKEEPING_INTERVAL;
+    slot->nameLen = 0;
+    slot->dataLen = 0;
+
+    if (submitSlot(broker, slot, deadline) != VIM_REMOTE_OK)
+        return NULL;
+
+    if (slot->status == VIM_REMOTE_OK) {
+        result = malloc(slot->dataLen + 1);
+        if (result) {
+            memcpy(result, slot->data, slot->dataLen);
+            result[slot->dataLen] = '\0';
+        }
+    }
+    releaseSlot(slot);
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <httpd.h>
+#include "channel.h"
+
+/*
+ * A separate process owning the connection to the X display on behalf of
+ * every child.  The children hand their commands over through slots in
+ * anonymous shared memory, so however many children there are, there is
+ * only one X client and one comm window.
+ *
+ * With the channel transport the broker is where the Vim connections are
+ * accepted and served instead, so that every child reaches every Vim.
+ */
+typedef struct VimBroker VimBroker;
+
+VimBroker *VimBroker_new(server_rec *server_rec, apr_pool_t *pool, int nslots, apr_size_t slotSize);
+int VimBroker_start(VimBroker *broker, apr_pool_t *pool, const char *vim_version, const char *enc, const char *display, int dispatcher);
+int VimBroker_startChannel(VimBroker *broker, apr_pool_t *pool, VimChannelServer *channel);
+int VimBroker_send(VimBroker *broker, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout);
+char *VimBroker_getNames(VimBroker *broker);
+
+#endif /* BROKER_H */
@@ -0,0 +1,678 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_strings.h>
+#include <apr_network_io.h>
+#include <apr_poll.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_buckets.h>
+#include <apr_json.h>
+#include "ga.h"
+#include "utils.h"
+#include "remote.h"
+#include "channel.h"
+
+#define CHANNEL_MAX_CONNECTIONS 64
+
+/*
+ * An expression sent to Vim whose result is still awaited.
+ */
+typedef struct VimChannelServer_Pending {
+    /* Message id; always negative so it doesn't clash with Vim's own */
+    long id;
+    /* The whole response message (malloc'ed).  NULL means still pending. */
+    char *message;
+    apr_size_t message_len;
+    /* Set when the connection is lost before the response arrives */
+    int failed;
+    struct VimChannelServer_Pending *nextPtr;
+} VimChannelServer_Pending;
+
+typedef struct VimChannelServer_Connection {
+    apr_pool_t *pool;
+    apr_socket_t *socket;
+    apr_pollfd_t pfd;
+    /* Server name announced by Vim (malloc'ed), NULL if none */
+    char *name;
+    /* TRUE once the connection is closed */
+    int dead;
+    /* Number of threads using the connection */
+    unsigned int refcount;
+    /* Number of expressions awaiting their results */
+    unsigned int inflight;
+    /* Serializes writes of whole messages */
+    apr_thread_mutex_t *writeMutex;
+    /* Bytes received that don't make up a whole message yet */
+    garray_T buf;
+    VimChannelServer_Pending *pendings;
+    struct VimChannelServer_Connection *nextPtr;
+} VimChannelServer_Connection;
+
+struct VimChannelServer {
+    server_rec *server_rec;
+    const char *address;
+    apr_socket_t *listener;
+    apr_pollfd_t listenerPfd;
+    apr_pollset_t *pollset;
+    apr_thread_t *thread;
+    volatile int stopping;
+
+    /* Guards everything below, and the pendings of all connections */
+    apr_thread_mutex_t *mutex;
+    /* Broadcast when a response arrives or a connection comes or goes */
+    apr_thread_cond_t *cond;
+    VimChannelServer_Connection *connections;
+    long lastId;
+};
+
+/*
+ * Create a socket listening on "address", which is either "unix:/path" or
+ * "host:port".
+ */
+static apr_status_t createListener(VimChannelServer *server, apr_pool_t *pool)
+{
+    apr_status_t status;
+    apr_sockaddr_t *sa;
+    int family;
+
+    if (strncmp(server->address, "unix:", 5) == 0) {
+        const char *path = server->address + 5;
+        /* remove the socket left behind by a previous generation */
+        apr_file_remove(path, pool);
+        if ((status = apr_sockaddr_info_get(&sa, path, APR_UNIX, 0, 0, pool)))
+            return status;
+        family = APR_UNIX;
+    } else {
+        char *host, *scope_id;
+        apr_port_t port;
+
+        if ((status = apr_parse_addr_port(&host, &scope_id, &port, server->address, pool)))
+            return status;
+        if (!port)
+            return APR_EINVAL;
+        if ((status = apr_sockaddr_info_get(&sa, host, APR_UNSPEC, port, 0, pool)))
+            return status;
+        family = sa->family;
+    }
+
+    if ((status = apr_socket_create(&server->listener, family, SOCK_STREAM, 0, pool)))
+        return status;
+    apr_socket_opt_set(server->listener, APR_SO_REUSEADDR, 1);
+    if ((status = apr_socket_bind(server->listener, sa))
+            || (status = apr_socket_listen(server->listener, CHANNEL_MAX_CONNECTIONS))) {
+        apr_socket_close(server->listener);
+        server->listener = NULL;
+        return status;
+    }
+    /* accept() is only called once the socket polled readable */
+    apr_socket_timeout_set(server->listener, 0);
+    return APR_SUCCESS;
+}
+
+/*
+ * Create a channel server and start listening.  This is meant to be called
+ * from the parent, which may still bind a privileged port, before the
+ * process serving the connections is forked.
+ * Returns NULL on failure.
+ */
+VimChannelServer *VimChannelServer_new(server_rec *server_rec, apr_pool_t *pool, const char *address)
+{
+    apr_status_t status;
+    VimChannelServer *server = apr_pcalloc(pool, sizeof(*server));
+
+    server->server_rec = server_rec;
+    server->address = address;
+    server->connections = NULL;
+    server->lastId = 0;
+    server->stopping = FALSE;
+
+    if ((status = createListener(server, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot listen on %s for Vim channels", address);
+        return NULL;
+    }
+    return server;
+}
+
+static void releaseConnection(VimChannelServer *server, VimChannelServer_Connection *conn)
+{
+    if (--conn->refcount > 0 || !conn->dead)
+        return;
+    free(conn->name);
+    ga_clear(&conn->buf);
+    apr_pool_destroy(conn->pool);
+    free(conn);
+}
+
+/*
+ * Forget a connection that got closed and fail everything awaited on it.
+ * Must be called with the mutex held.
+ */
+static void closeConnection(VimChannelServer *server, VimChannelServer_Connection *conn)
+{
+    VimChannelServer_Connection **pp;
+    VimChannelServer_Pending *pending;
+
+    for (pp = &server->connections; *pp; pp = &(*pp)->nextPtr) {
+        if (*pp == conn) {
+            *pp = conn->nextPtr;
+            break;
+        }
+    }
+
+    for (pending = conn->pendings; pending; pending = pending->nextPtr)
+        pending->failed = TRUE;
+
+    apr_pollset_remove(server->pollset, &conn->pfd);
+    apr_socket_close(conn->socket);
+    conn->dead = TRUE;
+    apr_thread_cond_broadcast(server->cond);
+    releaseConnection(server, conn);
+}
+
+static apr_status_t sendAll(apr_socket_t *socket, const char *data, apr_size_t len)
+{
+    apr_status_t status;
+
+    while (len > 0) {
+        apr_size_t n = len;
+        if ((status = apr_socket_send(socket, data, &n)))
+            return status;
+        data += n;
+        len -= n;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t sendMessage(VimChannelServer_Connection *conn, const char *msg, apr_size_t msg_len)
+{
+    apr_status_t status;
+
+    apr_thread_mutex_lock(conn->writeMutex);
+    status = sendAll(conn->socket, msg, msg_len);
+    if (!status)
+        status = sendAll(conn->socket, "\n", 1);
+    apr_thread_mutex_unlock(conn->writeMutex);
+    return status;
+}
+
+/*
+ * Encode "value" as a JSON text allocated from "pool".
+ */
+static apr_status_t encodeJSON(char **json, apr_size_t *json_len, const apr_json_value_t *value, apr_pool_t *pool)
+{
+    apr_status_t status;
+    apr_bucket_alloc_t *bucket_alloc = apr_bucket_alloc_create(pool);
+    apr_bucket_brigade *bb = apr_brigade_create(pool, bucket_alloc);
+
+    status = apr_json_encode(bb, value, pool);
+    if (!status)
+        status = apr_brigade_pflatten(bb, json, json_len, pool);
+    apr_brigade_destroy(bb);
+    apr_bucket_alloc_destroy(bucket_alloc);
+    return status;
+}
+
+/*
+ * Handle a request sent by Vim with ch_sendexpr().  The only one understood
+ * is ["register", {name}].
+ */
+static void handleRequest(VimChannelServer *server, VimChannelServer_Connection *conn, long id, const char *msg, apr_size_t msg_len)
+{
+    apr_pool_t *pool;
+    apr_json_value_t *value, *body;
+    char *reply;
+
+    if (apr_pool_create(&pool, NULL))
+        return;
+
+    if (apr_json_decode(&value, msg, msg_len, pool)
+            || value->type != APR_JSON_ARRAY || value->value.array->nelts != 2)
+        goto out;
+
+    body = ((apr_json_value_t **)value->value.array->elts)[1];
+    if (body->type == APR_JSON_ARRAY && body->value.array->nelts == 2
+            && ((apr_json_value_t **)body->value.array->elts)[0]->type == APR_JSON_STRING
+            && ((apr_json_value_t **)body->value.array->elts)[1]->type == APR_JSON_STRING
+            && strcmp(((apr_json_value_t **)body->value.array->elts)[0]->value.string.p, "register") == 0) {
+        const char *name = ((apr_json_value_t **)body->value.array->elts)[1]->value.string.p;
+
+        apr_thread_mutex_lock(server->mutex);
+        free(conn->name);
+        conn->name = strdup(name);
+        apr_thread_cond_broadcast(server->cond);
+        apr_thread_mutex_unlock(server->mutex);
+
+        reply = apr_psprintf(pool, "[%ld,\"ok\"]", id);
+        sendMessage(conn, reply, strlen(reply));
+    }
+
+out:
+    apr_pool_destroy(pool);
+}
+
+/*
+ * Dispatch one complete message received from Vim.
+ */
+static void handleMessage(VimChannelServer *server, VimChannelServer_Connection *conn, const char *msg, apr_size_t msg_len)
+{
+    VimChannelServer_Pending *pending;
+    char *p;
+    long id;
+
+    /* Every message is [{id}, {value}]; peek at the id without decoding */
+    p = skipwhite((char *)msg + 1);
+    id = strtol(p, &p, 10);
+
+    if (id > 0) {
+        handleRequest(server, conn, id, msg, msg_len);
+        return;
+    }
+
+    if (id == 0)
+        return;
+
+    apr_thread_mutex_lock(server->mutex);
+    for (pending = conn->pendings; pending; pending = pending->nextPtr) {
+        if (pending->id == id && !pending->message) {
+            pending->message = malloc(msg_len + 1);
+            if (pending->message) {
+                memcpy(pending->message, msg, msg_len);
+                pending->message[msg_len] = '\0';
+                pending->message_len = msg_len;
+            } else {
+                pending->failed = TRUE;
+            }
+            apr_thread_cond_broadcast(server->cond);
+            break;
+        }
+    }
+    apr_thread_mutex_unlock(server->mutex);
+}
+
+/*
+ * Split the received bytes into messages.  Vim doesn't delimit JSON
+ * messages, so the brackets are balanced, minding string literals.
+ */
+static void handleInput(VimChannelServer *server, VimChannelServer_Connection *conn)
+{
+    char *data = conn->buf.ga_data;
+    size_t i, start = 0;
+    int depth = 0, in_string = FALSE, escaped = FALSE;
+
+    for (i = 0; i < conn->buf.ga_len; i++) {
+        char c = data[i];
+
+        if (in_string) {
+            if (escaped)
+                escaped = FALSE;
+            else if (c == '\\')
+                escaped = TRUE;
+            else if (c == '"')
+                in_string = FALSE;
+            continue;
+        }
+
+        switch (c) {
+        case '"':
+            in_string = TRUE;
+            break;
+        case '[':
+        case '{':
+            if (depth++ == 0)
+                start = i;
+            break;
+        case ']':
+        case '}':
+            if (depth > 0 && --depth == 0) {
+                if (data[start] == '[')
+                    handleMessage(server, conn, data + start, i + 1 - start);
+                start = i + 1;
+            }
+            break;
+        default:
+            if (depth == 0)
+                start = i + 1;
+            break;
+        }
+    }
+
+    /* keep the incomplete tail */
+    if (depth == 0)
+        start = conn->buf.ga_len;
+    memmove(data, data + start, conn->buf.ga_len - start);
+    conn->buf.ga_len -= start;
+}
+
+static void acceptConnection(VimChannelServer *server)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_socket_t *socket;
+    VimChannelServer_Connection *conn;
+
+    if (apr_pool_create(&pool, NULL))
+        return;
+
+    if ((status = apr_socket_accept(&socket, server->listener, pool))) {
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    conn = malloc(sizeof(*conn));
+    if (!conn || apr_thread_mutex_create(&conn->writeMutex, APR_THREAD_MUTEX_DEFAULT, pool)) {
+        free(conn);
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    conn->pool = pool;
+    conn->socket = socket;
+    conn->name = NULL;
+    conn->dead = FALSE;
+    conn->refcount = 1;
+    conn->inflight = 0;
+    conn->pendings = NULL;
+    ga_init2(&conn->buf, 1, 4096);
+
+    /* writes block; reads are only done when the socket polled readable */
+    apr_socket_timeout_set(socket, -1);
+
+    conn->pfd.p = pool;
+    conn->pfd.desc_type = APR_POLL_SOCKET;
+    conn->pfd.desc.s = socket;
+    conn->pfd.reqevents = APR_POLLIN;
+    conn->pfd.rtnevents = 0;
+    conn->pfd.client_data = conn;
+
+    apr_thread_mutex_lock(server->mutex);
+    conn->nextPtr = server->connections;
+    server->connections = conn;
+    apr_pollset_add(server->pollset, &conn->pfd);
+    apr_thread_cond_broadcast(server->cond);
+    apr_thread_mutex_unlock(server->mutex);
+}
+
+/*
+ * Read what is available on a connection that polled readable.
+ */
+static void readConnection(VimChannelServer *server, VimChannelServer_Connection *conn)
+{
+    apr_status_t status;
+    apr_size_t len;
+
+    if (!ga_grow(&conn->buf, 4096)) {
+        len = conn->buf.ga_maxlen - conn->buf.ga_len;
+        status = apr_socket_recv(conn->socket, (char *)conn->buf.ga_data + conn->buf.ga_len, &len);
+        conn->buf.ga_len += len;
+        if (len > 0)
+            handleInput(server, conn);
+        if (!status || APR_STATUS_IS_EAGAIN(status))
+            return;
+    }
+
+    apr_thread_mutex_lock(server->mutex);
+    closeConnection(server, conn);
+    apr_thread_mutex_unlock(server->mutex);
+}
+
+/*
+ * The thread that accepts the connections from Vim and reads whatever
+ * they send.  Writes are done by the request threads themselves.
+ */
+static void *APR_THREAD_FUNC pollerThread(apr_thread_t *thread, void *data)
+{
+    VimChannelServer *server = data;
+
+    while (!server->stopping) {
+        apr_int32_t i, num;
+        const apr_pollfd_t *pfds;
+        apr_status_t status = apr_pollset_poll(server->pollset, -1, &num, &pfds);
+
+        if (status)
+            continue;
+
+        for (i = 0; i < num; i++) {
+            if (pfds[i].client_data == NULL)
+                acceptConnection(server);
+            else
+                readConnection(server, pfds[i].client_data);
+        }
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stopServer(void *data)
+{
+    VimChannelServer *server = data;
+    apr_status_t rv;
+
+    server->stopping = TRUE;
+    apr_pollset_wakeup(server->pollset);
+    apr_thread_join(&rv, server->thread);
+
+    apr_thread_mutex_lock(server->mutex);
+    while (server->connections)
+        closeConnection(server, server->connections);
+    apr_thread_mutex_unlock(server->mutex);
+    return APR_SUCCESS;
+}
+
+/*
+ * Start accepting and serving the connections from Vim in this process.
+ * Return 0 for OK, -1 for error.
+ */
+int VimChannelServer_start(VimChannelServer *server, apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if ((status = apr_thread_mutex_create(&server->mutex, APR_THREAD_MUTEX_DEFAULT, pool))
+            || (status = apr_thread_cond_create(&server->cond, pool))
+            || (status = apr_pollset_create(&server->pollset, CHANNEL_MAX_CONNECTIONS + 1, pool,
+                                            APR_POLLSET_THREADSAFE | APR_POLLSET_WAKEABLE))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server->server_rec, "Cannot set up the Vim channel server");
+        return -1;
+    }
+
+    server->listenerPfd.p = pool;
+    server->listenerPfd.desc_type = APR_POLL_SOCKET;
+    server->listenerPfd.desc.s = server->listener;
+    server->listenerPfd.reqevents = APR_POLLIN;
+    server->listenerPfd.rtnevents = 0;
+    server->listenerPfd.client_data = NULL;
+    apr_pollset_add(server->pollset, &server->listenerPfd);
+
+    if ((status = apr_thread_create(&server->thread, NULL, pollerThread, server, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server->server_rec, "Cannot start the Vim channel thread");
+        return -1;
+    }
+    apr_pool_cleanup_register(pool, server, stopServer, apr_pool_cleanup_null);
+    return 0;
+}
+
+/*
+ * Pick the least busy connection that serves "name".
+ * Must be called with the mutex held.
+ */
+static VimChannelServer_Connection *pickConnection(VimChannelServer *server, const char *name)
+{
+    VimChannelServer_Connection *conn, *retval = NULL;
+
+    for (conn = server->connections; conn; conn = conn->nextPtr) {
+        if (conn->name && strcasecmp(conn->name, name) != 0)
+            continue;
+        if (!retval || conn->inflight < retval->inflight)
+            retval = conn;
+    }
+    return retval;
+}
+
+/*
+ * Returns a newline separated list of the names the connected Vims
+ * registered, in malloc'ed memory.
+ */
+char *VimChannelServer_getNames(VimChannelServer *server)
+{
+    VimChannelServer_Connection *conn;
+    garray_T ga;
+
+    ga_init2(&ga, 1, 100);
+    apr_thread_mutex_lock(server->mutex);
+    for (conn = server->connections; conn; conn = conn->nextPtr) {
+        if (conn->name) {
+            ga_concat(&ga, conn->name);
+            ga_concat(&ga, (char *)"\n");
+        }
+    }
+    apr_thread_mutex_unlock(server->mutex);
+    ga_append(&ga, '\0');
+    return ga.ga_data;
+}
+
+/*
+ * Evaluate "expr" in a Vim connected as "name" and wait "timeout"
+ * milliseconds at most for the result, or forever if negative.  The result
+ * is stored in "*result" as JSON text in malloc'ed memory: a string result
+ * is taken to be JSON already, so that expressions written for the X11
+ * transport work unchanged, and anything else is encoded.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT or VIM_REMOTE_ERROR.
+ */
+int VimChannelServer_send(VimChannelServer *server, const char *name, const char *expr, apr_size_t expr_len, char **result, long timeout)
+{
+    VimChannelServer_Connection *conn;
+    VimChannelServer_Pending pending;
+    long long deadline = timeout >= 0 ? monotonic_msec() + timeout: -1;
+    int retval = VIM_REMOTE_OK;
+    int sent;
+    char *msg;
+    apr_size_t msg_len;
+    apr_pool_t *pool;
+
+    *result = NULL;
+
+    if (apr_pool_create(&pool, NULL))
+        return VIM_REMOTE_ERROR;
+
+    {
+        apr_json_value_t message = { APR_JSON_ARRAY };
+        apr_json_value_t type = { APR_JSON_STRING };
+        apr_json_value_t expression = { APR_JSON_STRING };
+        apr_json_value_t id = { APR_JSON_LONG };
+
+        apr_thread_mutex_lock(server->mutex);
+        pending.id = -++server->lastId;
+        apr_thread_mutex_unlock(server->mutex);
+
+        type.value.string.p = "expr";
+        type.value.string.len = sizeof("expr") - 1;
+        expression.value.string.p = expr;
+        expression.value.string.len = expr_len;
+        id.value.lnumber = pending.id;
+        message.value.array = apr_array_make(pool, 3, sizeof(apr_json_value_t *));
+        APR_ARRAY_PUSH(message.value.array, apr_json_value_t *) = &type;
+        APR_ARRAY_PUSH(message.value.array, apr_json_value_t *) = &expression;
+        APR_ARRAY_PUSH(message.value.array, apr_json_value_t *) = &id;
+
+        if (encodeJSON(&msg, &msg_len, &message, pool)) {
+            apr_pool_destroy(pool);
+            return VIM_REMOTE_ERROR;
+        }
+    }
+
+    pending.message = NULL;
+    pending.failed = FALSE;
+
+    apr_thread_mutex_lock(server->mutex);
+
+    /* Wait for a Vim to connect if none did yet */
+    while (!(conn = pickConnection(server, name))) {
+        long long now = monotonic_msec();
+        if (deadline >= 0 && now >= deadline) {
+            apr_thread_mutex_unlock(server->mutex);
+            apr_pool_destroy(pool);
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, server->server_rec, "No Vim is connected as %s", name);
+            return VIM_REMOTE_TIMEOUT;
+        }
+        apr_thread_cond_timedwait(server->cond, server->mutex,
+                                  apr_time_from_msec(deadline >= 0 ? deadline - now: 1000));
+    }
+
+    conn->refcount++;
+    conn->inflight++;
+    pending.nextPtr = conn->pendings;
+    conn->pendings = &pending;
+    apr_thread_mutex_unlock(server->mutex);
+
+    sent = !sendMessage(conn, msg, msg_len);
+
+    apr_thread_mutex_lock(server->mutex);
+    if (!sent) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server->server_rec, "Failed to send the expression to %s", name);
+        pending.failed = TRUE;
+    }
+    while (!pending.message && !pending.failed) {
+        long long now = monotonic_msec();
+        if (deadline >= 0 && now >= deadline) {
+            retval = VIM_REMOTE_TIMEOUT;
+            break;
+        }
+        apr_thread_cond_timedwait(server->cond, server->mutex,
+                                  apr_time_from_msec(deadline >= 0 ? deadline - now: 1000));
+    }
+
+    {
+        VimChannelServer_Pending **pp;
+        for (pp = &conn->pendings; *pp; pp = &(*pp)->nextPtr) {
+            if (*pp == &pending) {
+                *pp = pending.nextPtr;
+                break;
+            }
+        }
+    }
+    conn->inflight--;
+    releaseConnection(server, conn);
+    apr_thread_mutex_unlock(server->mutex);
+
+    if (!pending.message) {
+        apr_pool_destroy(pool);
+        return retval == VIM_REMOTE_TIMEOUT ? VIM_REMOTE_TIMEOUT: VIM_REMOTE_ERROR;
+    }
+
+    {
+        apr_json_value_t *value, *body;
+        char *json;
+        apr_size_t json_len;
+
+        if (apr_json_decode(&value, pending.message, pending.message_len, pool)
+                || value->type != APR_JSON_ARRAY || value->value.array->nelts != 2) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, server->server_rec, "Malformed message from %s -- %s", name, pending.message);
+            free(pending.message);
+            apr_pool_destroy(pool);
+            return VIM_REMOTE_ERROR;
+        }
+        free(pending.message);
+
+        body = ((apr_json_value_t **)value->value.array->elts)[1];
+        if (body->type == APR_JSON_STRING) {
+            json = (char *)body->value.string.p;
+            json_len = body->value.string.len;
+        } else if (encodeJSON(&json, &json_len, body, pool)) {
+            apr_pool_destroy(pool);
+            return VIM_REMOTE_ERROR;
+        }
+
+        if ((*result = malloc(json_len + 1)) != NULL) {
+            memcpy(*result, json, json_len);
+            (*result)[json_len] = '\0';
+        } else {
+            retval = VIM_REMOTE_ERROR;
+        }
+    }
+    apr_pool_destroy(pool);
+    return retval;
+}
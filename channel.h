@@ -0,0 +1,27 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <httpd.h>
+
+/*
+ * Transport talking to Vim over channels (see ":help channel").  Instead of
+ * going through the X server, Vim instances connect to a socket we listen on
+ * with ch_open() in JSON mode, and expressions are evaluated with
+ * ["expr", {expr}, {id}] messages over the persistent connection.
+ *
+ * A Vim may announce the server name it answers to by sending
+ * ["register", {name}] with ch_sendexpr(); connections that didn't are used
+ * for any name.
+ *
+ * Each Vim makes a single connection, so the connections are all served by
+ * one process, the broker, which the children send their expressions
+ * through (see broker.h).
+ */
+typedef struct VimChannelServer VimChannelServer;
+
+VimChannelServer *VimChannelServer_new(server_rec *server_rec, apr_pool_t *pool, const char *address);
+int VimChannelServer_start(VimChannelServer *server, apr_pool_t *pool);
+char *VimChannelServer_getNames(VimChannelServer *server);
+int VimChannelServer_send(VimChannelServer *server, const char *name, const char *expr, apr_size_t expr_len, char **result, long timeout);
+
+#endif /* CHANNEL_H */
@@ -811,6 +811,18 @@ int convert_setup(vimconv_T *vcp, const char *from, const char *to)
     return convert_setup_ext(vcp, from, 1, to, 1);
 }
 
+/*
+ * Put "vcp" back into its initial shift state, so that a converter set up
+ * once can be used for any number of strings.
+ */
+void convert_reset(vimconv_T *vcp)
+{
+#ifdef USE_ICONV
+    if (vcp->vc_type == CONV_ICONV && vcp->vc_fd != (iconv_t)-1)
+        iconv(vcp->vc_fd, NULL, NULL, NULL, NULL);
+#endif
+}
+
 /*
  * Convert Unicode character "c" to UTF-8 string in "buf[]".
  * Returns the number of bytes.
@@ -70,6 +70,7 @@ int convert_setup_ext(vimconv_T *vcp, const char *from, int from_unicode_is_utf8
 int convert_setup(vimconv_T *vcp, const char *from, const char *to);
 char *string_convert_ext(vimconv_T *vcp, char *ptr, int *lenp, int *unconvlenp);
 char *string_convert(vimconv_T *vcp, char *ptr, int *lenp);
+void convert_reset(vimconv_T *vcp);
 void conv_init();
 void conv_cleanup();
 
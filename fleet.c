@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <unixd.h>
+#include <apr_general.h>
+#include <apr_strings.h>
+#include <apr_shm.h>
+#include <apr_atomic.h>
+#include <apr_signal.h>
+#include <apr_thread_proc.h>
+#include "utils.h"
+#include "fleet.h"
+
+/*
+ * Life cycle of a worker slot.  The supervisor starts a server in an empty
+ * slot either in service straight away or as a standby, puts standbys in
+ * service as needed, and retires servers due for recycling: they are taken
+ * out of service at once but only killed after the grace period, so that
+ * the commands already sent to them can complete.  The slot is empty again
+ * once the server exited.
+ */
+#define WORKER_EMPTY    0
+#define WORKER_STANDBY  1
+#define WORKER_ACTIVE   2
+#define WORKER_RETIRING 3
+
+/* Room for a server name in the shared memory */
+#define FLEET_NAME_SIZE 64
+
+/* How often the supervisor looks after the servers, msec */
+#define FLEET_CHECK_INTERVAL 1000
+
+/* How long a server is given to exit on SIGTERM before SIGKILL */
+#define FLEET_KILL_TIMEOUT apr_time_from_sec(2)
+
+typedef struct VimFleet_Worker {
+    /* One of WORKER_* */
+    volatile apr_uint32_t state;
+    /* Requests sent to the server by every child */
+    volatile apr_uint32_t requests;
+    char name[FLEET_NAME_SIZE];
+} VimFleet_Worker;
+
+/* What the supervisor knows of the process in a slot */
+typedef struct VimFleet_Process {
+    /* NULL when there is no process */
+    apr_pool_t *pool;
+    apr_proc_t proc;
+    /* When a retiring server is sent SIGTERM, and then SIGKILL */
+    apr_time_t killAt;
+    int killed;
+} VimFleet_Process;
+
+struct VimFleet {
+    server_rec *server_rec;
+    apr_shm_t *shm;
+    VimFleet_Worker *workers;
+    int nworkers;
+    VimFleet_Group *groups;
+    int ngroups;
+    /* Slots of the group i are first[i] up to first[i + 1] */
+    int *first;
+    const char *command;
+    int maxRequests;
+    apr_off_t maxRSS;
+    apr_interval_time_t grace;
+
+    /* Supervisor process only */
+    apr_pool_t *pool;
+    VimFleet_Process *processes;
+    apr_uint32_t *serials;
+    apr_file_t *null;
+};
+
+static volatile sig_atomic_t stopping;
+
+/*
+ * Create the shared memory the supervisor publishes the servers through.
+ * Every group gets room for twice its workers plus its standbys, so that
+ * retiring servers never hold up their replacements.  "command" is the
+ * command line starting a server, to which "--servername" is added;
+ * "maxRequests" and "maxRSS", in bytes, are the limits past which a server
+ * is recycled, 0 for none; "grace" is how long a retired server is given to
+ * complete the commands already sent to it.
+ * Meant to be called before forking.  Returns NULL on failure.
+ */
+VimFleet *VimFleet_new(server_rec *server_rec, apr_pool_t *pool, const apr_array_header_t *groups, const char *command, int maxRequests, apr_off_t maxRSS, apr_interval_time_t grace)
+{
+    apr_status_t status;
+    VimFleet *fleet = apr_pcalloc(pool, sizeof(*fleet));
+    int i;
+
+    fleet->server_rec = server_rec;
+    fleet->ngroups = groups->nelts;
+    fleet->groups = apr_pmemdup(pool, groups->elts, sizeof(VimFleet_Group) * groups->nelts);
+    fleet->first = apr_palloc(pool, sizeof(int) * (groups->nelts + 1));
+    fleet->nworkers = 0;
+    for (i = 0; i < fleet->ngroups; i++) {
+        fleet->first[i] = fleet->nworkers;
+        fleet->nworkers += fleet->groups[i].workers * 2 + fleet->groups[i].standbys;
+    }
+    fleet->first[i] = fleet->nworkers;
+    fleet->command = command;
+    fleet->maxRequests = maxRequests;
+    fleet->maxRSS = maxRSS;
+    fleet->grace = grace;
+    fleet->pool = NULL;
+    fleet->processes = NULL;
+
+    if ((status = apr_shm_create(&fleet->shm, sizeof(VimFleet_Worker) * fleet->nworkers, NULL, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot create the shared memory for the Vim fleet");
+        return NULL;
+    }
+    fleet->workers = apr_shm_baseaddr_get(fleet->shm);
+    for (i = 0; i < fleet->nworkers; i++) {
+        fleet->workers[i].state = WORKER_EMPTY;
+        fleet->workers[i].requests = 0;
+        fleet->workers[i].name[0] = '\0';
+    }
+    return fleet;
+}
+
+/*
+ * Return the slot of the server "name", or NULL if it's none of ours.
+ */
+static VimFleet_Worker *findWorker(VimFleet *fleet, const char *name)
+{
+    int i;
+
+    for (i = 0; i < fleet->nworkers; i++) {
+        VimFleet_Worker *worker = &fleet->workers[i];
+        if (worker->name[0] && strncasecmp(worker->name, name, FLEET_NAME_SIZE) == 0)
+            return worker;
+    }
+    return NULL;
+}
+
+/*
+ * Return FALSE if "name" is a server of the fleet that isn't in service,
+ * that is a standby or one being retired.  Servers the fleet knows nothing
+ * of are left alone.
+ */
+int VimFleet_isInService(VimFleet *fleet, const char *name)
+{
+    VimFleet_Worker *worker = findWorker(fleet, name);
+
+    return !worker || apr_atomic_read32(&worker->state) == WORKER_ACTIVE;
+}
+
+/*
+ * Account for a request sent to the server "name", if it's ours.
+ */
+void VimFleet_count(VimFleet *fleet, const char *name)
+{
+    VimFleet_Worker *worker = findWorker(fleet, name);
+
+    if (worker)
+        apr_atomic_inc32(&worker->requests);
+}
+
+/*
+ * Return the resident set size of the process "pid" in bytes, or 0 if it
+ * can't be told.
+ */
+static apr_off_t getRSS(pid_t pid)
+{
+#ifdef __linux__
+    char path[64];
+    unsigned long size, resident;
+    FILE *fp;
+    int n;
+
+    apr_snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    if (!(fp = fopen(path, "r")))
+        return 0;
+    n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (n != 2)
+        return 0;
+    return (apr_off_t)resident * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Start a server of the group "g" in the empty slot "i", leaving it in the
+ * state "state".
+ * Return 0 for OK, -1 for error.
+ */
+static int spawnWorker(VimFleet *fleet, int g, int i, apr_uint32_t state)
+{
+    VimFleet_Worker *worker = &fleet->workers[i];
+    VimFleet_Process *process = &fleet->processes[i];
+    apr_procattr_t *attr;
+    char **args;
+    const char **argv;
+    int argc;
+    apr_status_t status;
+
+    if ((status = apr_pool_create(&process->pool, fleet->pool))) {
+        process->pool = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, fleet->server_rec, "Cannot start a Vim server");
+        return -1;
+    }
+
+    apr_snprintf(worker->name, sizeof(worker->name), "%s%u", fleet->groups[g].prefix, ++fleet->serials[g]);
+    apr_tokenize_to_argv(fleet->command, &args, process->pool);
+    for (argc = 0; args[argc]; argc++)
+        ;
+    argv = apr_palloc(process->pool, sizeof(*argv) * (argc + 3));
+    memcpy(argv, args, sizeof(*argv) * argc);
+    argv[argc++] = "--servername";
+    argv[argc++] = worker->name;
+    argv[argc] = NULL;
+
+    /* Vim reads keys from the pipe, where nothing ever comes, and paints
+     * the screen to /dev/null */
+    if ((status = apr_procattr_create(&attr, process->pool))
+            || (status = apr_procattr_cmdtype_set(attr, APR_PROGRAM_PATH))
+            || (status = apr_procattr_io_set(attr, APR_FULL_BLOCK, APR_NO_PIPE, APR_NO_PIPE))
+            || (status = apr_procattr_child_out_set(attr, fleet->null, NULL))
+            || (status = apr_procattr_child_err_set(attr, fleet->null, NULL))
+            || (status = apr_proc_create(&process->proc, argv[0], (const char * const *)argv, NULL, attr, process->pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, fleet->server_rec, "Cannot start the Vim server %s with \"%s\"", worker->name, fleet->command);
+        apr_pool_destroy(process->pool);
+        process->pool = NULL;
+        return -1;
+    }
+    process->killed = FALSE;
+    process->killAt = 0;
+
+    worker->requests = 0;
+    apr_atomic_set32(&worker->state, state);
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, fleet->server_rec, "Started the Vim server %s (pid %d)%s", worker->name, (int)process->proc.pid, state == WORKER_STANDBY ? " as a standby": "");
+    return 0;
+}
+
+/*
+ * Empty the slot "i" if its server exited.
+ */
+static void reapWorker(VimFleet *fleet, int i)
+{
+    VimFleet_Worker *worker = &fleet->workers[i];
+    VimFleet_Process *process = &fleet->processes[i];
+    apr_exit_why_e why;
+    int code;
+
+    if (!process->pool || apr_proc_wait(&process->proc, &code, &why, APR_NOWAIT) != APR_CHILD_DONE)
+        return;
+    if (worker->state != WORKER_RETIRING)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, fleet->server_rec, "Vim server %s (pid %d) exited unexpectedly with %s %d", worker->name, (int)process->proc.pid, why == APR_PROC_EXIT ? "status": "signal", code);
+    apr_atomic_set32(&worker->state, WORKER_EMPTY);
+    apr_pool_destroy(process->pool);
+    process->pool = NULL;
+}
+
+/*
+ * Send SIGTERM to the server in the slot "i", and SIGKILL should it still
+ * be there after a while.
+ */
+static void killWorker(VimFleet *fleet, int i, apr_time_t now)
+{
+    VimFleet_Process *process = &fleet->processes[i];
+
+    if (!process->pool || now < process->killAt)
+        return;
+    apr_proc_kill(&process->proc, process->killed ? SIGKILL: SIGTERM);
+    process->killed = TRUE;
+    process->killAt = now + FLEET_KILL_TIMEOUT;
+}
+
+/*
+ * Return TRUE if the server in the slot "i" is due for recycling.
+ */
+static int isWornOut(VimFleet *fleet, int i)
+{
+    VimFleet_Worker *worker = &fleet->workers[i];
+    apr_off_t rss;
+
+    if (fleet->maxRequests > 0 && apr_atomic_read32(&worker->requests) >= (apr_uint32_t)fleet->maxRequests) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, fleet->server_rec, "Recycling the Vim server %s after %u requests", worker->name, apr_atomic_read32(&worker->requests));
+        return TRUE;
+    }
+    if (fleet->maxRSS > 0 && (rss = getRSS(fleet->processes[i].proc.pid)) > fleet->maxRSS) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, fleet->server_rec, "Recycling the Vim server %s grown to %" APR_OFF_T_FMT " bytes", worker->name, rss);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Bring the group "g" back to its numbers of servers in service and
+ * standbys, putting standbys in service first and only starting servers
+ * cold when there are none.
+ */
+static void superviseGroup(VimFleet *fleet, int g)
+{
+    const VimFleet_Group *group = &fleet->groups[g];
+    int first = fleet->first[g], last = fleet->first[g + 1];
+    int active = 0, standbys = 0, i;
+    apr_time_t now = apr_time_now();
+
+    for (i = first; i < last; i++) {
+        VimFleet_Worker *worker = &fleet->workers[i];
+
+        reapWorker(fleet, i);
+        switch (worker->state) {
+        case WORKER_ACTIVE:
+            if (!isWornOut(fleet, i)) {
+                active++;
+                break;
+            }
+            apr_atomic_set32(&worker->state, WORKER_RETIRING);
+            fleet->processes[i].killAt = now + fleet->grace;
+            break;
+        case WORKER_STANDBY:
+            standbys++;
+            break;
+        case WORKER_RETIRING:
+            killWorker(fleet, i, now);
+            break;
+        }
+    }
+
+    for (i = first; i < last && active < group->workers; i++) {
+        VimFleet_Worker *worker = &fleet->workers[i];
+        if (worker->state != WORKER_STANDBY)
+            continue;
+        apr_atomic_set32(&worker->state, WORKER_ACTIVE);
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, fleet->server_rec, "Put the standby Vim server %s in service", worker->name);
+        active++;
+        standbys--;
+    }
+    for (i = first; i < last && active < group->workers; i++) {
+        if (fleet->workers[i].state == WORKER_EMPTY && spawnWorker(fleet, g, i, WORKER_ACTIVE) == 0)
+            active++;
+    }
+    for (i = first; i < last && standbys < group->standbys; i++) {
+        if (fleet->workers[i].state == WORKER_EMPTY && spawnWorker(fleet, g, i, WORKER_STANDBY) == 0)
+            standbys++;
+    }
+}
+
+/*
+ * Take every server down, waiting a little for them to exit.
+ */
+static void stopWorkers(VimFleet *fleet)
+{
+    apr_time_t now = apr_time_now(), until = now + FLEET_KILL_TIMEOUT;
+    int i, left;
+
+    for (i = 0; i < fleet->nworkers; i++) {
+        if (fleet->processes[i].pool)
+            apr_atomic_set32(&fleet->workers[i].state, WORKER_RETIRING);
+        fleet->processes[i].killAt = 0;
+        killWorker(fleet, i, now);
+    }
+    do {
+        left = 0;
+        for (i = 0; i < fleet->nworkers; i++) {
+            reapWorker(fleet, i);
+            if (fleet->processes[i].pool)
+                left++;
+        }
+        if (left)
+            apr_sleep(apr_time_from_msec(100));
+    } while (left && apr_time_now() < until);
+
+    for (i = 0; i < fleet->nworkers; i++) {
+        killWorker(fleet, i, until);
+        reapWorker(fleet, i);
+    }
+}
+
+static void stopSupervisor(int sig)
+{
+    stopping = TRUE;
+}
+
+/*
+ * The body of the supervisor process.  Never returns.
+ */
+static void runSupervisor(VimFleet *fleet, pid_t parent, const char *display)
+{
+    apr_status_t status;
+    int i;
+
+    stopping = FALSE;
+    apr_signal(SIGTERM, stopSupervisor);
+    apr_signal(SIGHUP, stopSupervisor);
+    apr_signal(SIGUSR1, SIG_IGN);
+    apr_signal(SIGPIPE, SIG_IGN);
+
+    if (ap_unixd_setup_child())
+        _exit(1);
+
+    if (apr_pool_create(&fleet->pool, NULL))
+        _exit(1);
+    if ((status = apr_file_open(&fleet->null, "/dev/null", APR_FOPEN_WRITE, APR_OS_DEFAULT, fleet->pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, fleet->server_rec, "Cannot open /dev/null for the Vim servers");
+        _exit(1);
+    }
+    if (display)
+        setenv("DISPLAY", display, 1);
+    fleet->processes = apr_pcalloc(fleet->pool, sizeof(*fleet->processes) * fleet->nworkers);
+    fleet->serials = apr_pcalloc(fleet->pool, sizeof(*fleet->serials) * fleet->ngroups);
+
+    /* Exit along with httpd */
+    while (!stopping && getppid() == parent) {
+        for (i = 0; i < fleet->ngroups; i++)
+            superviseGroup(fleet, i);
+        apr_sleep(apr_time_from_msec(FLEET_CHECK_INTERVAL));
+    }
+    stopWorkers(fleet);
+    _exit(0);
+}
+
+/*
+ * Fork the supervisor process, which starts the servers against the X
+ * display "display".  It is stopped along with its servers when "pool" is
+ * cleared, which is on every restart.
+ * Return 0 for OK, -1 for error.
+ */
+int VimFleet_start(VimFleet *fleet, apr_pool_t *pool, const char *display)
+{
+    apr_status_t status;
+    apr_proc_t *proc = apr_pcalloc(pool, sizeof(*proc));
+    pid_t parent = getpid();
+
+    status = apr_proc_fork(proc, pool);
+    if (status == APR_INCHILD)
+        runSupervisor(fleet, parent, display);
+    if (status != APR_INPARENT) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, fleet->server_rec, "Cannot start the Vim fleet supervisor");
+        return -1;
+    }
+    apr_pool_note_subprocess(pool, proc, APR_KILL_AFTER_TIMEOUT);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <httpd.h>
+
+/*
+ * Vim servers started and looked after by mod_vim itself.  A supervisor
+ * process forked from the parent keeps "workers" servers in service for
+ * every group, named after the group's prefix, plus "standbys" servers
+ * started ahead of time which are put in service as soon as a worker dies
+ * or is recycled.  Workers are recycled once they served a given number of
+ * requests or grew past a given size.  Which servers are in service is
+ * kept in shared memory, where the children look it up.
+ */
+typedef struct VimFleet VimFleet;
+
+typedef struct VimFleet_Group {
+    const char *prefix;
+    int workers;
+    int standbys;
+} VimFleet_Group;
+
+VimFleet *VimFleet_new(server_rec *server_rec, apr_pool_t *pool, const apr_array_header_t *groups, const char *command, int maxRequests, apr_off_t maxRSS, apr_interval_time_t grace);
+int VimFleet_start(VimFleet *fleet, apr_pool_t *pool, const char *display);
+int VimFleet_isInService(VimFleet *fleet, const char *name);
+void VimFleet_count(VimFleet *fleet, const char *name);
+
+#endif /* FLEET_H */
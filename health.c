@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include "utils.h"
+#include "remote.h"
+#include "health.h"
+
+/*
+ * States of a breaker.  Closed lets every request through; open turns them
+ * all away; half-open lets a single request through to see whether the
+ * server is back, which is only needed when there is no prober to tell.
+ */
+#define BREAKER_CLOSED      0
+#define BREAKER_OPEN        1
+#define BREAKER_HALF_OPEN   2
+
+/* Weight of a new sample in the average response time, as 1/n */
+#define HEALTH_EWMA_WEIGHT  5
+
+struct VimHealth_Server {
+    const char *name;
+    /* One of BREAKER_* */
+    volatile apr_uint32_t state;
+    /* Failures in a row */
+    volatile apr_uint32_t failures;
+    /* Requests of this child being sent to the server or awaiting its
+     * result */
+    volatile apr_uint32_t inFlight;
+    /* When the breaker may let a request through again, if not closed;
+     * guarded by the mutex */
+    apr_time_t retryAt;
+    /* Average response time, 0 until known; guarded by the mutex */
+    apr_interval_time_t latency;
+    struct VimHealth_Server *nextPtr;
+};
+
+struct VimHealth {
+    server_rec *server_rec;
+    apr_pool_t *pool;
+    int threshold;
+    apr_interval_time_t cooldown;
+
+    /* Servers by lowercased name.  Entries are never removed, so they can
+     * be used without holding the mutex. */
+    apr_hash_t *servers;
+    VimHealth_Server *list;
+    apr_thread_mutex_t *mutex;
+
+    /* The prober, if started */
+    apr_thread_t *prober;
+    apr_thread_cond_t *cond;
+    volatile int stopping;
+    apr_interval_time_t interval;
+    long timeout;
+    const char *expr;
+    VimHealth_Probe probe;
+    void *data;
+};
+
+/*
+ * Create the registry of server health.  "threshold" is the number of
+ * failures in a row that opens a breaker, 0 for never; "cooldown" is how
+ * long a breaker stays open when there is no prober.
+ * Returns NULL for error.
+ */
+VimHealth *VimHealth_new(server_rec *server_rec, apr_pool_t *pool, int threshold, apr_interval_time_t cooldown)
+{
+    VimHealth *health = apr_pcalloc(pool, sizeof(*health));
+
+    health->server_rec = server_rec;
+    health->pool = pool;
+    health->threshold = threshold;
+    health->cooldown = cooldown;
+    health->servers = apr_hash_make(pool);
+    health->list = NULL;
+    health->prober = NULL;
+    health->stopping = FALSE;
+    if (apr_thread_mutex_create(&health->mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+            || apr_thread_cond_create(&health->cond, pool))
+        return NULL;
+    return health;
+}
+
+/*
+ * Return the entry of the server "name", creating it on first use.
+ * Returns NULL when out of memory.
+ */
+VimHealth_Server *VimHealth_getServer(VimHealth *health, const char *name)
+{
+    VimHealth_Server *server;
+    char *key;
+    size_t i, name_len = strlen(name);
+
+    key = malloc(name_len + 1);
+    if (!key)
+        return NULL;
+    for (i = 0; i <= name_len; i++)
+        key[i] = tolower(((unsigned char *)name)[i]);
+
+    apr_thread_mutex_lock(health->mutex);
+    server = apr_hash_get(health->servers, key, name_len);
+    if (!server) {
+        server = apr_pcalloc(health->pool, sizeof(*server));
+        server->name = apr_pstrdup(health->pool, name);
+        server->state = BREAKER_CLOSED;
+        server->failures = 0;
+        server->inFlight = 0;
+        server->retryAt = 0;
+        server->latency = 0;
+        server->nextPtr = health->list;
+        health->list = server;
+        apr_hash_set(health->servers, apr_pstrdup(health->pool, key), name_len, server);
+    }
+    apr_thread_mutex_unlock(health->mutex);
+    free(key);
+    return server;
+}
+
+/*
+ * Return TRUE if a request may be sent to "server".  Otherwise store in
+ * "*retry_after" how long the client had better wait before trying again.
+ */
+int VimHealth_allow(VimHealth *health, VimHealth_Server *server, apr_interval_time_t *retry_after)
+{
+    apr_time_t now;
+    int retval = FALSE;
+
+    if (apr_atomic_read32(&server->state) == BREAKER_CLOSED)
+        return TRUE;
+
+    now = apr_time_now();
+    apr_thread_mutex_lock(health->mutex);
+    if (health->prober) {
+        /* the next probe tells */
+        *retry_after = health->interval;
+    } else if (now >= server->retryAt) {
+        /* let this one through to find out; should it never report back,
+         * another one gets its turn after the cooldown */
+        apr_atomic_set32(&server->state, BREAKER_HALF_OPEN);
+        server->retryAt = now + health->cooldown;
+        retval = TRUE;
+    } else {
+        *retry_after = server->retryAt > now ? server->retryAt - now: health->cooldown;
+    }
+    apr_thread_mutex_unlock(health->mutex);
+    return retval;
+}
+
+/*
+ * Account for a request of this child about to be sent to "server".  Must be
+ * matched by a call to VimHealth_record() once it completed.
+ */
+void VimHealth_begin(VimHealth *health, VimHealth_Server *server)
+{
+    apr_atomic_inc32(&server->inFlight);
+}
+
+/*
+ * Account for a command sent to "server", by a request or a probe, that
+ * completed with "result", one of VIM_REMOTE_*.
+ */
+static void recordResult(VimHealth *health, VimHealth_Server *server, int result)
+{
+    apr_uint32_t failures;
+
+    /* given up on by the client; says nothing about the server */
+    if (result == VIM_REMOTE_CANCELLED)
+        return;
+
+    /* a failed expression still took a working server to evaluate */
+    if (result == VIM_REMOTE_OK || result == VIM_REMOTE_EVAL_ERROR) {
+        apr_atomic_set32(&server->failures, 0);
+        apr_thread_mutex_lock(health->mutex);
+        if (server->state != BREAKER_CLOSED) {
+            apr_atomic_set32(&server->state, BREAKER_CLOSED);
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, health->server_rec, "Vim server %s is back (%" APR_TIME_T_FMT "ms)", server->name, apr_time_as_msec(server->latency));
+        }
+        apr_thread_mutex_unlock(health->mutex);
+        return;
+    }
+
+    failures = apr_atomic_inc32(&server->failures) + 1;
+    if (health->threshold <= 0)
+        return;
+
+    apr_thread_mutex_lock(health->mutex);
+    if (server->state == BREAKER_HALF_OPEN
+            || (server->state == BREAKER_CLOSED && failures >= (apr_uint32_t)health->threshold)) {
+        if (server->state == BREAKER_CLOSED)
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, health->server_rec, "Vim server %s failed %u times in a row; turning requests away", server->name, failures);
+        server->retryAt = apr_time_now() + health->cooldown;
+        apr_atomic_set32(&server->state, BREAKER_OPEN);
+    }
+    apr_thread_mutex_unlock(health->mutex);
+}
+
+/*
+ * Account for the request started with VimHealth_begin() on "server" that
+ * completed with "result", one of VIM_REMOTE_*, after "latency".
+ */
+void VimHealth_record(VimHealth *health, VimHealth_Server *server, int result, apr_interval_time_t latency)
+{
+    apr_atomic_dec32(&server->inFlight);
+    /* Only requests make the average: a probe is far cheaper than what
+     * they usually ask for */
+    if (result == VIM_REMOTE_OK) {
+        apr_thread_mutex_lock(health->mutex);
+        if (server->latency == 0)
+            server->latency = latency;
+        else
+            server->latency += (latency - server->latency) / HEALTH_EWMA_WEIGHT;
+        apr_thread_mutex_unlock(health->mutex);
+    }
+    recordResult(health, server, result);
+}
+
+/*
+ * Return FALSE if requests for the server "name" are being turned away.
+ * Servers never heard of are taken to be available.
+ */
+int VimHealth_isAvailable(VimHealth *health, const char *name)
+{
+    VimHealth_Server *server = VimHealth_getServer(health, name);
+    int retval;
+
+    if (!server || apr_atomic_read32(&server->state) == BREAKER_CLOSED)
+        return TRUE;
+    /* without a prober, an expired breaker lets a request find out */
+    apr_thread_mutex_lock(health->mutex);
+    retval = !health->prober && apr_time_now() >= server->retryAt;
+    apr_thread_mutex_unlock(health->mutex);
+    return retval;
+}
+
+/*
+ * Return the average response time of "server" to the requests, 0 until
+ * known.
+ */
+apr_interval_time_t VimHealth_getLatency(VimHealth *health, VimHealth_Server *server)
+{
+    apr_interval_time_t latency;
+
+    apr_thread_mutex_lock(health->mutex);
+    latency = server->latency;
+    apr_thread_mutex_unlock(health->mutex);
+    return latency;
+}
+
+static void *APR_THREAD_FUNC proberThread(apr_thread_t *thread, void *data)
+{
+    VimHealth *health = data;
+
+    apr_thread_mutex_lock(health->mutex);
+    while (!health->stopping) {
+        VimHealth_Server *server, *list;
+
+        apr_thread_cond_timedwait(health->cond, health->mutex, health->interval);
+        if (health->stopping)
+            break;
+
+        /* entries are only ever prepended, so the list can be walked
+         * without the mutex from a snapshot of its head */
+        list = health->list;
+        apr_thread_mutex_unlock(health->mutex);
+
+        for (server = list; server && !health->stopping; server = server->nextPtr) {
+            int result = health->probe(health->data, server->name, health->expr, health->timeout);
+
+            /* a server busy with our own requests may just be slow to get
+             * round to the probe; those requests tell how it is doing */
+            if (result == VIM_REMOTE_TIMEOUT && apr_atomic_read32(&server->inFlight) > 0)
+                continue;
+            recordResult(health, server, result);
+        }
+
+        apr_thread_mutex_lock(health->mutex);
+    }
+    apr_thread_mutex_unlock(health->mutex);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stopProber(void *data)
+{
+    VimHealth *health = data;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(health->mutex);
+    health->stopping = TRUE;
+    apr_thread_cond_signal(health->cond);
+    apr_thread_mutex_unlock(health->mutex);
+    apr_thread_join(&rv, health->prober);
+    health->prober = NULL;
+    return APR_SUCCESS;
+}
+
+/*
+ * Start a thread evaluating "expr" with "probe" on every server known so
+ * far, once every "interval", waiting "timeout" milliseconds at most for
+ * each.  The thread is stopped when "pool" is cleared.
+ * Return 0 for OK, -1 for error.
+ */
+int VimHealth_startProber(VimHealth *health, apr_pool_t *pool, apr_interval_time_t interval, long timeout, const char *expr, VimHealth_Probe probe, void *data)
+{
+    apr_status_t status;
+
+    health->interval = interval;
+    health->timeout = timeout;
+    health->expr = expr;
+    health->probe = probe;
+    health->data = data;
+    if ((status = apr_thread_create(&health->prober, NULL, proberThread, health, pool))) {
+        health->prober = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, health->server_rec, "Cannot start the Vim health prober");
+        return -1;
+    }
+    apr_pool_cleanup_register(pool, health, stopProber, apr_pool_cleanup_null);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <httpd.h>
+
+/*
+ * Health of the Vim servers as seen by this child, with a circuit breaker
+ * per server.  Once a server failed "threshold" times in a row its breaker
+ * opens and requests for it are turned away at once instead of each
+ * waiting for the timeout.  A background thread probes every server known
+ * so far with a cheap expression, which closes the breaker again as soon
+ * as the server answers.  An average of the response times to requests is
+ * kept as well.
+ */
+typedef struct VimHealth VimHealth;
+typedef struct VimHealth_Server VimHealth_Server;
+
+/*
+ * Evaluates "expr" on the server "name", waiting "timeout" milliseconds at
+ * most.  Returns one of VIM_REMOTE_*.
+ */
+typedef int (*VimHealth_Probe)(void *data, const char *name, const char *expr, long timeout);
+
+VimHealth *VimHealth_new(server_rec *server_rec, apr_pool_t *pool, int threshold, apr_interval_time_t cooldown);
+int VimHealth_startProber(VimHealth *health, apr_pool_t *pool, apr_interval_time_t interval, long timeout, const char *expr, VimHealth_Probe probe, void *data);
+VimHealth_Server *VimHealth_getServer(VimHealth *health, const char *name);
+int VimHealth_allow(VimHealth *health, VimHealth_Server *server, apr_interval_time_t *retry_after);
+void VimHealth_begin(VimHealth *health, VimHealth_Server *server);
+void VimHealth_record(VimHealth *health, VimHealth_Server *server, int result, apr_interval_time_t latency);
+int VimHealth_isAvailable(VimHealth *health, const char *name);
+apr_interval_time_t VimHealth_getLatency(VimHealth *health, VimHealth_Server *server);
+
+#endif /* HEALTH_H */
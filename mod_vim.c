@@ -42,42 +42,175 @@
 #include "http_config.h"
 #include "http_protocol.h"
 #include "http_log.h"
+#include "util_cookies.h"
 #include "ap_config.h"
+#include "apr_thread_proc.h"
 #include "conv.h"
 #include "remote.h"
+#include "channel.h"
+#include "nvim.h"
+#include "broker.h"
+#include "fleet.h"
+#include "health.h"
+#include "async.h"
+#include "retry.h"
+#include "pool.h"
+#include "utils.h"
 #include "apr_json.h"
 
+typedef enum mod_vim_transport {
+    MOD_VIM_TRANSPORT_X11,
+    MOD_VIM_TRANSPORT_CHANNEL,
+    MOD_VIM_TRANSPORT_NVIM
+} mod_vim_transport;
+
+/* Where VimAffinityKey takes the key from */
+typedef enum mod_vim_affinity_source {
+    MOD_VIM_AFFINITY_UNSET = -1,
+    MOD_VIM_AFFINITY_NONE,
+    MOD_VIM_AFFINITY_COOKIE,
+    MOD_VIM_AFFINITY_HEADER,
+    MOD_VIM_AFFINITY_URI
+} mod_vim_affinity_source;
+
+/* Values of VimHedgeDelay besides durations */
+#define MOD_VIM_HEDGE_UNSET (-1)
+#define MOD_VIM_HEDGE_AUTO  (-2)
+
+/* With VimHedgeDelay auto, how many times the average response time of
+ * the server to wait before hedging */
+#define MOD_VIM_HEDGE_AUTO_FACTOR 3
+
 typedef struct mod_vim_server_config {
     const char *vim_version;
     const char *encoding;
     const char *server_name;
+    VimServerPool *server_pool;
     const char *expr;
+    const char *function;
+    apr_interval_time_t timeout;
+    mod_vim_transport transport;
+    const char *channel_address;
+    apr_interval_time_t health_check_interval;
+    apr_interval_time_t health_check_timeout;
+    const char *health_check_expr;
+    int breaker_threshold;
+    apr_interval_time_t breaker_cooldown;
+    int async_queue_size;
+    /* Set when some location of the server has VimAsync on */
+    int async_used;
+    /* Set when some location of the server has VimHedgeDelay auto */
+    int hedge_auto_used;
+    int retries;
+    apr_interval_time_t retry_backoff;
+    int retry_budget;
+    int broker_slots;
+    int broker_slot_size;
 #ifdef USE_X11
     const char *display; 
+    int thread_connections;
+    int dispatcher_thread;
+    int broker;
+    const char *cancel_expr;
+    apr_array_header_t *fleet_groups;
+    const char *fleet_command;
+    int fleet_max_requests;
+    int fleet_max_rss;
+    apr_interval_time_t hedge_delay;
+    int hedge_ratio;
 #endif
 } mod_vim_server_config;
 
 typedef struct mod_vim_dir_config {
     const char *server_name;
+    VimServerPool *server_pool;
     const char *expr;
+    const char *function;
+    apr_interval_time_t timeout;
+    int async;
+    int retries;
+    mod_vim_affinity_source affinity_source;
+    /* The cookie or header name, or the number of path segments */
+    const char *affinity_name;
+    int affinity_segments;
+#ifdef USE_X11
+    int stream;
+    int deferred;
+    apr_interval_time_t hedge_delay;
+#endif
 } mod_vim_dir_config;
 
 static void mod_vim_register_hooks(apr_pool_t *p);
 static const char *mod_vim_set_string_slot(cmd_parms *cmd, void *dummy, const char *arg);
 static const char *mod_vim_set_server_name(cmd_parms *cmd, void *dummy, const char *arg);
 static const char *mod_vim_set_expr(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_function(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_add_server_pool_member(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_server_pool_prefix(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_server_pool_policy(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_timeout(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_transport(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_duration_slot(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_breaker_threshold(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_async(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_set_async_queue_size(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_retries(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_retry_budget(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_affinity_key(cmd_parms *cmd, void *dummy, const char *source, const char *name);
+static const char *mod_vim_set_broker_int(cmd_parms *cmd, void *dummy, const char *arg);
+#ifdef USE_X11
+static const char *mod_vim_set_thread_connections(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_set_dispatcher_thread(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_set_broker(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_set_stream(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_set_deferred(cmd_parms *cmd, void *dummy, int flag);
+static const char *mod_vim_add_fleet_group(cmd_parms *cmd, void *dummy, const char *prefix, const char *workers, const char *standbys);
+static const char *mod_vim_set_fleet_int(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_hedge_delay(cmd_parms *cmd, void *dummy, const char *arg);
+static const char *mod_vim_set_hedge_ratio(cmd_parms *cmd, void *dummy, const char *arg);
+#endif
 
 /* global thingies */
+static VimRemotingClient *client;
 #ifdef USE_X11
-static Display *dpy;
+/* Per-thread clients when VimThreadConnections is on */
+static apr_threadkey_t *client_key;
+static server_rec *main_server;
+static VimFleet *fleet;
+/* Bounds the share of requests of this child that are hedged */
+static VimRetryBudget *hedge_budget;
 #endif
-static VimRemotingClient *client;
+static mod_vim_transport transport;
+/* Set when VimBroker is on, and always with the channel transport; the
+ * children have no connection to Vim of their own then */
+static VimBroker *broker;
+static VimNvimClient *nvim;
+/* Health of the servers, unless the prober and the breaker are both off
+ * and no location needs the response times for VimHedgeDelay auto */
+static VimHealth *health;
+/* Expressions of VimAsync locations waiting to be sent */
+static VimAsyncQueue *async_queue;
+/* Bounds the retries of this child */
+static VimRetryBudget *retry_budget;
 
 static void *mod_vim_create_dir_config(apr_pool_t *p, char *dir)
 {
     mod_vim_dir_config *config = apr_pcalloc(p, sizeof(*config));
     config->server_name = NULL;
+    config->server_pool = NULL;
     config->expr = NULL;
+    config->function = NULL;
+    config->timeout = -1;
+    config->async = -1;
+    config->retries = -1;
+    config->affinity_source = MOD_VIM_AFFINITY_UNSET;
+    config->affinity_name = NULL;
+    config->affinity_segments = 0;
+#ifdef USE_X11
+    config->stream = -1;
+    config->deferred = -1;
+    config->hedge_delay = MOD_VIM_HEDGE_UNSET;
+#endif
     return config;
 }
 
@@ -87,10 +220,45 @@ static void *mod_vim_merge_dir_config(apr_pool_t *p, void *base, void *overrides
                        *overriding_config = overrides,
                        *new_config = apr_pcalloc(p, sizeof(*new_config));
 
-    new_config->server_name = overriding_config->server_name ?
-            overriding_config->server_name: base_config->server_name;
-    new_config->expr = overriding_config->expr ?
-            overriding_config->expr: base_config->expr;
+    /* VimServerName and VimServerPool override each other */
+    if (overriding_config->server_name || overriding_config->server_pool) {
+        new_config->server_name = overriding_config->server_name;
+        new_config->server_pool = overriding_config->server_pool;
+    } else {
+        new_config->server_name = base_config->server_name;
+        new_config->server_pool = base_config->server_pool;
+    }
+    /* so do VimExpr and VimFunction */
+    if (overriding_config->expr || overriding_config->function) {
+        new_config->expr = overriding_config->expr;
+        new_config->function = overriding_config->function;
+    } else {
+        new_config->expr = base_config->expr;
+        new_config->function = base_config->function;
+    }
+    new_config->timeout = overriding_config->timeout >= 0 ?
+            overriding_config->timeout: base_config->timeout;
+    new_config->async = overriding_config->async >= 0 ?
+            overriding_config->async: base_config->async;
+    new_config->retries = overriding_config->retries >= 0 ?
+            overriding_config->retries: base_config->retries;
+    if (overriding_config->affinity_source != MOD_VIM_AFFINITY_UNSET) {
+        new_config->affinity_source = overriding_config->affinity_source;
+        new_config->affinity_name = overriding_config->affinity_name;
+        new_config->affinity_segments = overriding_config->affinity_segments;
+    } else {
+        new_config->affinity_source = base_config->affinity_source;
+        new_config->affinity_name = base_config->affinity_name;
+        new_config->affinity_segments = base_config->affinity_segments;
+    }
+#ifdef USE_X11
+    new_config->stream = overriding_config->stream >= 0 ?
+            overriding_config->stream: base_config->stream;
+    new_config->deferred = overriding_config->deferred >= 0 ?
+            overriding_config->deferred: base_config->deferred;
+    new_config->hedge_delay = overriding_config->hedge_delay != MOD_VIM_HEDGE_UNSET ?
+            overriding_config->hedge_delay: base_config->hedge_delay;
+#endif
 
     return new_config;
 }
@@ -101,8 +269,36 @@ static void *mod_vim_create_server_config(apr_pool_t *p, server_rec *s)
     config->vim_version = "7.2";
     config->encoding = "UTF-8";
     config->server_name = "VIM";
+    config->server_pool = NULL;
+    config->timeout = apr_time_from_sec(600);
+    config->transport = MOD_VIM_TRANSPORT_X11;
+    config->channel_address = NULL;
+    config->health_check_interval = 0;
+    config->health_check_timeout = apr_time_from_sec(2);
+    config->health_check_expr = "1";
+    config->breaker_threshold = 0;
+    config->breaker_cooldown = apr_time_from_sec(10);
+    config->async_queue_size = 1024;
+    config->async_used = FALSE;
+    config->hedge_auto_used = FALSE;
+    config->retries = 0;
+    config->retry_backoff = apr_time_from_msec(50);
+    config->retry_budget = 20;
+    config->broker_slots = 64;
+    config->broker_slot_size = 65536;
+    config->function = NULL;
     config->expr = "\"[200,{\\\"Content-Type\\\":\\\"text/html;charset=us-ascii\\\"},[\\\"<html><body><h1>It works!</h1></body></html>\\\"]]\"";
     config->display = getenv("DISPLAY");
+    config->thread_connections = 0;
+    config->dispatcher_thread = 0;
+    config->broker = 0;
+    config->cancel_expr = NULL;
+    config->fleet_groups = apr_array_make(p, 0, sizeof(VimFleet_Group));
+    config->fleet_command = "vim -n -N -i NONE";
+    config->fleet_max_requests = 0;
+    config->fleet_max_rss = 0;
+    config->hedge_delay = 0;
+    config->hedge_ratio = 5;
     return config;
 }
 
@@ -115,7 +311,189 @@ static const command_rec mod_vim_cmds[] = {
         RSRC_CONF,                          /* where available */
         "Specifies a X Display number"  /* directive description */
     ),
+    AP_INIT_FLAG(
+        "VimThreadConnections",
+        mod_vim_set_thread_connections,
+        NULL,
+        RSRC_CONF,
+        "On to give every thread its own connection to the X display"
+    ),
+    AP_INIT_FLAG(
+        "VimDispatcherThread",
+        mod_vim_set_dispatcher_thread,
+        NULL,
+        RSRC_CONF,
+        "On to have a single thread do all the X I/O for the others"
+    ),
+    AP_INIT_FLAG(
+        "VimBroker",
+        mod_vim_set_broker,
+        NULL,
+        RSRC_CONF,
+        "On to have a separate process talk to X on behalf of every child"
+    ),
+    AP_INIT_FLAG(
+        "VimStream",
+        mod_vim_set_stream,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "On to let Vim send the response piece by piece with server2client(); needs the x11 transport without VimBroker"
+    ),
+    AP_INIT_FLAG(
+        "VimDeferred",
+        mod_vim_set_deferred,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "On to let VimExpr return at once and Vim send the response later with server2client(); needs the x11 transport without VimBroker"
+    ),
+    AP_INIT_TAKE1(
+        "VimCancelExpr",
+        mod_vim_set_string_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, cancel_expr),
+        RSRC_CONF,
+        "Specifies the expression evaluated when the client of a streamed or deferred request goes away; @@ stands for the tag of the request"
+    ),
+    AP_INIT_TAKE23(
+        "VimFleet",
+        mod_vim_add_fleet_group,
+        NULL,
+        RSRC_CONF,
+        "Specifies a prefix, the number of Vim servers named after it to keep running and optionally the number of standbys to start ahead of time"
+    ),
+    AP_INIT_TAKE1(
+        "VimFleetCommand",
+        mod_vim_set_string_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, fleet_command),
+        RSRC_CONF,
+        "Specifies the command line starting a Vim server of VimFleet, to which --servername is added"
+    ),
+    AP_INIT_TAKE1(
+        "VimFleetMaxRequests",
+        mod_vim_set_fleet_int,
+        (void *)APR_OFFSETOF(mod_vim_server_config, fleet_max_requests),
+        RSRC_CONF,
+        "Specifies how many requests a Vim server of VimFleet serves before it is replaced, 0 for no limit"
+    ),
+    AP_INIT_TAKE1(
+        "VimFleetMaxRSS",
+        mod_vim_set_fleet_int,
+        (void *)APR_OFFSETOF(mod_vim_server_config, fleet_max_rss),
+        RSRC_CONF,
+        "Specifies how large a Vim server of VimFleet may grow before it is replaced, in megabytes, 0 for no limit"
+    ),
+    AP_INIT_TAKE1(
+        "VimHedgeDelay",
+        mod_vim_set_hedge_delay,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies after how long without a result a GET request is sent to another server of the pool as well, 0 for never or auto for three times the average response time of the server to this child's requests; needs the x11 transport without VimBroker"
+    ),
+    AP_INIT_TAKE1(
+        "VimHedgeRatio",
+        mod_vim_set_hedge_ratio,
+        NULL,
+        RSRC_CONF,
+        "Specifies how many GET requests per 100 a child may hedge, beyond a reserve of a few"
+    ),
 #endif
+    AP_INIT_TAKE1(
+        "VimTransport",
+        mod_vim_set_transport,
+        NULL,
+        RSRC_CONF,
+        "Specifies how to talk to Vim: x11, channel or nvim"
+    ),
+    AP_INIT_TAKE1(
+        "VimChannelListen",
+        mod_vim_set_string_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, channel_address),
+        RSRC_CONF,
+        "Specifies the address (host:port or unix:/path) Vim connects to with ch_open(); the connections are all held by the broker process, which every child goes through"
+    ),
+    AP_INIT_TAKE1(
+        "VimBrokerSlots",
+        mod_vim_set_broker_int,
+        (void *)APR_OFFSETOF(mod_vim_server_config, broker_slots),
+        RSRC_CONF,
+        "Specifies how many commands may be handed to the broker at a time"
+    ),
+    AP_INIT_TAKE1(
+        "VimBrokerSlotSize",
+        mod_vim_set_broker_int,
+        (void *)APR_OFFSETOF(mod_vim_server_config, broker_slot_size),
+        RSRC_CONF,
+        "Specifies the largest command and reply passed through the broker, in bytes"
+    ),
+    AP_INIT_TAKE1(
+        "VimHealthCheckInterval",
+        mod_vim_set_duration_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, health_check_interval),
+        RSRC_CONF,
+        "Specifies how often every Vim server is probed, in seconds unless suffixed with ms; 0, the default, disables probing"
+    ),
+    AP_INIT_TAKE1(
+        "VimHealthCheckTimeout",
+        mod_vim_set_duration_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, health_check_timeout),
+        RSRC_CONF,
+        "Specifies how long a probe waits for the Vim server, in seconds unless suffixed with ms"
+    ),
+    AP_INIT_TAKE1(
+        "VimHealthCheckExpr",
+        mod_vim_set_string_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, health_check_expr),
+        RSRC_CONF,
+        "Specifies the expression evaluated to probe a Vim server"
+    ),
+    AP_INIT_TAKE1(
+        "VimCircuitBreakerThreshold",
+        mod_vim_set_breaker_threshold,
+        NULL,
+        RSRC_CONF,
+        "Specifies after how many failures in a row requests for a Vim server are turned away; 0, the default, disables it"
+    ),
+    AP_INIT_TAKE1(
+        "VimCircuitBreakerCooldown",
+        mod_vim_set_duration_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, breaker_cooldown),
+        RSRC_CONF,
+        "Specifies how long requests are turned away before one is let through again when probing is disabled"
+    ),
+    AP_INIT_FLAG(
+        "VimAsync",
+        mod_vim_set_async,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "On to answer 202 at once and evaluate the expression in the background, throwing the result away"
+    ),
+    AP_INIT_TAKE1(
+        "VimAsyncQueueSize",
+        mod_vim_set_async_queue_size,
+        NULL,
+        RSRC_CONF,
+        "Specifies how many expressions of VimAsync locations may wait to be sent per child; more are turned away with 503"
+    ),
+    AP_INIT_TAKE1(
+        "VimRetries",
+        mod_vim_set_retries,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies how many times an idempotent request is sent again, to another server of the pool if any, when talking to the server failed"
+    ),
+    AP_INIT_TAKE1(
+        "VimRetryBackoff",
+        mod_vim_set_duration_slot,
+        (void *)APR_OFFSETOF(mod_vim_server_config, retry_backoff),
+        RSRC_CONF,
+        "Specifies the wait before the first retry, doubled for every retry after it up to 5 seconds, plus a random part up to as much again, in seconds unless suffixed with ms"
+    ),
+    AP_INIT_TAKE1(
+        "VimRetryBudget",
+        mod_vim_set_retry_budget,
+        NULL,
+        RSRC_CONF,
+        "Specifies how many retries a child may make per 100 requests; the unused ones are saved up to a reserve of 10 retries, which is also what a child starts with"
+    ),
     AP_INIT_TAKE1(
         "VimVersion",
         mod_vim_set_string_slot,
@@ -136,12 +514,54 @@ static const command_rec mod_vim_cmds[] = {
         NULL,
         RSRC_CONF|ACCESS_CONF,
     ),
+    AP_INIT_ITERATE(
+        "VimServerPool",
+        mod_vim_add_server_pool_member,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies the names of the Vim servers that requests are balanced across"
+    ),
+    AP_INIT_TAKE1(
+        "VimServerPoolPrefix",
+        mod_vim_set_server_pool_prefix,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies the prefix of the registered Vim server names that make up the pool"
+    ),
+    AP_INIT_TAKE1(
+        "VimServerPoolPolicy",
+        mod_vim_set_server_pool_policy,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Either round-robin, least-outstanding or consistent-hash"
+    ),
+    AP_INIT_TAKE12(
+        "VimAffinityKey",
+        mod_vim_set_affinity_key,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies the key by which VimServerPoolPolicy consistent-hash sends requests to the same server: cookie <name>, header <name>, uri <number of path segments> or none"
+    ),
+    AP_INIT_TAKE1(
+        "VimTimeout",
+        mod_vim_set_timeout,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies how long to wait for the Vim server to evaluate the expression, in seconds unless suffixed with ms"
+    ),
     AP_INIT_RAW_ARGS(
         "VimExpr",
         mod_vim_set_expr,
         NULL,
         RSRC_CONF|ACCESS_CONF,
     ),
+    AP_INIT_TAKE1(
+        "VimFunction",
+        mod_vim_set_function,
+        NULL,
+        RSRC_CONF|ACCESS_CONF,
+        "Specifies the function called with the request instead of evaluating VimExpr"
+    ),
     {NULL}
 };
 
@@ -168,6 +588,7 @@ static const char *mod_vim_set_server_name(cmd_parms *cmd, void *dconf, const ch
     if (dconf) {
         mod_vim_dir_config *config = dconf;
         config->server_name = arg;
+        config->server_pool = NULL;
     } else {
         mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
         config->server_name = arg;
@@ -175,14 +596,350 @@ static const char *mod_vim_set_server_name(cmd_parms *cmd, void *dconf, const ch
     return NULL;
 }
 
+static VimServerPool **mod_vim_get_server_pool_slot(cmd_parms *cmd, void *dconf)
+{
+    if (dconf) {
+        mod_vim_dir_config *config = dconf;
+        config->server_name = NULL;
+        return &config->server_pool;
+    } else {
+        mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+        return &config->server_pool;
+    }
+}
+
+static const char *mod_vim_get_server_pool(VimServerPool **retval, cmd_parms *cmd, void *dconf)
+{
+    VimServerPool **slot = mod_vim_get_server_pool_slot(cmd, dconf);
+    if (!*slot) {
+        *slot = VimServerPool_new(cmd->pool);
+        if (!*slot)
+            return "Failed to create a Vim server pool";
+    }
+    *retval = *slot;
+    return NULL;
+}
+
+static const char *mod_vim_add_server_pool_member(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    VimServerPool *server_pool;
+    const char *err = mod_vim_get_server_pool(&server_pool, cmd, dconf);
+    if (err)
+        return err;
+    if (VimServerPool_addMember(server_pool, arg))
+        return apr_psprintf(cmd->pool, "Too many servers in VimServerPool (up to %d)", VIM_POOL_MAX_MEMBERS);
+    return NULL;
+}
+
+static const char *mod_vim_set_server_pool_prefix(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    VimServerPool *server_pool;
+    const char *err = mod_vim_get_server_pool(&server_pool, cmd, dconf);
+    if (err)
+        return err;
+    server_pool->prefix = arg;
+    return NULL;
+}
+
+static const char *mod_vim_set_server_pool_policy(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    VimServerPool *server_pool;
+    const char *err = mod_vim_get_server_pool(&server_pool, cmd, dconf);
+    if (err)
+        return err;
+    if (strcasecmp(arg, "round-robin") == 0)
+        server_pool->policy = VIM_POOL_ROUND_ROBIN;
+    else if (strcasecmp(arg, "least-outstanding") == 0)
+        server_pool->policy = VIM_POOL_LEAST_OUTSTANDING;
+    else if (strcasecmp(arg, "consistent-hash") == 0)
+        server_pool->policy = VIM_POOL_CONSISTENT_HASH;
+    else
+        return "VimServerPoolPolicy must be round-robin, least-outstanding or consistent-hash";
+    return NULL;
+}
+
+static const char *mod_vim_set_affinity_key(cmd_parms *cmd, void *dconf, const char *source, const char *name)
+{
+    mod_vim_dir_config *config = dconf;
+    mod_vim_affinity_source affinity_source;
+    int segments = 0;
+
+    if (strcasecmp(source, "none") == 0) {
+        if (name)
+            return "VimAffinityKey none takes no other argument";
+        affinity_source = MOD_VIM_AFFINITY_NONE;
+    } else if (strcasecmp(source, "cookie") == 0) {
+        if (!name)
+            return "VimAffinityKey cookie takes the name of the cookie";
+        affinity_source = MOD_VIM_AFFINITY_COOKIE;
+    } else if (strcasecmp(source, "header") == 0) {
+        if (!name)
+            return "VimAffinityKey header takes the name of the header";
+        affinity_source = MOD_VIM_AFFINITY_HEADER;
+    } else if (strcasecmp(source, "uri") == 0) {
+        char *end;
+        long value;
+
+        if (!name)
+            return "VimAffinityKey uri takes a positive number of path segments";
+        value = strtol(name, &end, 10);
+        if (*end || value <= 0 || value > 0x7fffffffL)
+            return "VimAffinityKey uri takes a positive number of path segments";
+        affinity_source = MOD_VIM_AFFINITY_URI;
+        segments = (int)value;
+    } else {
+        return "VimAffinityKey must be cookie, header, uri or none";
+    }
+    config->affinity_source = affinity_source;
+    config->affinity_name = name;
+    config->affinity_segments = segments;
+    return NULL;
+}
+
+static const char *mod_vim_set_timeout(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    apr_interval_time_t timeout;
+
+    if (ap_timeout_parameter_parse(arg, &timeout, "s") != APR_SUCCESS || timeout < 0)
+        return "VimTimeout must be a non-negative duration";
+
+    if (dconf) {
+        mod_vim_dir_config *config = dconf;
+        config->timeout = timeout;
+    } else {
+        mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+        config->timeout = timeout;
+    }
+    return NULL;
+}
+
+static const char *mod_vim_set_async(cmd_parms *cmd, void *dconf, int flag)
+{
+    mod_vim_dir_config *config = dconf;
+    config->async = flag;
+    if (flag) {
+        mod_vim_server_config *sconfig = ap_get_module_config(cmd->server->module_config, &vim_module);
+        sconfig->async_used = TRUE;
+    }
+    return NULL;
+}
+
+static const char *mod_vim_set_async_queue_size(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value <= 0 || value > 0x7fffffffL)
+        return "VimAsyncQueueSize must be a positive integer";
+    config->async_queue_size = (int)value;
+    return NULL;
+}
+
+static const char *mod_vim_set_retries(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    char *end;
+    long retries = strtol(arg, &end, 10);
+
+    if (*end || retries < 0 || retries > 100)
+        return "VimRetries must be an integer from 0 to 100";
+
+    if (dconf) {
+        mod_vim_dir_config *config = dconf;
+        config->retries = (int)retries;
+    } else {
+        mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+        config->retries = (int)retries;
+    }
+    return NULL;
+}
+
+static const char *mod_vim_set_retry_budget(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value < 0 || value > 1000)
+        return "VimRetryBudget must be an integer from 0 to 1000";
+    config->retry_budget = (int)value;
+    return NULL;
+}
+
+static const char *mod_vim_set_transport(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    if (strcasecmp(arg, "x11") == 0)
+        config->transport = MOD_VIM_TRANSPORT_X11;
+    else if (strcasecmp(arg, "channel") == 0)
+        config->transport = MOD_VIM_TRANSPORT_CHANNEL;
+    else if (strcasecmp(arg, "nvim") == 0)
+        config->transport = MOD_VIM_TRANSPORT_NVIM;
+    else
+        return "VimTransport must be one of x11, channel or nvim";
+    return NULL;
+}
+
+static const char *mod_vim_set_duration_slot(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    apr_interval_time_t value;
+
+    if (ap_timeout_parameter_parse(arg, &value, "s") != APR_SUCCESS || value < 0)
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " must be a non-negative duration", NULL);
+    *(apr_interval_time_t *)((char *)config + (long)cmd->info) = value;
+    return NULL;
+}
+
+static const char *mod_vim_set_breaker_threshold(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value < 0 || value > 0x7fffffffL)
+        return "VimCircuitBreakerThreshold must be a non-negative integer";
+    config->breaker_threshold = (int)value;
+    return NULL;
+}
+
+static const char *mod_vim_set_broker_int(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value <= 0 || value > 0x7fffffffL)
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " must be a positive integer", NULL);
+    *(int *)((char *)config + (long)cmd->info) = (int)value;
+    return NULL;
+}
+
+#ifdef USE_X11
+static const char *mod_vim_set_thread_connections(cmd_parms *cmd, void *dummy, int flag)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    config->thread_connections = flag;
+    return NULL;
+}
+
+static const char *mod_vim_set_dispatcher_thread(cmd_parms *cmd, void *dummy, int flag)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    config->dispatcher_thread = flag;
+    return NULL;
+}
+
+static const char *mod_vim_set_broker(cmd_parms *cmd, void *dummy, int flag)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    config->broker = flag;
+    return NULL;
+}
+
+static const char *mod_vim_set_stream(cmd_parms *cmd, void *dconf, int flag)
+{
+    mod_vim_dir_config *config = dconf;
+    config->stream = flag;
+    return NULL;
+}
+
+static const char *mod_vim_set_deferred(cmd_parms *cmd, void *dconf, int flag)
+{
+    mod_vim_dir_config *config = dconf;
+    config->deferred = flag;
+    return NULL;
+}
+
+static const char *mod_vim_add_fleet_group(cmd_parms *cmd, void *dummy, const char *prefix, const char *workers, const char *standbys)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    VimFleet_Group *group;
+    char *end;
+    long nworkers, nstandbys = 0;
+
+    if (!*prefix || strlen(prefix) > 48)
+        return "VimFleet prefix must be 1 to 48 characters long";
+    nworkers = strtol(workers, &end, 10);
+    if (*end || nworkers <= 0 || nworkers > VIM_POOL_MAX_MEMBERS)
+        return apr_psprintf(cmd->pool, "VimFleet needs 1 to %d servers", VIM_POOL_MAX_MEMBERS);
+    if (standbys) {
+        nstandbys = strtol(standbys, &end, 10);
+        if (*end || nstandbys < 0 || nstandbys > VIM_POOL_MAX_MEMBERS)
+            return apr_psprintf(cmd->pool, "VimFleet takes 0 to %d standbys", VIM_POOL_MAX_MEMBERS);
+    }
+    group = apr_array_push(config->fleet_groups);
+    group->prefix = prefix;
+    group->workers = (int)nworkers;
+    group->standbys = (int)nstandbys;
+    return NULL;
+}
+
+static const char *mod_vim_set_hedge_delay(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    apr_interval_time_t delay;
+
+    if (strcasecmp(arg, "auto") == 0) {
+        mod_vim_server_config *sconfig = ap_get_module_config(cmd->server->module_config, &vim_module);
+        delay = MOD_VIM_HEDGE_AUTO;
+        sconfig->hedge_auto_used = TRUE;
+    } else if (ap_timeout_parameter_parse(arg, &delay, "s") != APR_SUCCESS || delay < 0) {
+        return "VimHedgeDelay must be a non-negative duration or auto";
+    }
+
+    if (dconf) {
+        mod_vim_dir_config *config = dconf;
+        config->hedge_delay = delay;
+    } else {
+        mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+        config->hedge_delay = delay;
+    }
+    return NULL;
+}
+
+static const char *mod_vim_set_hedge_ratio(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value < 0 || value > 100)
+        return "VimHedgeRatio must be an integer from 0 to 100";
+    config->hedge_ratio = (int)value;
+    return NULL;
+}
+
+static const char *mod_vim_set_fleet_int(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end || value < 0 || value > 0x7fffffffL)
+        return apr_pstrcat(cmd->pool, cmd->cmd->name, " must be a non-negative integer", NULL);
+    *(int *)((char *)config + (long)cmd->info) = (int)value;
+    return NULL;
+}
+#endif
+
 static const char *mod_vim_set_expr(cmd_parms *cmd, void *dconf, const char *arg)
 {
     if (dconf) {
         mod_vim_dir_config *config = dconf;
         config->expr = arg;
+        config->function = NULL;
     } else {
         mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
         config->expr = arg;
+        config->function = NULL;
+    }
+    return NULL;
+}
+
+static const char *mod_vim_set_function(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    if (dconf) {
+        mod_vim_dir_config *config = dconf;
+        config->function = arg;
+        config->expr = NULL;
+    } else {
+        mod_vim_server_config *config = ap_get_module_config(cmd->server->module_config, &vim_module);
+        config->function = arg;
+        config->expr = NULL;
     }
     return NULL;
 }
@@ -275,137 +1032,868 @@ static void mod_vim_append_escaped_string_literal(apr_bucket_brigade *brigade, c
                 APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_heap_create(buf, 2, NULL, brigade->bucket_alloc));
                 chunk = p + 1;
             }
-            break;
+            break;
+        }
+        p++;
+    }
+    if (chunk < p)
+        mod_vim_append_transient_bucket(brigade, chunk, p - chunk);
+}
+
+static int mod_vim_build_request_json_add_header_cb(void *data, const char *key, const char *value)
+{
+    apr_hash_t *h = data;
+    apr_hash_set(h, key, strlen(key), value);
+    return 1;
+}
+
+static apr_status_t mod_vim_read_request_body(char **body, apr_size_t *body_len, request_rec *r, apr_pool_t *pool)
+{
+    apr_status_t status;
+    apr_bucket_brigade *brigade = apr_brigade_create(pool, r->connection->bucket_alloc);
+    if ((status = ap_get_brigade(
+            r->input_filters, brigade, AP_MODE_READBYTES,
+            APR_BLOCK_READ, HUGE_STRING_LEN))) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "Error reading request entity data");
+        return status;
+    }
+
+    return apr_brigade_pflatten(brigade, body, body_len, pool);
+}
+
+/*
+ * Build the object describing the request that is handed to Vim, allocated
+ * from "pool".  "tag_key", if not NULL, names the member holding "tag",
+ * which every notification Vim sends back for the request must start with.
+ */
+static apr_status_t mod_vim_build_request_value(apr_json_value_t **value, request_rec *r, long long deadline, const char *tag_key, const char *tag, apr_pool_t *pool)
+{
+    apr_status_t status = OK;
+    apr_json_value_t *request_json = apr_pcalloc(pool, sizeof(*request_json));
+    apr_json_value_t *uri = apr_pcalloc(pool, sizeof(*uri));
+    apr_json_value_t *method = apr_pcalloc(pool, sizeof(*method));
+    apr_json_value_t *filename = apr_pcalloc(pool, sizeof(*filename));
+    apr_json_value_t *path_info = apr_pcalloc(pool, sizeof(*path_info));
+    apr_json_value_t *headers = apr_pcalloc(pool, sizeof(*headers));
+    apr_json_value_t *request_body = apr_pcalloc(pool, sizeof(*request_body));
+    apr_json_value_t *timeout = apr_pcalloc(pool, sizeof(*timeout));
+
+    request_body->type = APR_JSON_STRING;
+    if ((status = mod_vim_read_request_body((char **)&request_body->value.string.p, &request_body->value.string.len, r, pool))) {
+        return status;
+    }
+
+    request_json->type = APR_JSON_OBJECT;
+    request_json->value.object = apr_hash_make(pool);
+
+    apr_hash_set(request_json->value.object, "content", sizeof("content") - 1, request_body);
+
+    uri->type = APR_JSON_STRING;
+    uri->value.string.p = r->uri;
+    uri->value.string.len = strlen(uri->value.string.p);
+    apr_hash_set(request_json->value.object, "uri", sizeof("uri") - 1, uri);
+
+    filename->type = APR_JSON_STRING;
+    filename->value.string.p = r->filename;
+    filename->value.string.len = strlen(filename->value.string.p);
+    apr_hash_set(request_json->value.object, "filename", sizeof("filename") - 1, filename);
+
+    path_info->type = APR_JSON_NULL;
+    if (r->path_info) {
+        path_info->type = APR_JSON_STRING;
+        path_info->value.string.p = r->path_info;
+        path_info->value.string.len = strlen(path_info->value.string.p);
+    }
+    apr_hash_set(request_json->value.object, "path_info", sizeof("path_info") - 1, path_info);
+
+    method->type = APR_JSON_STRING;
+    method->value.string.p = r->method;
+    method->value.string.len = strlen(r->method);
+    apr_hash_set(request_json->value.object, "method", sizeof("method") - 1, method);
+
+    /* milliseconds left before the request is given up on */
+    timeout->type = APR_JSON_LONG;
+    timeout->value.lnumber = deadline - monotonic_msec();
+    if (timeout->value.lnumber < 0)
+        timeout->value.lnumber = 0;
+    apr_hash_set(request_json->value.object, "timeout", sizeof("timeout") - 1, timeout);
+
+    headers->type = APR_JSON_OBJECT;
+    headers->value.object = apr_hash_make(pool);
+    apr_table_do(mod_vim_build_request_json_add_header_cb, headers->value.object, r->headers_in, NULL);
+
+    if (tag_key) {
+        apr_json_value_t *tag_value = apr_pcalloc(pool, sizeof(*tag_value));
+        tag_value->type = APR_JSON_STRING;
+        tag_value->value.string.p = tag;
+        tag_value->value.string.len = strlen(tag);
+        apr_hash_set(request_json->value.object, tag_key, APR_HASH_KEY_STRING, tag_value);
+    }
+
+    *value = request_json;
+    return status;
+}
+
+static apr_status_t mod_vim_build_request_json(char **json, apr_size_t *json_len, request_rec *r, long long deadline, const char *tag_key, const char *tag, apr_pool_t *pool)
+{
+    apr_status_t status = OK;
+    apr_pool_t *subpool = NULL;
+    apr_bucket_alloc_t *bucket_alloc = NULL;
+    apr_bucket_brigade *json_bb = NULL;
+    apr_json_value_t *request_json;
+
+    if ((status = apr_pool_create(&subpool, pool))) {
+        return status;
+    }
+
+    if ((status = mod_vim_build_request_value(&request_json, r, deadline, tag_key, tag, subpool))) {
+        goto out;
+    }
+
+    bucket_alloc = apr_bucket_alloc_create(subpool);
+
+    json_bb = apr_brigade_create(subpool, bucket_alloc);
+
+    apr_json_encode(json_bb, request_json, subpool);
+
+    APR_BRIGADE_INSERT_TAIL(json_bb, apr_bucket_eos_create(bucket_alloc));
+
+    status = apr_brigade_pflatten(json_bb, json, json_len, pool);
+
+out:
+    if (json_bb)
+        apr_brigade_destroy(json_bb);
+    if (bucket_alloc)
+        apr_bucket_alloc_destroy(bucket_alloc);
+    if (subpool)
+        apr_pool_destroy(subpool);
+    return status;
+}
+
+/*
+ * Returns the client the current thread talks to X through, creating it
+ * on first use if every thread has its own.
+ */
+static VimRemotingClient *mod_vim_get_client(void)
+{
+#ifdef USE_X11
+    void *data = NULL;
+
+    if (!client_key)
+        return client;
+
+    apr_threadkey_private_get(&data, client_key);
+    if (!data) {
+        mod_vim_server_config *config = ap_get_module_config(main_server->module_config, &vim_module);
+        data = VimRemotingClient_new(main_server, config->vim_version, config->encoding, config->display);
+        if (data)
+            apr_threadkey_private_set(data, client_key);
+    }
+    return data;
+#else
+    return client;
+#endif
+}
+
+static char *mod_vim_list_server_names(void *data)
+{
+    switch (transport) {
+    case MOD_VIM_TRANSPORT_NVIM:
+        return nvim ? VimNvimClient_getNames(nvim): NULL;
+    default:
+        {
+            VimRemotingClient *client;
+            if (broker)
+                return VimBroker_getNames(broker);
+            if (transport == MOD_VIM_TRANSPORT_CHANNEL)
+                return NULL;
+            client = mod_vim_get_client();
+            return client ? serverGetVimNames(client): NULL;
+        }
+    }
+}
+
+/*
+ * Returns TRUE once the client of the request "data" hung up.
+ */
+static int mod_vim_client_gone(void *data)
+{
+    request_rec *r = data;
+    conn_rec *c = r->connection;
+    int eof = 0;
+
+    if (!c->aborted && apr_socket_atreadeof(ap_get_conn_socket(c), &eof) == APR_SUCCESS && eof)
+        c->aborted = 1;
+    return c->aborted;
+}
+
+/*
+ * Evaluate "expr" on the Vim server "server_name" through the configured
+ * transport, waiting "timeout" milliseconds at most, and decode the result.
+ * Over X the wait ends early should the client hang up.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT, VIM_REMOTE_CANCELLED,
+ * VIM_REMOTE_EVAL_ERROR when the expression failed or its result isn't
+ * JSON, or VIM_REMOTE_ERROR.
+ */
+static int mod_vim_send(request_rec *r, const char *server_name, const char *expr, apr_size_t expr_len, long timeout, apr_json_value_t **value)
+{
+    switch (transport) {
+    case MOD_VIM_TRANSPORT_NVIM:
+        if (!nvim) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Neovim client is not running");
+            return VIM_REMOTE_ERROR;
+        }
+        return VimNvimClient_eval(nvim, server_name, expr, expr_len, value, r->pool, timeout);
+    default:
+        {
+            VimRemotingClient *client;
+            char *result = NULL;
+            int retval;
+
+            if (broker) {
+                retval = VimBroker_send(broker, server_name, expr, expr_len, &result, timeout);
+            } else if (transport == MOD_VIM_TRANSPORT_CHANNEL) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Vim channel broker is not running");
+                return VIM_REMOTE_ERROR;
+            } else {
+                client = mod_vim_get_client();
+                if (!client) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Not connected to the X display");
+                    return VIM_REMOTE_ERROR;
+                }
+                retval = serverSendToVimCancellable(client, server_name, expr, expr_len, &result, timeout, mod_vim_client_gone, r);
+            }
+            if (retval == VIM_REMOTE_OK && apr_json_decode(value, result, strlen(result), r->pool)) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server -- %s", result);
+                retval = VIM_REMOTE_EVAL_ERROR;
+            }
+            free(result);
+            return retval;
         }
-        p++;
     }
-    if (chunk < p)
-        mod_vim_append_transient_bucket(brigade, chunk, p - chunk);
 }
 
-static int mod_vim_build_request_json_add_header_cb(void *data, const char *key, const char *value)
+/*
+ * Evaluate "expr" on the Vim server "server_name" on behalf of the health
+ * prober, throwing the result away.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT or VIM_REMOTE_ERROR.
+ */
+static int mod_vim_probe(void *data, const char *server_name, const char *expr, long timeout)
 {
-    apr_hash_t *h = data;
-    apr_hash_set(h, key, strlen(key), value);
-    return 1;
+    apr_pool_t *pool;
+    apr_json_value_t *value;
+    int retval = VIM_REMOTE_ERROR;
+
+    switch (transport) {
+    case MOD_VIM_TRANSPORT_NVIM:
+        if (apr_pool_create(&pool, NULL))
+            return VIM_REMOTE_ERROR;
+        if (nvim)
+            retval = VimNvimClient_eval(nvim, server_name, expr, strlen(expr), &value, pool, timeout);
+        apr_pool_destroy(pool);
+        return retval;
+    default:
+        {
+            VimRemotingClient *client;
+            char *result = NULL;
+
+            if (broker) {
+                retval = VimBroker_send(broker, server_name, expr, strlen(expr), &result, timeout);
+            } else if (transport == MOD_VIM_TRANSPORT_X11
+                       && (client = mod_vim_get_client()) != NULL) {
+                retval = serverSendToVim(client, server_name, expr, strlen(expr), &result, timeout);
+            }
+            free(result);
+            return retval;
+        }
+    }
 }
 
-static apr_status_t mod_vim_read_request_body(char **body, apr_size_t *body_len, request_rec *r, apr_pool_t *pool)
+/*
+ * Evaluate "expr" queued by a VimAsync location on the Vim server
+ * "server_name", throwing the result away.  Over X this doesn't wait at
+ * all.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT or VIM_REMOTE_ERROR.
+ */
+static int mod_vim_send_async(void *data, const char *server_name, const char *expr, apr_size_t expr_len, long timeout)
 {
-    apr_status_t status;
-    apr_bucket_brigade *brigade = apr_brigade_create(pool, r->connection->bucket_alloc);
-    if ((status = ap_get_brigade(
-            r->input_filters, brigade, AP_MODE_READBYTES,
-            APR_BLOCK_READ, HUGE_STRING_LEN))) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "Error reading request entity data");
-        return status;
+    apr_pool_t *pool;
+    apr_json_value_t *value;
+    int retval = VIM_REMOTE_ERROR;
+
+    switch (transport) {
+    case MOD_VIM_TRANSPORT_NVIM:
+        if (apr_pool_create(&pool, NULL))
+            return VIM_REMOTE_ERROR;
+        if (nvim)
+            retval = VimNvimClient_eval(nvim, server_name, expr, expr_len, &value, pool, timeout);
+        apr_pool_destroy(pool);
+        return retval;
+    default:
+        {
+            VimRemotingClient *client;
+
+            if (broker) {
+                char *result = NULL;
+                retval = VimBroker_send(broker, server_name, expr, expr_len, &result, timeout);
+                free(result);
+            } else if (transport == MOD_VIM_TRANSPORT_X11
+                       && (client = mod_vim_get_client()) != NULL) {
+                retval = serverSendExpr(client, server_name, expr, expr_len);
+            }
+            return retval;
+        }
     }
+}
 
-    return apr_brigade_pflatten(brigade, body, body_len, pool);
+/*
+ * Passes over the server "data" names, if any, on top of those that are
+ * down or out of service.
+ */
+static int mod_vim_is_server_usable(void *data, const char *server_name)
+{
+    if (data && strcasecmp(data, server_name) == 0)
+        return 0;
+#ifdef USE_X11
+    /* standbys and servers being recycled are registered all the same */
+    if (fleet && !VimFleet_isInService(fleet, server_name))
+        return 0;
+#endif
+    return !health || VimHealth_isAvailable(health, server_name);
 }
 
-static apr_status_t mod_vim_build_request_json(char **json, apr_size_t *json_len, request_rec *r, apr_pool_t *pool)
+/*
+ * Return the key by which VimServerPoolPolicy consistent-hash sends the
+ * request "r" to the same server as the others with the same key, or NULL
+ * if there is none.
+ */
+static const char *mod_vim_get_affinity_key(request_rec *r)
 {
-    apr_status_t status = OK;
-    apr_pool_t *subpool = NULL;
-    apr_bucket_alloc_t *bucket_alloc = NULL;
-    apr_bucket_brigade *json_bb = NULL;
-    apr_json_value_t request_json = { APR_JSON_OBJECT };
-    apr_json_value_t uri = { APR_JSON_STRING };
-    apr_json_value_t method = { APR_JSON_STRING };
-    apr_json_value_t filename = { APR_JSON_STRING };
-    apr_json_value_t path_info = { APR_JSON_NULL };
-    apr_json_value_t headers = { APR_JSON_OBJECT };
-    apr_json_value_t request_body = { APR_JSON_STRING };
+    const mod_vim_dir_config *dconfig = ap_get_module_config(r->per_dir_config, &vim_module);
+    const char *key = NULL;
+
+    switch (dconfig->affinity_source) {
+    case MOD_VIM_AFFINITY_COOKIE:
+        if (ap_cookie_read(r, dconfig->affinity_name, &key, 0) != APR_SUCCESS)
+            key = NULL;
+        break;
+    case MOD_VIM_AFFINITY_HEADER:
+        key = apr_table_get(r->headers_in, dconfig->affinity_name);
+        break;
+    case MOD_VIM_AFFINITY_URI:
+        {
+            /* the path up to the end of the given number of segments */
+            const char *p = r->uri;
+            int i;
+
+            for (i = 0; *p && i < dconfig->affinity_segments; i++) {
+                if (*p == '/')
+                    p++;
+                p += strcspn(p, "/");
+            }
+            key = apr_pstrndup(r->pool, r->uri, p - r->uri);
+        }
+        break;
+    default:
+        break;
+    }
+    return key && *key ? key: NULL;
+}
 
-    if ((status = apr_pool_create(&subpool, pool))) {
-        return status;
+/*
+ * Return TRUE if sending the request "r" twice does no more than sending
+ * it once.
+ */
+static int mod_vim_is_idempotent(request_rec *r)
+{
+    switch (r->method_number) {
+    case M_GET:
+    case M_PUT:
+    case M_DELETE:
+    case M_OPTIONS:
+    case M_TRACE:
+        return 1;
     }
+    return 0;
+}
 
-    if ((status = mod_vim_read_request_body((char **)&request_body.value.string.p, &request_body.value.string.len, r, subpool))) {
-        goto out;
+/*
+ * Get ready to send the request "r" again, "attempt" being the number of
+ * retries made so far, after talking to "*server_name" failed: wait a
+ * while, then move over to another server of "server_pool" in place of
+ * "*member" if there is one up; otherwise the same server may be back by
+ * then.  The number of retries and the servers given up on are left in
+ * the notes "vim-retries" and "vim-failover" for logging.
+ * Returns FALSE if the request is not to be sent again after all.
+ */
+static int mod_vim_prepare_retry(request_rec *r, int attempt, long long deadline, VimServerPool *server_pool, VimServerPool_Member **member, const char **server_name, VimHealth_Server **health_server)
+{
+    const mod_vim_server_config *sconfig = ap_get_module_config(r->server->module_config, &vim_module);
+    apr_interval_time_t backoff = VimRetry_backoff(sconfig->retry_backoff, attempt);
+    const char *failed = *server_name;
+
+    if (monotonic_msec() + apr_time_as_msec(backoff) >= deadline)
+        return 0;
+    if (!VimRetryBudget_withdraw(retry_budget)) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Not retrying the request for the server %s: out of retry budget", failed);
+        return 0;
+    }
+    apr_sleep(backoff);
+
+    if (server_pool) {
+        VimServerPool_Member *next = VimServerPool_acquire(server_pool, mod_vim_get_affinity_key(r), mod_vim_list_server_names,
+                                                           mod_vim_is_server_usable, (void *)failed);
+        if (next) {
+            VimServerPool_release(server_pool, *member);
+            *member = next;
+            *server_name = next->name;
+            apr_table_merge(r->notes, "vim-failover", apr_pstrcat(r->pool, failed, "->", next->name, NULL));
+        }
     }
+    if (health) {
+        apr_interval_time_t retry_after;
 
-    bucket_alloc = apr_bucket_alloc_create(subpool);
+        if (*server_name != failed)
+            *health_server = VimHealth_getServer(health, *server_name);
+        if (*health_server && !VimHealth_allow(health, *health_server, &retry_after))
+            return 0;
+    }
 
-    json_bb = apr_brigade_create(subpool, bucket_alloc);
+    apr_table_setn(r->notes, "vim-retries", apr_itoa(r->pool, attempt + 1));
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Retrying on the server %s after failing to talk to the server %s", *server_name, failed);
+    return 1;
+}
 
-    request_json.value.object = apr_hash_make(subpool);
+#ifdef USE_X11
+typedef struct mod_vim_hedge {
+    request_rec *r;
+    VimServerPool *server_pool;
+    /* The server the expression went to first */
+    const char *first;
+    /* The second server, once picked */
+    VimServerPool_Member *member;
+} mod_vim_hedge;
+
+/*
+ * Pick the server to send the expression of the request "data" describes
+ * to as well, unless hedging is over budget.
+ */
+static const char *mod_vim_pick_hedge(void *data)
+{
+    mod_vim_hedge *hedge = data;
+
+    hedge->member = VimServerPool_acquire(hedge->server_pool, mod_vim_get_affinity_key(hedge->r), mod_vim_list_server_names,
+                                          mod_vim_is_server_usable, (void *)hedge->first);
+    if (!hedge->member)
+        return NULL;
+    if (!VimRetryBudget_withdraw(hedge_budget)) {
+        VimServerPool_release(hedge->server_pool, hedge->member);
+        hedge->member = NULL;
+        return NULL;
+    }
+    apr_table_setn(hedge->r->notes, "vim-hedge-server", hedge->member->name);
+    return hedge->member->name;
+}
 
-    apr_hash_set(request_json.value.object, "content", sizeof("content") - 1, &request_body);
+/*
+ * As mod_vim_send(), but should no result have come in after "delay", send
+ * the expression to another server of "server_pool" as well and take
+ * whichever result comes in first.  Should the second server win,
+ * "*member", "*server_name" and "*health_server" are moved over to it, the
+ * request then counting as in flight to that server.  The note "vim-hedge"
+ * tells which one won for logging.  Without a client of our own the
+ * expression is just sent.
+ */
+static int mod_vim_send_hedged(request_rec *r, const char *expr, apr_size_t expr_len, long timeout, apr_interval_time_t delay, VimServerPool *server_pool, VimServerPool_Member **member, const char **server_name, VimHealth_Server **health_server, apr_json_value_t **value)
+{
+    VimRemotingClient *client;
+    mod_vim_hedge hedge;
+    char *result = NULL;
+    long delay_msec;
+    int retval, which;
+
+    if (delay == MOD_VIM_HEDGE_AUTO)
+        delay = health && *health_server ? VimHealth_getLatency(health, *health_server) * MOD_VIM_HEDGE_AUTO_FACTOR: 0;
+    if (delay <= 0 || transport != MOD_VIM_TRANSPORT_X11 || broker || !(client = mod_vim_get_client()))
+        return mod_vim_send(r, *server_name, expr, expr_len, timeout, value);
+    delay_msec = (long)apr_time_as_msec(delay);
+
+    hedge.r = r;
+    hedge.server_pool = server_pool;
+    hedge.first = *server_name;
+    hedge.member = NULL;
+    retval = serverSendToVimHedged(client, *server_name, expr, expr_len, &result, timeout,
+                                   delay_msec > 0 ? delay_msec: 1, mod_vim_pick_hedge, &hedge,
+                                   &which, mod_vim_client_gone, r);
+    if (hedge.member) {
+        apr_table_setn(r->notes, "vim-hedge", which ? "won": "lost");
+        if (which) {
+            VimServerPool_release(server_pool, *member);
+            *member = hedge.member;
+            *server_name = hedge.member->name;
+            if (health) {
+                /* the first server's command was given up on */
+                if (*health_server)
+                    VimHealth_record(health, *health_server, VIM_REMOTE_CANCELLED, 0);
+                if ((*health_server = VimHealth_getServer(health, *server_name)) != NULL)
+                    VimHealth_begin(health, *health_server);
+            }
+        } else {
+            VimServerPool_release(server_pool, hedge.member);
+        }
+    }
+    if (retval == VIM_REMOTE_OK && apr_json_decode(value, result, strlen(result), r->pool)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server -- %s", result);
+        retval = VIM_REMOTE_EVAL_ERROR;
+    }
+    free(result);
+    return retval;
+}
+#endif
 
-    uri.value.string.p = r->uri;
-    uri.value.string.len = strlen(uri.value.string.p);
-    apr_hash_set(request_json.value.object, "uri", sizeof("uri") - 1, &uri);
+/*
+ * Tell the client to come back after "retry_after", rounded up to seconds.
+ */
+static void mod_vim_set_retry_after(request_rec *r, apr_interval_time_t retry_after)
+{
+    apr_time_t seconds = (retry_after + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC;
 
-    filename.value.string.p = r->filename;
-    filename.value.string.len = strlen(filename.value.string.p);
-    apr_hash_set(request_json.value.object, "filename", sizeof("filename") - 1, &filename);
+    apr_table_setn(r->err_headers_out, "Retry-After",
+                   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, seconds > 0 ? seconds: 1));
+}
 
-    if (r->path_info) {
-        path_info.type = APR_JSON_STRING;
-        path_info.value.string.p = r->path_info;
-        path_info.value.string.len = strlen(path_info.value.string.p);
+/*
+ * Set the response headers from the object "headers" sent by Vim.
+ */
+static int mod_vim_set_headers(request_rec *r, apr_hash_t *headers)
+{
+    apr_hash_index_t *i;
+    for (i = apr_hash_first(r->pool, headers); i; i = apr_hash_next(i)) {
+        const char *key;
+        apr_ssize_t key_len;
+        apr_json_value_t *value;
+        apr_hash_this(i, (const void **)&key, &key_len, (void **)&value);
+
+        if (value->type != APR_JSON_STRING) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server: header value must be a string");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        if (strcasecmp(key, "Content-Type") == 0)
+            r->content_type = value->value.string.p;
+        else
+            apr_table_set(r->headers_out, key, value->value.string.p);
     }
-    apr_hash_set(request_json.value.object, "path_info", sizeof("path_info") - 1, &path_info);
+    return OK;
+}
 
-    method.value.string.p = r->method;
-    method.value.string.len = strlen(r->method);
-    apr_hash_set(request_json.value.object, "method", sizeof("method") - 1, &method);
+#ifdef USE_X11
+/*
+ * Send "expr" to the server "server_name" and relay the response it sends
+ * back through "stream": first the JSON array [status, {headers}], then
+ * the body in any number of pieces, each passed down the filters and
+ * flushed as soon as it arrives, then an empty piece.  Stores how talking
+ * to the server went, one of VIM_REMOTE_*, in "*result".
+ */
+static int mod_vim_relay_stream(request_rec *r, VimRemotingClient_Stream *stream, const char *server_name, const char *expr, apr_size_t expr_len, long long deadline, int *result)
+{
+    conn_rec *c = r->connection;
+    apr_json_value_t *head;
+    apr_bucket_brigade *brigade;
+    char *str = NULL;
+    long remaining;
+    int retval;
+
+    *result = serverStreamSend(stream, server_name, expr, expr_len);
+    if (*result == VIM_REMOTE_OK) {
+        remaining = deadline - monotonic_msec();
+        *result = serverReadStream(stream, &str, remaining > 0 ? remaining: 0, mod_vim_client_gone, r);
+    }
+    switch (*result) {
+    case VIM_REMOTE_OK:
+        break;
+    case VIM_REMOTE_CANCELLED:
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Client went away while waiting for the server %s", server_name);
+        return DONE;
+    case VIM_REMOTE_TIMEOUT:
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Timed out waiting for the server %s", server_name);
+        return HTTP_GATEWAY_TIME_OUT;
+    case VIM_REMOTE_EVAL_ERROR:
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "The server %s failed to evaluate the expression", server_name);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    default:
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to communicate with the server");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    headers.value.object = apr_hash_make(subpool);
-    apr_table_do(mod_vim_build_request_json_add_header_cb, headers.value.object, r->headers_in, NULL);
+    if (!str || apr_json_decode(&head, str, strlen(str), r->pool)
+            || head->type != APR_JSON_ARRAY || head->value.array->nelts != 2
+            || ((apr_json_value_t **)head->value.array->elts)[0]->type != APR_JSON_LONG
+            || ((apr_json_value_t **)head->value.array->elts)[1]->type != APR_JSON_OBJECT) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid streamed response from the Vim server: the first piece must be an array of the HTTP status and an object that contains response headers -- %s", str ? str: "(end of stream)");
+        free(str);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    free(str);
 
-    apr_json_encode(json_bb, &request_json, subpool);
+    if ((retval = mod_vim_set_headers(r, ((apr_json_value_t **)head->value.array->elts)[1]->value.object)) != OK)
+        return retval;
+    r->status = ((apr_json_value_t **)head->value.array->elts)[0]->value.lnumber;
 
-    APR_BRIGADE_INSERT_TAIL(json_bb, apr_bucket_eos_create(bucket_alloc));
+    if (r->header_only)
+        return OK;
 
-    status = apr_brigade_pflatten(json_bb, json, json_len, pool);
+    brigade = apr_brigade_create(r->pool, c->bucket_alloc);
+    for (;;) {
+        remaining = deadline - monotonic_msec();
+        *result = serverReadStream(stream, &str, remaining > 0 ? remaining: 0, mod_vim_client_gone, r);
+        if (*result == VIM_REMOTE_CANCELLED) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Client went away while receiving the response from the server %s", server_name);
+            return DONE;
+        }
+        if (*result != VIM_REMOTE_OK) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, *result == VIM_REMOTE_TIMEOUT ?
+                          "Timed out waiting for the rest of the response from the server %s":
+                          "Failed to receive the rest of the response from the server %s", server_name);
+            /* too late for an error page; have the response cut short so
+             * that the client can tell */
+            APR_BRIGADE_INSERT_TAIL(brigade, ap_bucket_error_create(HTTP_BAD_GATEWAY, NULL, r->pool, c->bucket_alloc));
+            APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_eos_create(c->bucket_alloc));
+            ap_pass_brigade(r->output_filters, brigade);
+            return OK;
+        }
+        if (!str) {
+            APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_eos_create(c->bucket_alloc));
+            return ap_pass_brigade(r->output_filters, brigade);
+        }
+        APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_heap_create(str, strlen(str), free, c->bucket_alloc));
+        APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_flush_create(c->bucket_alloc));
+        if (ap_pass_brigade(r->output_filters, brigade) != APR_SUCCESS || c->aborted)
+            return OK;
+        apr_brigade_cleanup(brigade);
+    }
+}
 
-out:
-    if (json_bb)
-        apr_brigade_destroy(json_bb);
-    if (bucket_alloc)
-        apr_bucket_alloc_destroy(bucket_alloc);
-    if (subpool)
-        apr_pool_destroy(subpool);
-    return status;
+/*
+ * Evaluate VimCancelExpr on the server "server_name" for the request tagged
+ * "tag" whose client went away, so that the Vim can stop working on it,
+ * without waiting for the result.  "@@" in the expression stands for the
+ * tag as a string literal.
+ */
+static void mod_vim_cancel(request_rec *r, const char *server_name, const char *tag)
+{
+    const mod_vim_server_config *sconfig = ap_get_module_config(r->server->module_config, &vim_module);
+    VimRemotingClient *client;
+    const char *p, *chunk;
+    char *expr = "";
+
+    if (!sconfig->cancel_expr || !tag || !(client = mod_vim_get_client()))
+        return;
+    for (chunk = sconfig->cancel_expr; (p = strstr(chunk, "@@")) != NULL; chunk = p + 2)
+        expr = apr_pstrcat(r->pool, expr, apr_pstrndup(r->pool, chunk, p - chunk), "\"", tag, "\"", NULL);
+    expr = apr_pstrcat(r->pool, expr, chunk, NULL);
+    if (serverSendExpr(client, server_name, expr, strlen(expr)) != VIM_REMOTE_OK)
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Failed to send VimCancelExpr to the server %s", server_name);
+}
+
+/*
+ * Send "expr" to the server "server_name", which is to return at once and
+ * complete the request later, say from a timer or a job callback, with a
+ * single notification through "stream": the usual three-element response
+ * array after the ticket.  This lets a Vim work on many requests at once
+ * instead of one expression after another.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT, VIM_REMOTE_EVAL_ERROR or
+ * VIM_REMOTE_ERROR.
+ */
+static int mod_vim_await_ticket(request_rec *r, VimRemotingClient_Stream *stream, const char *server_name, const char *expr, apr_size_t expr_len, long long deadline, apr_json_value_t **value)
+{
+    char *str = NULL;
+    long remaining;
+    int retval;
+
+    retval = serverStreamSend(stream, server_name, expr, expr_len);
+    if (retval == VIM_REMOTE_OK) {
+        remaining = deadline - monotonic_msec();
+        retval = serverReadStream(stream, &str, remaining > 0 ? remaining: 0, mod_vim_client_gone, r);
+    }
+    if (retval != VIM_REMOTE_OK)
+        return retval;
+
+    if (!str || apr_json_decode(value, str, strlen(str), r->pool)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server -- %s", str ? str: "(no response after the ticket)");
+        retval = VIM_REMOTE_EVAL_ERROR;
+    }
+    free(str);
+    return retval;
 }
+#endif
 
 /* The sample content handler */
 static int mod_vim_handler(request_rec *r)
 {
     apr_status_t status;
-    char *result = NULL;
     apr_json_value_t *value;
     const mod_vim_dir_config *dconfig;
     const mod_vim_server_config *sconfig;
     const char *server_name;
-    const char *orig_expr;
+    VimServerPool *server_pool = NULL;
+    VimServerPool_Member *member = NULL;
+    VimHealth_Server *health_server = NULL;
+    const char *orig_expr, *function;
+    apr_interval_time_t timeout;
+    long long deadline;
+    apr_time_t started;
+    const char *tag_key = NULL, *tag = NULL;
+    int queued = 0;
+    int retries;
+#ifdef USE_X11
+    VimRemotingClient_Stream *stream = NULL;
+    int deferred = 0;
+    apr_interval_time_t hedge_delay;
+#endif
 
     if (strcmp(r->handler, "vim"))
         return DECLINED;
 
     dconfig = ap_get_module_config(r->per_dir_config, &vim_module);
     sconfig = ap_get_module_config(r->server->module_config, &vim_module);
-    server_name = dconfig->server_name ? dconfig->server_name: sconfig->server_name;
-    orig_expr = dconfig->expr ? dconfig->expr: sconfig->expr;
+    if (dconfig->server_name || dconfig->server_pool) {
+        server_name = dconfig->server_name;
+        server_pool = dconfig->server_pool;
+    } else {
+        server_name = sconfig->server_name;
+        server_pool = sconfig->server_pool;
+    }
+    if (dconfig->expr || dconfig->function) {
+        orig_expr = dconfig->expr;
+        function = dconfig->function;
+    } else {
+        orig_expr = sconfig->expr;
+        function = sconfig->function;
+    }
+    /* Neovim takes the request object as it is; the other transports get
+     * it as a JSON string literal */
+    if (function && transport != MOD_VIM_TRANSPORT_NVIM) {
+        orig_expr = apr_pstrcat(r->pool, function, "(@@)", NULL);
+        function = NULL;
+    }
+    timeout = dconfig->timeout >= 0 ? dconfig->timeout: sconfig->timeout;
+    deadline = monotonic_msec() + apr_time_as_msec(timeout);
+    retries = dconfig->retries >= 0 ? dconfig->retries: sconfig->retries;
+    if (retries > 0 && mod_vim_is_idempotent(r))
+        VimRetryBudget_deposit(retry_budget);
+    else
+        retries = 0;
+#ifdef USE_X11
+    hedge_delay = dconfig->hedge_delay != MOD_VIM_HEDGE_UNSET ? dconfig->hedge_delay: sconfig->hedge_delay;
+    /* there must be another server to turn to */
+    if (hedge_delay != 0 && r->method_number == M_GET && server_pool)
+        VimRetryBudget_deposit(hedge_budget);
+    else
+        hedge_delay = 0;
+#endif
+
+    if (server_pool) {
+        member = VimServerPool_acquire(server_pool, mod_vim_get_affinity_key(r), mod_vim_list_server_names,
+                                       mod_vim_is_server_usable, NULL);
+        if (!member) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "No Vim server is available in VimServerPool");
+            if (health)
+                mod_vim_set_retry_after(r, sconfig->health_check_interval > 0 ? sconfig->health_check_interval: sconfig->breaker_cooldown);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        server_name = member->name;
+    }
 
     if (!server_name) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "VimServerName is not set");
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    if (!orig_expr) {
+    if (!orig_expr && !function) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "VimExpr is not given");
+        if (member)
+            VimServerPool_release(server_pool, member);
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    /* Don't tie up this thread waiting on a server known to be down */
+    if (health && (health_server = VimHealth_getServer(health, server_name)) != NULL) {
+        apr_interval_time_t retry_after;
+
+        if (!VimHealth_allow(health, health_server, &retry_after)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "The server %s is unavailable", server_name);
+            if (member)
+                VimServerPool_release(server_pool, member);
+            mod_vim_set_retry_after(r, retry_after);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
     {
         int retval = OK;
         apr_bucket_alloc_t *bucket_alloc = apr_bucket_alloc_create(r->pool);
         apr_bucket_brigade *expr_bb = apr_brigade_create(r->pool, bucket_alloc);
+
+        if (function) {
+            apr_json_value_t *request_json;
+            apr_json_value_t args = { APR_JSON_ARRAY };
+            long remaining;
+            int result;
+
+            if ((status = mod_vim_build_request_value(&request_json, r, deadline, NULL, NULL, r->pool))) {
+                retval = HTTP_INTERNAL_SERVER_ERROR;
+                goto out_send_server;
+            }
+            args.value.array = apr_array_make(r->pool, 1, sizeof(apr_json_value_t *));
+            APR_ARRAY_PUSH(args.value.array, apr_json_value_t *) = request_json;
+
+            remaining = deadline - monotonic_msec();
+            started = apr_time_now();
+            if (health_server)
+                VimHealth_begin(health, health_server);
+            result = nvim ? VimNvimClient_callFunction(nvim, server_name, function, &args, &value, r->pool, remaining > 0 ? remaining: 0): VIM_REMOTE_ERROR;
+            if (health_server)
+                VimHealth_record(health, health_server, result, apr_time_now() - started);
+            switch (result) {
+            case VIM_REMOTE_OK:
+                break;
+            case VIM_REMOTE_TIMEOUT:
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Timed out waiting for the server %s", server_name);
+                retval = HTTP_GATEWAY_TIME_OUT;
+                break;
+            case VIM_REMOTE_EVAL_ERROR:
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "The server %s failed to call the function", server_name);
+                retval = HTTP_INTERNAL_SERVER_ERROR;
+                break;
+            default:
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to communicate with the server");
+                retval = HTTP_INTERNAL_SERVER_ERROR;
+                break;
+            }
+            goto out_send_server;
+        }
+
+#ifdef USE_X11
+        /* Without a client of our own there is no telling the responses
+         * sent in notifications apart; the request object then lacks
+         * "stream" or "ticket" and Vim is to answer the usual way.  A
+         * streamed response can be deferred as it is. */
+        if ((dconfig->stream > 0 || dconfig->deferred > 0) && dconfig->async <= 0
+                && transport == MOD_VIM_TRANSPORT_X11 && !broker) {
+            VimRemotingClient *client = mod_vim_get_client();
+            if (client && (stream = serverOpenStream(client, &tag)) == NULL) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to open a stream");
+                retval = HTTP_INTERNAL_SERVER_ERROR;
+                goto out_send_server;
+            }
+            if (stream) {
+                deferred = dconfig->stream <= 0;
+                tag_key = deferred ? "ticket": "stream";
+            }
+        }
+#endif
+
         {
             const char *p = orig_expr, *chunk = orig_expr;
 
@@ -422,7 +1910,7 @@ static int mod_vim_handler(request_rec *r)
                         goto out_send_server;
                     }
 
-                    mod_vim_build_request_json(&json, &json_len, r, subpool);
+                    mod_vim_build_request_json(&json, &json_len, r, deadline, tag_key, tag, subpool);
 
                     mod_vim_append_transient_bucket(expr_bb, chunk, p - chunk);
                     mod_vim_append_immortal_bucket(expr_bb, "\"", 1);
@@ -451,28 +1939,122 @@ static int mod_vim_handler(request_rec *r)
                 goto out_send_server;
             }
 
-            if (serverSendToVim(client, server_name, expr, expr_len, &result)) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to communicate with the server");
-                retval = HTTP_INTERNAL_SERVER_ERROR;
-                goto out_send_server;
+            {
+                long remaining = deadline - monotonic_msec();
+                int result;
+
+                /* Nobody waits for the result; the body is read already */
+                if (dconfig->async > 0) {
+                    if (!async_queue || VimAsyncQueue_push(async_queue, server_name, expr, expr_len, deadline)) {
+                        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Cannot queue the expression for the server %s", server_name);
+                        apr_table_setn(r->err_headers_out, "Retry-After", "1");
+                        retval = HTTP_SERVICE_UNAVAILABLE;
+                    }
+                    queued = 1;
+                    goto out_send_server;
+                }
+
+                started = apr_time_now();
+#ifdef USE_X11
+                if (stream && !deferred) {
+                    if (health_server)
+                        VimHealth_begin(health, health_server);
+                    retval = mod_vim_relay_stream(r, stream, server_name, expr, expr_len, deadline, &result);
+                    if (health_server)
+                        VimHealth_record(health, health_server, result, apr_time_now() - started);
+                    if (result == VIM_REMOTE_CANCELLED)
+                        mod_vim_cancel(r, server_name, tag);
+                    goto out_send_server;
+                }
+                if (stream) {
+                    if (health_server)
+                        VimHealth_begin(health, health_server);
+                    result = mod_vim_await_ticket(r, stream, server_name, expr, expr_len, deadline, &value);
+                    if (health_server)
+                        VimHealth_record(health, health_server, result, apr_time_now() - started);
+                } else
+#endif
+                {
+                    int attempt;
+
+                    /* The request object holds nothing of the server, so
+                     * the same expression can go to another.  One that
+                     * Vim failed to evaluate would only fail again. */
+                    for (attempt = 0; ; attempt++) {
+                        if (health_server)
+                            VimHealth_begin(health, health_server);
+#ifdef USE_X11
+                        if (hedge_delay != 0 && attempt == 0)
+                            result = mod_vim_send_hedged(r, expr, expr_len, remaining > 0 ? remaining: 0, hedge_delay,
+                                                         server_pool, &member, &server_name, &health_server, &value);
+                        else
+#endif
+                        result = mod_vim_send(r, server_name, expr, expr_len, remaining > 0 ? remaining: 0, &value);
+                        if (health_server)
+                            VimHealth_record(health, health_server, result, apr_time_now() - started);
+                        if (result != VIM_REMOTE_ERROR || attempt >= retries
+                                || !mod_vim_prepare_retry(r, attempt, deadline, server_pool, &member, &server_name, &health_server))
+                            break;
+                        remaining = deadline - monotonic_msec();
+                        started = apr_time_now();
+                    }
+                }
+                switch (result) {
+                case VIM_REMOTE_OK:
+                    break;
+                case VIM_REMOTE_CANCELLED:
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Client went away while waiting for the server %s", server_name);
+#ifdef USE_X11
+                    mod_vim_cancel(r, server_name, tag);
+#endif
+                    retval = DONE;
+                    goto out_send_server;
+                case VIM_REMOTE_TIMEOUT:
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Timed out waiting for the server %s", server_name);
+                    retval = HTTP_GATEWAY_TIME_OUT;
+                    goto out_send_server;
+                case VIM_REMOTE_EVAL_ERROR:
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "The server %s failed to evaluate the expression", server_name);
+                    retval = HTTP_INTERNAL_SERVER_ERROR;
+                    goto out_send_server;
+                default:
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Failed to communicate with the server");
+                    retval = HTTP_INTERNAL_SERVER_ERROR;
+                    goto out_send_server;
+                }
             }
         }
 
     out_send_server:
+#ifdef USE_X11
+        if (fleet)
+            VimFleet_count(fleet, server_name);
+#endif
+        if (member)
+            VimServerPool_release(server_pool, member);
         apr_brigade_destroy(expr_bb);
         apr_bucket_alloc_destroy(bucket_alloc);
+#ifdef USE_X11
+        if (stream) {
+            serverCloseStream(stream);
+            /* a streamed response went out already */
+            if (!deferred)
+                return retval;
+        }
+#endif
         if (retval != OK)
             return retval;
+        if (queued) {
+            r->status = HTTP_ACCEPTED;
+            return OK;
+        }
     }
 
-    if (apr_json_decode(&value, result, strlen(result), r->pool) || value->type != APR_JSON_ARRAY || value->value.array->nelts != 3) {
-        free(result);
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server: the response must be a three-element array -- %s", result);
+    if (value->type != APR_JSON_ARRAY || value->value.array->nelts != 3) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server: the response must be a three-element array");
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    free(result);
-
     if (((apr_json_value_t **)value->value.array->elts)[0]->type != APR_JSON_LONG) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server: first element must be an integer that represents HTTP status");
         return HTTP_INTERNAL_SERVER_ERROR;
@@ -491,23 +2073,9 @@ static int mod_vim_handler(request_rec *r)
     r->status = ((apr_json_value_t **)value->value.array->elts)[0]->value.lnumber;
 
     {
-        apr_hash_t *headers = ((apr_json_value_t **)value->value.array->elts)[1]->value.object;
-        apr_hash_index_t *i;
-        for (i = apr_hash_first(r->pool, headers); i; i = apr_hash_next(i)) {
-            const char *key;
-            apr_ssize_t key_len;
-            apr_json_value_t *value;
-            apr_hash_this(i, (const void **)&key, &key_len, (void **)&value);
-
-            if (value->type != APR_JSON_STRING) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Invalid JSON response from the Vim server: header value must be a string");
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            if (strcasecmp(key, "Content-Type") == 0)
-                r->content_type = value->value.string.p;
-            else
-                apr_table_set(r->headers_out, key, value->value.string.p);
-        }
+        int retval = mod_vim_set_headers(r, ((apr_json_value_t **)value->value.array->elts)[1]->value.object);
+        if (retval != OK)
+            return retval;
     }
 
     if (r->header_only)
@@ -540,8 +2108,7 @@ static int mod_vim_init(server_rec *s)
 static apr_status_t mod_vim_cleanup(void *tmp)
 {
     VimRemotingClient_delete(client);
-    if (dpy)
-        XCloseDisplay(dpy);
+    client = NULL;
     conv_cleanup();
     return APR_SUCCESS;
 }
@@ -552,22 +2119,102 @@ static apr_status_t mod_vim_child_cleanup(void *tmp)
     return APR_SUCCESS;
 }
 
-static void mod_vim_child_init(apr_pool_t *pchild, server_rec *s)
+#ifdef USE_X11
+static void mod_vim_delete_thread_client(void *data)
+{
+    VimRemotingClient_delete(data);
+}
+#endif
+
+static void mod_vim_child_init_transport(apr_pool_t *pchild, server_rec *s)
 {
     mod_vim_server_config *config = ap_get_module_config(s->module_config, &vim_module);
     conv_init();
+    if (transport == MOD_VIM_TRANSPORT_NVIM) {
+        nvim = VimNvimClient_new(s, pchild);
+        apr_pool_cleanup_register(pchild, NULL, mod_vim_child_cleanup, apr_pool_cleanup_null);
+        return;
+    }
+    if (broker || transport == MOD_VIM_TRANSPORT_CHANNEL) {
+        /* the broker forked from the parent holds the X connection or the
+         * channels */
+        apr_pool_cleanup_register(pchild, NULL, mod_vim_child_cleanup, apr_pool_cleanup_null);
+        return;
+    }
 #ifdef USE_X11
+#ifndef USE_XCB
     XInitThreads();
-    dpy = XOpenDisplay(config->display);
-    if (!dpy) {
-        conv_cleanup();
-        return;
+#endif
+    main_server = s;
+    client_key = NULL;
+    if (config->thread_connections && config->dispatcher_thread)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "VimThreadConnections is ignored with VimDispatcherThread");
+    if (config->thread_connections && !config->dispatcher_thread) {
+        /* the connections are opened by the threads as they need them */
+        if (apr_threadkey_private_create(&client_key, mod_vim_delete_thread_client, pchild)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Cannot create a thread key for the X connections");
+            conv_cleanup();
+            return;
+        }
+    } else {
+        client = VimRemotingClient_new(s, config->vim_version, config->encoding, config->display);
+        if (!client) {
+            conv_cleanup();
+            return;
+        }
+        if (config->dispatcher_thread && VimRemotingClient_startDispatcher(client)) {
+            VimRemotingClient_delete(client);
+            client = NULL;
+            conv_cleanup();
+            return;
+        }
     }
-    client = VimRemotingClient_new(s, config->vim_version, config->encoding, dpy);
 #endif
     apr_pool_cleanup_register(pchild, NULL, mod_vim_cleanup, apr_pool_cleanup_null);
 }
 
+static void mod_vim_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    mod_vim_server_config *config = ap_get_module_config(s->module_config, &vim_module);
+    server_rec *sv;
+    int hedge_auto;
+
+    mod_vim_child_init_transport(pchild, s);
+
+    retry_budget = VimRetryBudget_new(pchild, config->retry_budget);
+#ifdef USE_X11
+    hedge_budget = VimRetryBudget_new(pchild, config->hedge_ratio);
+#endif
+
+    /* Stopped before the transport goes away too.  The sender thread is
+     * only started when some location has VimAsync on */
+    async_queue = NULL;
+    for (sv = s; sv; sv = sv->next) {
+        mod_vim_server_config *sconfig = ap_get_module_config(sv->module_config, &vim_module);
+        if (sconfig->async_used) {
+            async_queue = VimAsyncQueue_new(s, pchild, config->async_queue_size, mod_vim_send_async, NULL);
+            break;
+        }
+    }
+
+    /* Set up after the transport, so that the prober is stopped before the
+     * transport goes away */
+    health = NULL;
+    hedge_auto = FALSE;
+    for (sv = s; sv; sv = sv->next) {
+        mod_vim_server_config *sconfig = ap_get_module_config(sv->module_config, &vim_module);
+        if (sconfig->hedge_auto_used)
+            hedge_auto = TRUE;
+    }
+    if (config->breaker_threshold > 0 || config->health_check_interval > 0 || hedge_auto) {
+        health = VimHealth_new(s, pchild, config->breaker_threshold, config->breaker_cooldown);
+        if (health && config->health_check_interval > 0)
+            VimHealth_startProber(health, pchild, config->health_check_interval,
+                                  (long)apr_time_as_msec(config->health_check_timeout),
+                                  config->health_check_expr, mod_vim_probe, NULL);
+    }
+}
+
 static int mod_vim_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 {
     void *data;
@@ -583,10 +2230,57 @@ static int mod_vim_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *
 
     if (mod_vim_init(s)) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to initialize Vim module");
-        return DECLINED;
+        return HTTP_INTERNAL_SERVER_ERROR;
     }
     apr_pool_cleanup_register(pconf, NULL, mod_vim_cleanup, apr_pool_cleanup_null);
 
+    {
+        mod_vim_server_config *config = ap_get_module_config(s->module_config, &vim_module);
+
+        transport = config->transport;
+        nvim = NULL;
+        broker = NULL;
+        if (transport == MOD_VIM_TRANSPORT_CHANNEL) {
+            VimChannelServer *channel;
+
+            if (!config->channel_address) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "VimChannelListen is required for VimTransport channel");
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+            /* Each Vim connects once, so a single process must hold every
+             * connection for all the children to reach all the Vims */
+            channel = VimChannelServer_new(s, pconf, config->channel_address);
+            if (!channel)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            broker = VimBroker_new(s, pconf, config->broker_slots, config->broker_slot_size);
+            if (!broker || VimBroker_startChannel(broker, pconf, channel)) {
+                broker = NULL;
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+#ifdef USE_X11
+        if (transport == MOD_VIM_TRANSPORT_X11 && config->broker) {
+            /* forked anew on every restart, as pconf is cleared */
+            broker = VimBroker_new(s, pconf, config->broker_slots, config->broker_slot_size);
+            if (!broker || VimBroker_start(broker, pconf, config->vim_version, config->encoding, config->display, config->dispatcher_thread)) {
+                broker = NULL;
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+        fleet = NULL;
+        if (transport == MOD_VIM_TRANSPORT_X11 && config->fleet_groups->nelts > 0) {
+            /* retired servers are given as long as a request may take */
+            fleet = VimFleet_new(s, pconf, config->fleet_groups, config->fleet_command,
+                                 config->fleet_max_requests, (apr_off_t)config->fleet_max_rss << 20,
+                                 config->timeout);
+            if (!fleet || VimFleet_start(fleet, pconf, config->display)) {
+                fleet = NULL;
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+#endif
+    }
+
     return OK;
 }
 
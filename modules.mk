@@ -1,4 +1,4 @@
-mod_vim.la: mod_vim.slo ga.slo utils.slo conv.slo remote.slo
-	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version mod_vim.lo ga.lo utils.lo conv.lo remote.lo $(LIBS)
+mod_vim.la: mod_vim.slo ga.slo utils.slo conv.slo remote.slo pool.slo channel.slo msgpack.slo nvim.slo broker.slo health.slo async.slo fleet.slo retry.slo
+	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version mod_vim.lo ga.lo utils.lo conv.lo remote.lo pool.lo channel.lo msgpack.lo nvim.lo broker.lo health.lo async.lo fleet.lo retry.lo $(LIBS)
 DISTCLEAN_TARGETS = modules.mk
 shared =  mod_vim.la
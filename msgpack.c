@@ -0,0 +1,480 @@
+#include <string.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_tables.h>
+#include "msgpack.h"
+
+/* How deep arrays and maps may nest in what we unpack */
+#define MSGPACK_MAX_DEPTH 64
+
+typedef enum msgpack_kind {
+    MSGPACK_NIL,
+    MSGPACK_BOOLEAN,
+    MSGPACK_UINT,
+    MSGPACK_INT,
+    MSGPACK_FLOAT,
+    MSGPACK_STR,
+    MSGPACK_BIN,
+    MSGPACK_ARRAY,
+    MSGPACK_MAP,
+    MSGPACK_EXT
+} msgpack_kind;
+
+typedef struct msgpack_header {
+    msgpack_kind kind;
+    /* length of str, bin and ext, number of items of array and map,
+     * value of uint and boolean */
+    apr_uint64_t n;
+    apr_int64_t i;
+    double d;
+} msgpack_header;
+
+static int put(garray_T *ga, const unsigned char *data, apr_size_t len)
+{
+    if (ga_grow(ga, len))
+        return -1;
+    memcpy((char *)ga->ga_data + ga->ga_len, data, len);
+    ga->ga_len += len;
+    return 0;
+}
+
+/*
+ * Write the tag byte "tag" followed by "v" in "size" bytes, big endian.
+ */
+static int putTagged(garray_T *ga, unsigned char tag, apr_uint64_t v, int size)
+{
+    unsigned char buf[9];
+    int i;
+
+    buf[0] = tag;
+    for (i = size; i > 0; i--) {
+        buf[i] = v & 0xff;
+        v >>= 8;
+    }
+    return put(ga, buf, size + 1);
+}
+
+static apr_uint64_t getBigEndian(const unsigned char *p, int size)
+{
+    apr_uint64_t v = 0;
+    while (size-- > 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+int msgpack_pack_nil(garray_T *ga)
+{
+    unsigned char c = 0xc0;
+    return put(ga, &c, 1);
+}
+
+int msgpack_pack_int(garray_T *ga, apr_int64_t v)
+{
+    if (v >= 0) {
+        if (v < 0x80)
+            return putTagged(ga, (unsigned char)v, 0, 0);
+        if (v < 0x100)
+            return putTagged(ga, 0xcc, v, 1);
+        if (v < 0x10000)
+            return putTagged(ga, 0xcd, v, 2);
+        if (v < ((apr_int64_t)1 << 32))
+            return putTagged(ga, 0xce, v, 4);
+        return putTagged(ga, 0xcf, v, 8);
+    }
+    if (v >= -32)
+        return putTagged(ga, (unsigned char)(v & 0xff), 0, 0);
+    if (v >= -0x80)
+        return putTagged(ga, 0xd0, (apr_uint64_t)v, 1);
+    if (v >= -0x8000)
+        return putTagged(ga, 0xd1, (apr_uint64_t)v, 2);
+    if (v >= -((apr_int64_t)1 << 31))
+        return putTagged(ga, 0xd2, (apr_uint64_t)v, 4);
+    return putTagged(ga, 0xd3, (apr_uint64_t)v, 8);
+}
+
+static int packDouble(garray_T *ga, double d)
+{
+    apr_uint64_t v;
+    memcpy(&v, &d, sizeof(v));
+    return putTagged(ga, 0xcb, v, 8);
+}
+
+int msgpack_pack_str(garray_T *ga, const char *s, apr_size_t len)
+{
+    int status;
+
+    if (len < 32)
+        status = putTagged(ga, 0xa0 | len, 0, 0);
+    else if (len < 0x100)
+        status = putTagged(ga, 0xd9, len, 1);
+    else if (len < 0x10000)
+        status = putTagged(ga, 0xda, len, 2);
+    else
+        status = putTagged(ga, 0xdb, len, 4);
+    return status ? status: put(ga, (const unsigned char *)s, len);
+}
+
+int msgpack_pack_array(garray_T *ga, apr_uint32_t n)
+{
+    if (n < 16)
+        return putTagged(ga, 0x90 | n, 0, 0);
+    if (n < 0x10000)
+        return putTagged(ga, 0xdc, n, 2);
+    return putTagged(ga, 0xdd, n, 4);
+}
+
+int msgpack_pack_map(garray_T *ga, apr_uint32_t n)
+{
+    if (n < 16)
+        return putTagged(ga, 0x80 | n, 0, 0);
+    if (n < 0x10000)
+        return putTagged(ga, 0xde, n, 2);
+    return putTagged(ga, 0xdf, n, 4);
+}
+
+/*
+ * Append "value" to "ga" in MessagePack.
+ * Return 0 for OK, -1 for error.
+ */
+int msgpack_pack_value(garray_T *ga, const apr_json_value_t *value)
+{
+    switch (value->type) {
+    case APR_JSON_NULL:
+        return msgpack_pack_nil(ga);
+    case APR_JSON_BOOLEAN:
+        return putTagged(ga, value->value.boolean ? 0xc3: 0xc2, 0, 0);
+    case APR_JSON_LONG:
+        return msgpack_pack_int(ga, value->value.lnumber);
+    case APR_JSON_DOUBLE:
+        return packDouble(ga, value->value.dnumber);
+    case APR_JSON_STRING:
+        return msgpack_pack_str(ga, value->value.string.p, value->value.string.len);
+    case APR_JSON_ARRAY:
+        {
+            int i;
+
+            if (msgpack_pack_array(ga, value->value.array->nelts))
+                return -1;
+            for (i = 0; i < value->value.array->nelts; i++) {
+                if (msgpack_pack_value(ga, ((apr_json_value_t **)value->value.array->elts)[i]))
+                    return -1;
+            }
+        }
+        return 0;
+    case APR_JSON_OBJECT:
+        {
+            apr_hash_index_t *i;
+
+            if (msgpack_pack_map(ga, apr_hash_count(value->value.object)))
+                return -1;
+            for (i = apr_hash_first(NULL, value->value.object); i; i = apr_hash_next(i)) {
+                const void *key;
+                apr_ssize_t key_len;
+                void *item;
+
+                apr_hash_this(i, &key, &key_len, &item);
+                if (key_len == APR_HASH_KEY_STRING)
+                    key_len = strlen(key);
+                if (msgpack_pack_str(ga, key, key_len)
+                        || msgpack_pack_value(ga, item))
+                    return -1;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Read the header of the object at "*p", advancing "*p" past it.  The
+ * payload of str, bin and ext is left to the caller; the type byte of ext
+ * is skipped.
+ * Returns 0 for OK, 1 if more bytes are needed, -1 for malformed data.
+ */
+static int readHeader(const char **p, const char *e, msgpack_header *h)
+{
+    const unsigned char *q = (const unsigned char *)*p;
+    apr_size_t avail = e - *p;
+    int size = 0;
+    unsigned char c;
+
+    if (avail < 1)
+        return 1;
+    c = *q++;
+
+    if (c < 0x80) {
+        h->kind = MSGPACK_UINT;
+        h->n = c;
+    } else if (c < 0x90) {
+        h->kind = MSGPACK_MAP;
+        h->n = c & 0x0f;
+    } else if (c < 0xa0) {
+        h->kind = MSGPACK_ARRAY;
+        h->n = c & 0x0f;
+    } else if (c < 0xc0) {
+        h->kind = MSGPACK_STR;
+        h->n = c & 0x1f;
+    } else if (c >= 0xe0) {
+        h->kind = MSGPACK_INT;
+        h->i = (signed char)c;
+    } else {
+        switch (c) {
+        case 0xc0:
+            h->kind = MSGPACK_NIL;
+            break;
+        case 0xc2:
+        case 0xc3:
+            h->kind = MSGPACK_BOOLEAN;
+            h->n = c & 1;
+            break;
+        case 0xc4: case 0xc5: case 0xc6:
+            h->kind = MSGPACK_BIN;
+            size = 1 << (c - 0xc4);
+            break;
+        case 0xc7: case 0xc8: case 0xc9:
+            h->kind = MSGPACK_EXT;
+            size = 1 << (c - 0xc7);
+            break;
+        case 0xca: case 0xcb:
+            h->kind = MSGPACK_FLOAT;
+            size = c == 0xca ? 4: 8;
+            break;
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            h->kind = MSGPACK_UINT;
+            size = 1 << (c - 0xcc);
+            break;
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+            h->kind = MSGPACK_INT;
+            size = 1 << (c - 0xd0);
+            break;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+            h->kind = MSGPACK_EXT;
+            h->n = 1 << (c - 0xd4);
+            break;
+        case 0xd9: case 0xda: case 0xdb:
+            h->kind = MSGPACK_STR;
+            size = 1 << (c - 0xd9);
+            break;
+        case 0xdc: case 0xdd:
+            h->kind = MSGPACK_ARRAY;
+            size = c == 0xdc ? 2: 4;
+            break;
+        case 0xde: case 0xdf:
+            h->kind = MSGPACK_MAP;
+            size = c == 0xde ? 2: 4;
+            break;
+        default:
+            return -1;
+        }
+
+        if (avail < 1 + (apr_size_t)size)
+            return 1;
+
+        if (size > 0) {
+            apr_uint64_t v = getBigEndian(q, size);
+            q += size;
+
+            switch (h->kind) {
+            case MSGPACK_FLOAT:
+                if (size == 4) {
+                    apr_uint32_t v32 = (apr_uint32_t)v;
+                    float f;
+                    memcpy(&f, &v32, sizeof(f));
+                    h->d = f;
+                } else {
+                    memcpy(&h->d, &v, sizeof(h->d));
+                }
+                break;
+            case MSGPACK_INT:
+                /* sign-extend */
+                if (size < 8 && (v & ((apr_uint64_t)1 << (size * 8 - 1))))
+                    v |= ~(apr_uint64_t)0 << (size * 8);
+                h->i = (apr_int64_t)v;
+                break;
+            default:
+                h->n = v;
+                break;
+            }
+        }
+
+        /* the type of ext */
+        if (h->kind == MSGPACK_EXT) {
+            if ((const char *)q >= e)
+                return 1;
+            q++;
+        }
+    }
+
+    *p = (const char *)q;
+    return 0;
+}
+
+/*
+ * Returns the length of the object starting at "p", 0 if "len" bytes
+ * don't hold the whole object yet, or -1 for malformed data.
+ */
+apr_ssize_t msgpack_measure(const char *p, apr_size_t len)
+{
+    const char *q = p, *e = p + len;
+    apr_uint64_t need = 1;
+
+    while (need > 0) {
+        msgpack_header h;
+        int status = readHeader(&q, e, &h);
+
+        if (status)
+            return status > 0 ? 0: -1;
+        need--;
+
+        switch (h.kind) {
+        case MSGPACK_STR:
+        case MSGPACK_BIN:
+        case MSGPACK_EXT:
+            if ((apr_uint64_t)(e - q) < h.n)
+                return 0;
+            q += h.n;
+            break;
+        case MSGPACK_ARRAY:
+            need += h.n;
+            break;
+        case MSGPACK_MAP:
+            need += h.n * 2;
+            break;
+        default:
+            break;
+        }
+    }
+    return q - p;
+}
+
+/*
+ * Read the header of an array at "*p" and store the number of its items.
+ * Returns 0 for OK, -1 if there isn't an array.
+ */
+int msgpack_read_array(const char **p, const char *e, apr_uint32_t *n)
+{
+    msgpack_header h;
+    const char *q = *p;
+
+    if (readHeader(&q, e, &h) || h.kind != MSGPACK_ARRAY)
+        return -1;
+    *n = (apr_uint32_t)h.n;
+    *p = q;
+    return 0;
+}
+
+/*
+ * Read an integer at "*p".
+ * Returns 0 for OK, -1 if there isn't an integer.
+ */
+int msgpack_read_int(const char **p, const char *e, apr_int64_t *v)
+{
+    msgpack_header h;
+    const char *q = *p;
+
+    if (readHeader(&q, e, &h))
+        return -1;
+    if (h.kind == MSGPACK_UINT)
+        *v = (apr_int64_t)h.n;
+    else if (h.kind == MSGPACK_INT)
+        *v = h.i;
+    else
+        return -1;
+    *p = q;
+    return 0;
+}
+
+static int unpack(apr_json_value_t **value, const char **p, const char *e, apr_pool_t *pool, int depth)
+{
+    msgpack_header h;
+    apr_json_value_t *v;
+
+    if (depth > MSGPACK_MAX_DEPTH || readHeader(p, e, &h))
+        return -1;
+
+    v = apr_pcalloc(pool, sizeof(*v));
+    switch (h.kind) {
+    case MSGPACK_NIL:
+        v->type = APR_JSON_NULL;
+        break;
+    case MSGPACK_BOOLEAN:
+        v->type = APR_JSON_BOOLEAN;
+        v->value.boolean = (int)h.n;
+        break;
+    case MSGPACK_UINT:
+        v->type = APR_JSON_LONG;
+        v->value.lnumber = (apr_int64_t)h.n;
+        break;
+    case MSGPACK_INT:
+        v->type = APR_JSON_LONG;
+        v->value.lnumber = h.i;
+        break;
+    case MSGPACK_FLOAT:
+        v->type = APR_JSON_DOUBLE;
+        v->value.dnumber = h.d;
+        break;
+    case MSGPACK_STR:
+    case MSGPACK_BIN:
+        if ((apr_uint64_t)(e - *p) < h.n)
+            return -1;
+        v->type = APR_JSON_STRING;
+        v->value.string.p = apr_pstrmemdup(pool, *p, h.n);
+        v->value.string.len = h.n;
+        *p += h.n;
+        break;
+    case MSGPACK_EXT:
+        /* Buffer, Window and Tabpage handles; nothing we could use */
+        if ((apr_uint64_t)(e - *p) < h.n)
+            return -1;
+        v->type = APR_JSON_NULL;
+        *p += h.n;
+        break;
+    case MSGPACK_ARRAY:
+        {
+            apr_uint64_t i;
+
+            if (h.n > (apr_uint64_t)(e - *p))
+                return -1;
+            v->type = APR_JSON_ARRAY;
+            v->value.array = apr_array_make(pool, h.n ? (int)h.n: 1, sizeof(apr_json_value_t *));
+            for (i = 0; i < h.n; i++) {
+                if (unpack(&APR_ARRAY_PUSH(v->value.array, apr_json_value_t *), p, e, pool, depth + 1))
+                    return -1;
+            }
+        }
+        break;
+    case MSGPACK_MAP:
+        {
+            apr_uint64_t i;
+
+            if (h.n > (apr_uint64_t)(e - *p))
+                return -1;
+            v->type = APR_JSON_OBJECT;
+            v->value.object = apr_hash_make(pool);
+            for (i = 0; i < h.n; i++) {
+                apr_json_value_t *key, *item;
+
+                if (unpack(&key, p, e, pool, depth + 1)
+                        || unpack(&item, p, e, pool, depth + 1))
+                    return -1;
+                if (key->type != APR_JSON_STRING)
+                    return -1;
+                apr_hash_set(v->value.object, key->value.string.p, key->value.string.len, item);
+            }
+        }
+        break;
+    }
+
+    *value = v;
+    return 0;
+}
+
+/*
+ * Unpack the object at "*p" into an apr_json_value_t allocated from "pool".
+ * Strings and binaries both become strings; ext objects become null.
+ * Returns 0 for OK, -1 for malformed data.
+ */
+int msgpack_unpack(apr_json_value_t **value, const char **p, const char *e, apr_pool_t *pool)
+{
+    return unpack(value, p, e, pool, 0);
+}
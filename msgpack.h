@@ -0,0 +1,26 @@
+#ifndef MSGPACK_H
+#define MSGPACK_H
+
+#include <apr_pools.h>
+#include <apr_json.h>
+#include "ga.h"
+
+/*
+ * Just enough of MessagePack to speak Neovim's msgpack-RPC.  Values are
+ * exchanged as apr_json_value_t so that the callers don't have to care
+ * about which transport produced them.
+ */
+
+int msgpack_pack_nil(garray_T *ga);
+int msgpack_pack_int(garray_T *ga, apr_int64_t v);
+int msgpack_pack_str(garray_T *ga, const char *s, apr_size_t len);
+int msgpack_pack_array(garray_T *ga, apr_uint32_t n);
+int msgpack_pack_map(garray_T *ga, apr_uint32_t n);
+int msgpack_pack_value(garray_T *ga, const apr_json_value_t *value);
+
+apr_ssize_t msgpack_measure(const char *p, apr_size_t len);
+int msgpack_read_array(const char **p, const char *e, apr_uint32_t *n);
+int msgpack_read_int(const char **p, const char *e, apr_int64_t *v);
+int msgpack_unpack(apr_json_value_t **value, const char **p, const char *e, apr_pool_t *pool);
+
+#endif /* MSGPACK_H */
@@ -0,0 +1,586 @@
+#include <stdlib.h>
+#include <string.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_strings.h>
+#include <apr_network_io.h>
+#include <apr_poll.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include "ga.h"
+#include "utils.h"
+#include "remote.h"
+#include "msgpack.h"
+#include "nvim.h"
+
+#define NVIM_MAX_CONNECTIONS 64
+
+/* msgpack-RPC message types */
+#define NVIM_RPC_REQUEST 0
+#define NVIM_RPC_RESPONSE 1
+#define NVIM_RPC_NOTIFICATION 2
+
+/*
+ * A request sent to Neovim whose response is still awaited.
+ */
+typedef struct VimNvimClient_Pending {
+    apr_uint32_t msgid;
+    /* The whole response message (malloc'ed).  NULL means still pending. */
+    char *message;
+    apr_size_t message_len;
+    /* Set when the connection is lost before the response arrives */
+    int failed;
+    struct VimNvimClient_Pending *nextPtr;
+} VimNvimClient_Pending;
+
+typedef struct VimNvimClient_Connection {
+    apr_pool_t *pool;
+    /* The address connected to (malloc'ed) */
+    char *address;
+    apr_socket_t *socket;
+    apr_pollfd_t pfd;
+    /* TRUE once the connection is closed */
+    int dead;
+    /* Number of threads using the connection */
+    unsigned int refcount;
+    /* Serializes writes of whole messages */
+    apr_thread_mutex_t *writeMutex;
+    /* Bytes received that don't make up a whole message yet */
+    garray_T buf;
+    VimNvimClient_Pending *pendings;
+    struct VimNvimClient_Connection *nextPtr;
+} VimNvimClient_Connection;
+
+struct VimNvimClient {
+    server_rec *server_rec;
+    apr_pollset_t *pollset;
+    apr_thread_t *thread;
+    volatile int stopping;
+
+    /* Guards everything below, and the pendings of all connections */
+    apr_thread_mutex_t *mutex;
+    /* Broadcast when a response arrives or a connection goes */
+    apr_thread_cond_t *cond;
+    VimNvimClient_Connection *connections;
+    apr_uint32_t lastMsgid;
+};
+
+static void releaseConnection(VimNvimClient *client, VimNvimClient_Connection *conn)
+{
+    if (--conn->refcount > 0 || !conn->dead)
+        return;
+    free(conn->address);
+    ga_clear(&conn->buf);
+    apr_pool_destroy(conn->pool);
+    free(conn);
+}
+
+/*
+ * Forget a connection that got closed and fail everything awaited on it.
+ * Must be called with the mutex held.
+ */
+static void closeConnection(VimNvimClient *client, VimNvimClient_Connection *conn)
+{
+    VimNvimClient_Connection **pp;
+    VimNvimClient_Pending *pending;
+
+    if (conn->dead)
+        return;
+
+    for (pp = &client->connections; *pp; pp = &(*pp)->nextPtr) {
+        if (*pp == conn) {
+            *pp = conn->nextPtr;
+            break;
+        }
+    }
+
+    for (pending = conn->pendings; pending; pending = pending->nextPtr)
+        pending->failed = TRUE;
+
+    apr_pollset_remove(client->pollset, &conn->pfd);
+    apr_socket_close(conn->socket);
+    conn->dead = TRUE;
+    apr_thread_cond_broadcast(client->cond);
+    releaseConnection(client, conn);
+}
+
+static apr_status_t sendMessage(VimNvimClient_Connection *conn, const char *data, apr_size_t len)
+{
+    apr_status_t status = APR_SUCCESS;
+
+    apr_thread_mutex_lock(conn->writeMutex);
+    while (len > 0) {
+        apr_size_t n = len;
+        if ((status = apr_socket_send(conn->socket, data, &n)))
+            break;
+        data += n;
+        len -= n;
+    }
+    apr_thread_mutex_unlock(conn->writeMutex);
+    return status;
+}
+
+/*
+ * Open a connection to "address", which is a socket path (optionally
+ * prefixed with "unix:") or host:port, giving up at "deadline".
+ */
+static apr_status_t openSocket(apr_socket_t **socket, const char *address, long long deadline, apr_pool_t *pool)
+{
+    apr_status_t status;
+    apr_sockaddr_t *sa;
+    int family;
+
+    if (strncmp(address, "unix:", 5) == 0)
+        address += 5;
+
+    if (address[0] == '/' || !strchr(address, ':')) {
+        if ((status = apr_sockaddr_info_get(&sa, address, APR_UNIX, 0, 0, pool)))
+            return status;
+        family = APR_UNIX;
+    } else {
+        char *host, *scope_id;
+        apr_port_t port;
+
+        if ((status = apr_parse_addr_port(&host, &scope_id, &port, address, pool)))
+            return status;
+        if (!host || !port)
+            return APR_EINVAL;
+        if ((status = apr_sockaddr_info_get(&sa, host, APR_UNSPEC, port, 0, pool)))
+            return status;
+        family = sa->family;
+    }
+
+    if ((status = apr_socket_create(socket, family, SOCK_STREAM, 0, pool)))
+        return status;
+    if (deadline >= 0) {
+        long long remaining = deadline - monotonic_msec();
+        apr_socket_timeout_set(*socket, apr_time_from_msec(remaining > 0 ? remaining: 0));
+    }
+    if ((status = apr_socket_connect(*socket, sa))) {
+        apr_socket_close(*socket);
+        return status;
+    }
+    if (family != APR_UNIX)
+        apr_socket_opt_set(*socket, APR_TCP_NODELAY, 1);
+    /* writes block; reads are only done when the socket polled readable */
+    apr_socket_timeout_set(*socket, -1);
+    return APR_SUCCESS;
+}
+
+/*
+ * Must be called with the mutex held.
+ */
+static VimNvimClient_Connection *findConnection(VimNvimClient *client, const char *address)
+{
+    VimNvimClient_Connection *conn;
+
+    for (conn = client->connections; conn; conn = conn->nextPtr) {
+        if (strcmp(conn->address, address) == 0)
+            return conn;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the connection to "address", connecting to it first if needed,
+ * with its reference count incremented.  Returns NULL on failure.
+ */
+static VimNvimClient_Connection *acquireConnection(VimNvimClient *client, const char *address, long long deadline)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    VimNvimClient_Connection *conn;
+
+    apr_thread_mutex_lock(client->mutex);
+    conn = findConnection(client, address);
+    if (conn)
+        conn->refcount++;
+    apr_thread_mutex_unlock(client->mutex);
+    if (conn)
+        return conn;
+
+    if ((status = apr_pool_create(&pool, NULL)))
+        return NULL;
+
+    conn = malloc(sizeof(*conn));
+    if (!conn)
+        goto fail;
+    conn->address = strdup(address);
+    if (!conn->address)
+        goto fail;
+    if ((status = apr_thread_mutex_create(&conn->writeMutex, APR_THREAD_MUTEX_DEFAULT, pool)))
+        goto fail;
+    if ((status = openSocket(&conn->socket, address, deadline, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, client->server_rec, "Cannot connect to Neovim at %s", address);
+        goto fail;
+    }
+
+    conn->pool = pool;
+    conn->dead = FALSE;
+    conn->refcount = 2;
+    conn->pendings = NULL;
+    ga_init2(&conn->buf, 1, 4096);
+
+    conn->pfd.p = pool;
+    conn->pfd.desc_type = APR_POLL_SOCKET;
+    conn->pfd.desc.s = conn->socket;
+    conn->pfd.reqevents = APR_POLLIN;
+    conn->pfd.rtnevents = 0;
+    conn->pfd.client_data = conn;
+
+    apr_thread_mutex_lock(client->mutex);
+    {
+        /* another thread may have connected in the meantime */
+        VimNvimClient_Connection *other = findConnection(client, address);
+        if (other) {
+            other->refcount++;
+            apr_thread_mutex_unlock(client->mutex);
+            apr_socket_close(conn->socket);
+            free(conn->address);
+            free(conn);
+            apr_pool_destroy(pool);
+            return other;
+        }
+    }
+    conn->nextPtr = client->connections;
+    client->connections = conn;
+    apr_pollset_add(client->pollset, &conn->pfd);
+    apr_thread_mutex_unlock(client->mutex);
+    return conn;
+
+fail:
+    if (conn)
+        free(conn->address);
+    free(conn);
+    apr_pool_destroy(pool);
+    return NULL;
+}
+
+/*
+ * Dispatch one complete message received from Neovim.
+ */
+static void handleMessage(VimNvimClient *client, VimNvimClient_Connection *conn, const char *msg, apr_size_t msg_len)
+{
+    const char *p = msg, *e = msg + msg_len;
+    apr_uint32_t n;
+    apr_int64_t type, msgid;
+    VimNvimClient_Pending *pending;
+
+    if (msgpack_read_array(&p, e, &n) || msgpack_read_int(&p, e, &type))
+        return;
+
+    if (type == NVIM_RPC_REQUEST && n == 4 && !msgpack_read_int(&p, e, &msgid)) {
+        /* we don't serve any method */
+        garray_T ga;
+        static const char error[] = "mod_vim doesn't handle requests";
+
+        ga_init2(&ga, 1, 64);
+        if (!msgpack_pack_array(&ga, 4)
+                && !msgpack_pack_int(&ga, NVIM_RPC_RESPONSE)
+                && !msgpack_pack_int(&ga, msgid)
+                && !msgpack_pack_str(&ga, error, sizeof(error) - 1)
+                && !msgpack_pack_nil(&ga))
+            sendMessage(conn, ga.ga_data, ga.ga_len);
+        ga_clear(&ga);
+        return;
+    }
+
+    if (type != NVIM_RPC_RESPONSE || n != 4 || msgpack_read_int(&p, e, &msgid))
+        return;
+
+    apr_thread_mutex_lock(client->mutex);
+    for (pending = conn->pendings; pending; pending = pending->nextPtr) {
+        if (pending->msgid == (apr_uint32_t)msgid && !pending->message) {
+            pending->message = malloc(msg_len);
+            if (pending->message) {
+                memcpy(pending->message, msg, msg_len);
+                pending->message_len = msg_len;
+            } else {
+                pending->failed = TRUE;
+            }
+            apr_thread_cond_broadcast(client->cond);
+            break;
+        }
+    }
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+/*
+ * Read what is available on a connection that polled readable and
+ * dispatch the complete messages.
+ */
+static void readConnection(VimNvimClient *client, VimNvimClient_Connection *conn)
+{
+    apr_status_t status = APR_SUCCESS;
+    apr_size_t len;
+
+    if (!ga_grow(&conn->buf, 4096)) {
+        char *data;
+        apr_size_t start = 0;
+
+        len = conn->buf.ga_maxlen - conn->buf.ga_len;
+        status = apr_socket_recv(conn->socket, (char *)conn->buf.ga_data + conn->buf.ga_len, &len);
+        conn->buf.ga_len += len;
+
+        data = conn->buf.ga_data;
+        while (start < conn->buf.ga_len) {
+            apr_ssize_t msg_len = msgpack_measure(data + start, conn->buf.ga_len - start);
+            if (msg_len == 0)
+                break;
+            if (msg_len < 0) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Malformed message from Neovim at %s", conn->address);
+                status = APR_EGENERAL;
+                break;
+            }
+            handleMessage(client, conn, data + start, msg_len);
+            start += msg_len;
+        }
+        memmove(data, data + start, conn->buf.ga_len - start);
+        conn->buf.ga_len -= start;
+
+        if (!status || APR_STATUS_IS_EAGAIN(status))
+            return;
+    }
+
+    apr_thread_mutex_lock(client->mutex);
+    closeConnection(client, conn);
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+/*
+ * The thread that reads the responses from every Neovim connected to.
+ * Requests are written by the request threads themselves.
+ */
+static void *APR_THREAD_FUNC pollerThread(apr_thread_t *thread, void *data)
+{
+    VimNvimClient *client = data;
+
+    while (!client->stopping) {
+        apr_int32_t i, num;
+        const apr_pollfd_t *pfds;
+        apr_status_t status = apr_pollset_poll(client->pollset, -1, &num, &pfds);
+
+        if (status)
+            continue;
+
+        for (i = 0; i < num; i++)
+            readConnection(client, pfds[i].client_data);
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stopClient(void *data)
+{
+    VimNvimClient *client = data;
+    apr_status_t rv;
+
+    client->stopping = TRUE;
+    apr_pollset_wakeup(client->pollset);
+    apr_thread_join(&rv, client->thread);
+
+    apr_thread_mutex_lock(client->mutex);
+    while (client->connections)
+        closeConnection(client, client->connections);
+    apr_thread_mutex_unlock(client->mutex);
+    return APR_SUCCESS;
+}
+
+/*
+ * Create a client and start the thread reading the responses.  The
+ * connections are opened on demand.  Returns NULL on failure.
+ */
+VimNvimClient *VimNvimClient_new(server_rec *server_rec, apr_pool_t *pool)
+{
+    apr_status_t status;
+    VimNvimClient *client = apr_pcalloc(pool, sizeof(*client));
+
+    client->server_rec = server_rec;
+    client->connections = NULL;
+    client->lastMsgid = 0;
+    client->stopping = FALSE;
+
+    if ((status = apr_thread_mutex_create(&client->mutex, APR_THREAD_MUTEX_DEFAULT, pool))
+            || (status = apr_thread_cond_create(&client->cond, pool))
+            || (status = apr_pollset_create(&client->pollset, NVIM_MAX_CONNECTIONS, pool,
+                                            APR_POLLSET_THREADSAFE | APR_POLLSET_WAKEABLE))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot set up the Neovim client");
+        return NULL;
+    }
+
+    if ((status = apr_thread_create(&client->thread, NULL, pollerThread, client, pool))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, server_rec, "Cannot start the Neovim client thread");
+        return NULL;
+    }
+    apr_pool_cleanup_register(pool, client, stopClient, apr_pool_cleanup_null);
+    return client;
+}
+
+/*
+ * Returns a newline separated list of the addresses connected to, in
+ * malloc'ed memory.
+ */
+char *VimNvimClient_getNames(VimNvimClient *client)
+{
+    VimNvimClient_Connection *conn;
+    garray_T ga;
+
+    ga_init2(&ga, 1, 100);
+    apr_thread_mutex_lock(client->mutex);
+    for (conn = client->connections; conn; conn = conn->nextPtr) {
+        ga_concat(&ga, conn->address);
+        ga_concat(&ga, (char *)"\n");
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    ga_append(&ga, '\0');
+    return ga.ga_data;
+}
+
+/*
+ * Call "method" with the packed array "params" on the Neovim at "address"
+ * and wait "timeout" milliseconds at most for the response, or forever if
+ * negative.  A string result is decoded as JSON, so that expressions
+ * written for the X11 transport work unchanged; anything else is returned
+ * as is.
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT, VIM_REMOTE_EVAL_ERROR when
+ * Neovim reports an error or the string isn't JSON, or VIM_REMOTE_ERROR.
+ */
+static int request(VimNvimClient *client, const char *address, const char *method, const garray_T *params, apr_json_value_t **result, apr_pool_t *pool, long timeout)
+{
+    VimNvimClient_Connection *conn;
+    VimNvimClient_Pending pending;
+    long long deadline = timeout >= 0 ? monotonic_msec() + timeout: -1;
+    int retval = VIM_REMOTE_OK;
+    int sent;
+    garray_T msg;
+
+    *result = NULL;
+
+    conn = acquireConnection(client, address, deadline);
+    if (!conn)
+        return VIM_REMOTE_ERROR;
+
+    apr_thread_mutex_lock(client->mutex);
+    pending.msgid = ++client->lastMsgid;
+    pending.message = NULL;
+    pending.failed = conn->dead;
+    pending.nextPtr = conn->pendings;
+    conn->pendings = &pending;
+    apr_thread_mutex_unlock(client->mutex);
+
+    ga_init2(&msg, 1, 256);
+    sent = !msgpack_pack_array(&msg, 4)
+            && !msgpack_pack_int(&msg, NVIM_RPC_REQUEST)
+            && !msgpack_pack_int(&msg, pending.msgid)
+            && !msgpack_pack_str(&msg, method, strlen(method))
+            && !ga_grow(&msg, params->ga_len);
+    if (sent) {
+        memcpy((char *)msg.ga_data + msg.ga_len, params->ga_data, params->ga_len);
+        msg.ga_len += params->ga_len;
+        sent = !sendMessage(conn, msg.ga_data, msg.ga_len);
+    }
+    ga_clear(&msg);
+
+    apr_thread_mutex_lock(client->mutex);
+    if (!sent) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Failed to send the request to Neovim at %s", address);
+        pending.failed = TRUE;
+    }
+    while (!pending.message && !pending.failed) {
+        long long now = monotonic_msec();
+        if (deadline >= 0 && now >= deadline) {
+            retval = VIM_REMOTE_TIMEOUT;
+            break;
+        }
+        apr_thread_cond_timedwait(client->cond, client->mutex,
+                                  apr_time_from_msec(deadline >= 0 ? deadline - now: 1000));
+    }
+
+    {
+        VimNvimClient_Pending **pp;
+        for (pp = &conn->pendings; *pp; pp = &(*pp)->nextPtr) {
+            if (*pp == &pending) {
+                *pp = pending.nextPtr;
+                break;
+            }
+        }
+    }
+    releaseConnection(client, conn);
+    apr_thread_mutex_unlock(client->mutex);
+
+    if (!pending.message)
+        return retval == VIM_REMOTE_TIMEOUT ? VIM_REMOTE_TIMEOUT: VIM_REMOTE_ERROR;
+
+    {
+        const char *p = pending.message, *e = pending.message + pending.message_len;
+        apr_json_value_t *value, *error, *body;
+
+        if (msgpack_unpack(&value, &p, e, pool) || value->type != APR_JSON_ARRAY || value->value.array->nelts != 4) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Malformed response from Neovim at %s", address);
+            free(pending.message);
+            return VIM_REMOTE_ERROR;
+        }
+        free(pending.message);
+
+        /* the error is [{type}, {message}] */
+        error = ((apr_json_value_t **)value->value.array->elts)[2];
+        if (error->type != APR_JSON_NULL) {
+            const char *message = "unknown error";
+            if (error->type == APR_JSON_ARRAY && error->value.array->nelts == 2
+                    && ((apr_json_value_t **)error->value.array->elts)[1]->type == APR_JSON_STRING)
+                message = ((apr_json_value_t **)error->value.array->elts)[1]->value.string.p;
+            else if (error->type == APR_JSON_STRING)
+                message = error->value.string.p;
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "%s failed on Neovim at %s -- %s", method, address, message);
+            return VIM_REMOTE_EVAL_ERROR;
+        }
+
+        body = ((apr_json_value_t **)value->value.array->elts)[3];
+        if (body->type == APR_JSON_STRING) {
+            if (apr_json_decode(result, body->value.string.p, body->value.string.len, pool)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Invalid JSON response from Neovim at %s -- %s", address, body->value.string.p);
+                return VIM_REMOTE_EVAL_ERROR;
+            }
+        } else {
+            *result = body;
+        }
+    }
+    return VIM_REMOTE_OK;
+}
+
+/*
+ * Evaluate "expr" with nvim_eval().
+ */
+int VimNvimClient_eval(VimNvimClient *client, const char *address, const char *expr, apr_size_t expr_len, apr_json_value_t **result, apr_pool_t *pool, long timeout)
+{
+    garray_T params;
+    int retval = VIM_REMOTE_ERROR;
+
+    ga_init2(&params, 1, 256);
+    if (!msgpack_pack_array(&params, 1) && !msgpack_pack_str(&params, expr, expr_len))
+        retval = request(client, address, "nvim_eval", &params, result, pool, timeout);
+    ga_clear(&params);
+    return retval;
+}
+
+/*
+ * Call the function "function" with nvim_call_function(), passing the
+ * items of the array "args" as the arguments.  The arguments go over the
+ * wire as MessagePack as they are; nothing has to be quoted into a Vim
+ * string literal.
+ */
+int VimNvimClient_callFunction(VimNvimClient *client, const char *address, const char *function, const apr_json_value_t *args, apr_json_value_t **result, apr_pool_t *pool, long timeout)
+{
+    garray_T params;
+    int retval = VIM_REMOTE_ERROR;
+
+    ga_init2(&params, 1, 256);
+    if (!msgpack_pack_array(&params, 2)
+            && !msgpack_pack_str(&params, function, strlen(function))
+            && !msgpack_pack_value(&params, args))
+        retval = request(client, address, "nvim_call_function", &params, result, pool, timeout);
+    ga_clear(&params);
+    return retval;
+}
@@ -0,0 +1,20 @@
+#ifndef NVIM_H
+#define NVIM_H
+
+#include <httpd.h>
+#include <apr_json.h>
+
+/*
+ * Transport talking to Neovim over msgpack-RPC (see ":help RPC").  The
+ * server names are the addresses Neovim listens on with --listen, either a
+ * socket path or host:port.  Requests to the same Neovim share one
+ * connection and are pipelined; responses are matched to them by msgid.
+ */
+typedef struct VimNvimClient VimNvimClient;
+
+VimNvimClient *VimNvimClient_new(server_rec *server_rec, apr_pool_t *pool);
+char *VimNvimClient_getNames(VimNvimClient *client);
+int VimNvimClient_eval(VimNvimClient *client, const char *address, const char *expr, apr_size_t expr_len, apr_json_value_t **result, apr_pool_t *pool, long timeout);
+int VimNvimClient_callFunction(VimNvimClient *client, const char *address, const char *function, const apr_json_value_t *args, apr_json_value_t **result, apr_pool_t *pool, long timeout);
+
+#endif /* NVIM_H */
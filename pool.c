@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <apr_time.h>
+#include "pool.h"
+
+/* How often the members of a prefix pool are looked up again */
+#define VIM_POOL_REFRESH_INTERVAL apr_time_from_sec(5)
+
+/* Points every member gets on the hash ring; the more, the more evenly
+ * the keys are spread */
+#define VIM_POOL_RING_POINTS 64
+
+/* With consistent-hash, no member takes on more than this percentage of
+ * the average number of commands in flight, so that a hot key doesn't
+ * pile up on a single server */
+#define VIM_POOL_LOAD_BOUND 125
+
+typedef struct VimServerPool_RingPoint {
+    apr_uint32_t hash;
+    apr_uint32_t member;
+} VimServerPool_RingPoint;
+
+/*
+ * The points of the first "nmembers" members, in hash order.  A ring is
+ * never changed once published; a new one replaces it when members are
+ * added, and the old one is kept around for the threads still walking it.
+ * As members are never removed, there are VIM_POOL_MAX_MEMBERS of them
+ * at most.
+ */
+struct VimServerPool_Ring {
+    apr_uint32_t nmembers;
+    apr_uint32_t npoints;
+    VimServerPool_Ring *older;
+    VimServerPool_RingPoint points[1];
+};
+
+VimServerPool *VimServerPool_new(apr_pool_t *pool)
+{
+    VimServerPool *retval = apr_pcalloc(pool, sizeof(*retval));
+    retval->policy = VIM_POOL_ROUND_ROBIN;
+    retval->prefix = NULL;
+    retval->nmembers = 0;
+    retval->next = 0;
+    retval->lastRefresh = 0;
+    retval->ring = NULL;
+    if (apr_thread_mutex_create(&retval->mutex, APR_THREAD_MUTEX_DEFAULT, pool))
+        return NULL;
+    return retval;
+}
+
+static VimServerPool_Member *findMember(VimServerPool *pool, const char *name, size_t name_len)
+{
+    apr_uint32_t i, n = apr_atomic_read32(&pool->nmembers);
+
+    for (i = 0; i < n; i++) {
+        VimServerPool_Member *member = &pool->members[i];
+        if (strlen(member->name) == name_len
+                && strncasecmp(member->name, name, name_len) == 0)
+            return member;
+    }
+    return NULL;
+}
+
+/*
+ * Add a server to the pool.  The name is not copied.
+ * Return 0 for OK, -1 when the pool is full.
+ */
+int VimServerPool_addMember(VimServerPool *pool, const char *name)
+{
+    VimServerPool_Member *member;
+    apr_uint32_t n = apr_atomic_read32(&pool->nmembers);
+
+    if (findMember(pool, name, strlen(name)))
+        return 0;
+
+    if (n >= VIM_POOL_MAX_MEMBERS)
+        return -1;
+
+    member = &pool->members[n];
+    member->name = name;
+    member->inflight = 0;
+    member->present = 1;
+    /* publish the member only after it is filled in */
+    apr_atomic_set32(&pool->nmembers, n + 1);
+    return 0;
+}
+
+/*
+ * Match the registered server names against the prefix and update the
+ * member list accordingly.  Members are never removed, so that pointers
+ * handed out by VimServerPool_acquire() stay valid; the ones that went away
+ * are just marked absent.
+ */
+static void refreshMembers(VimServerPool *pool, VimServerPool_ListNames listNames, void *data)
+{
+    char *names, *p, *e;
+    size_t prefix_len = strlen(pool->prefix);
+    apr_uint32_t i, n;
+    /* The members found this time.  The flags of the members are only
+     * changed at the end, so that those staying present never look absent
+     * to the threads picking one meanwhile. */
+    char seen[VIM_POOL_MAX_MEMBERS];
+
+    names = listNames(data);
+    pool->lastRefresh = apr_time_now();
+    if (!names)
+        return;
+
+    memset(seen, 0, sizeof(seen));
+    for (p = names; *p; p = e) {
+        VimServerPool_Member *member;
+
+        e = strchr(p, '\n');
+        if (!e)
+            e = p + strlen(p);
+
+        if (e - p >= prefix_len && strncasecmp(p, pool->prefix, prefix_len) == 0) {
+            member = findMember(pool, p, e - p);
+            if (member) {
+                seen[member - pool->members] = 1;
+            } else {
+                char *name = malloc(e - p + 1);
+                if (name) {
+                    memcpy(name, p, e - p);
+                    name[e - p] = '\0';
+                    if (VimServerPool_addMember(pool, name))
+                        free(name);
+                    else
+                        seen[apr_atomic_read32(&pool->nmembers) - 1] = 1;
+                }
+            }
+        }
+
+        if (*e)
+            e++;
+    }
+    free(names);
+
+    n = apr_atomic_read32(&pool->nmembers);
+    for (i = 0; i < n; i++) {
+        if (pool->members[i].present != seen[i])
+            pool->members[i].present = seen[i];
+    }
+}
+
+/*
+ * FNV-1a, folding case if "fold" is TRUE, as server names are compared
+ * without regard to case.
+ */
+static apr_uint32_t hashBytes(apr_uint32_t hash, const char *p, size_t len, int fold)
+{
+    const unsigned char *q = (const unsigned char *)p, *e = q + len;
+
+    for (; q < e; q++) {
+        hash ^= fold ? tolower(*q): *q;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Spread the bits of "hash" all over, so that similar keys land far apart
+ * on the ring.
+ */
+static apr_uint32_t mixHash(apr_uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int comparePoints(const void *a, const void *b)
+{
+    apr_uint32_t x = ((const VimServerPool_RingPoint *)a)->hash;
+    apr_uint32_t y = ((const VimServerPool_RingPoint *)b)->hash;
+    return x < y ? -1: x > y;
+}
+
+/*
+ * Return a ring holding at least the first "n" members, building it if the
+ * current one is older.  Returns NULL when out of memory.
+ */
+static VimServerPool_Ring *getRing(VimServerPool *pool, apr_uint32_t n)
+{
+    VimServerPool_Ring *ring = pool->ring;
+    apr_uint32_t i, j;
+
+    if (ring && ring->nmembers >= n)
+        return ring;
+
+    apr_thread_mutex_lock(pool->mutex);
+    ring = pool->ring;
+    n = apr_atomic_read32(&pool->nmembers);
+    if (!ring || ring->nmembers < n) {
+        VimServerPool_Ring *newRing = malloc(sizeof(*newRing) + sizeof(VimServerPool_RingPoint) * (n * VIM_POOL_RING_POINTS - 1));
+
+        if (newRing) {
+            newRing->nmembers = n;
+            newRing->npoints = n * VIM_POOL_RING_POINTS;
+            newRing->older = ring;
+            /* a point depends on the name only, so that a member lands at
+             * the same places whatever the other members */
+            for (i = 0; i < n; i++) {
+                const char *name = pool->members[i].name;
+                apr_uint32_t hash = hashBytes(2166136261U, name, strlen(name), 1);
+
+                for (j = 0; j < VIM_POOL_RING_POINTS; j++) {
+                    VimServerPool_RingPoint *point = &newRing->points[i * VIM_POOL_RING_POINTS + j];
+                    point->hash = mixHash(hashBytes(hash, (const char *)&j, sizeof(j), 0));
+                    point->member = i;
+                }
+            }
+            qsort(newRing->points, newRing->npoints, sizeof(VimServerPool_RingPoint), comparePoints);
+            apr_atomic_xchgptr((volatile void **)&pool->ring, newRing);
+        }
+        ring = newRing;
+    }
+    apr_thread_mutex_unlock(pool->mutex);
+    return ring;
+}
+
+/*
+ * Pick the first member clockwise from "key" on the ring that is usable
+ * and not loaded beyond the bound.  A member going away thus only moves
+ * its own keys to the next members, and a member coming in only takes
+ * over keys from the others.  Should every usable member be over the
+ * bound, the first of them is picked all the same.
+ * Sets "*retval" to NULL if no member is usable.
+ * Returns -1 when out of memory, 0 otherwise.
+ */
+static int pickByKey(VimServerPool *pool, const char *key, apr_uint32_t n, VimServerPool_IsUsable isUsable, void *data, VimServerPool_Member **retval)
+{
+    VimServerPool_Ring *ring = getRing(pool, n);
+    apr_uint32_t hash, lo, hi, i, present = 0, total = 0, bound;
+
+    *retval = NULL;
+    if (!ring)
+        return -1;
+
+    n = ring->nmembers;
+    for (i = 0; i < n; i++) {
+        if (pool->members[i].present) {
+            present++;
+            total += apr_atomic_read32(&pool->members[i].inflight);
+        }
+    }
+    if (present == 0 || ring->npoints == 0)
+        return 0;
+    /* counting the command about to be sent */
+    bound = ((total + 1) * VIM_POOL_LOAD_BOUND + present * 100 - 1) / (present * 100);
+
+    hash = mixHash(hashBytes(2166136261U, key, strlen(key), 0));
+    for (lo = 0, hi = ring->npoints; lo < hi; ) {
+        apr_uint32_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = 0; i < ring->npoints; i++) {
+        VimServerPool_Member *member = &pool->members[ring->points[(lo + i) % ring->npoints].member];
+
+        if (!member->present)
+            continue;
+        if (isUsable && !isUsable(data, member->name))
+            continue;
+        if (apr_atomic_read32(&member->inflight) < bound) {
+            *retval = member;
+            break;
+        }
+        if (!*retval)
+            *retval = member;
+    }
+    return 0;
+}
+
+/*
+ * Pick a server according to the policy of the pool and account for the
+ * command about to be sent to it.  VimServerPool_release() must be called
+ * once the command has completed.  The servers "isUsable" says no to, if
+ * given, are passed over.  With consistent-hash, requests with the same
+ * "key" go to the same server as long as it is there; without a key they
+ * are spread round-robin.
+ * Returns NULL if no server is available.
+ */
+VimServerPool_Member *VimServerPool_acquire(VimServerPool *pool, const char *key, VimServerPool_ListNames listNames, VimServerPool_IsUsable isUsable, void *data)
+{
+    VimServerPool_Member *retval = NULL;
+    apr_uint32_t i, n, start;
+
+    if (pool->prefix && listNames) {
+        int refresh = apr_atomic_read32(&pool->nmembers) == 0
+                || apr_time_now() - pool->lastRefresh >= VIM_POOL_REFRESH_INTERVAL;
+        /* a single thread refreshes while the rest go on with what's known */
+        if (refresh && apr_thread_mutex_trylock(pool->mutex) == APR_SUCCESS) {
+            refreshMembers(pool, listNames, data);
+            apr_thread_mutex_unlock(pool->mutex);
+        }
+    }
+
+    n = apr_atomic_read32(&pool->nmembers);
+    if (n == 0)
+        return NULL;
+
+    if (pool->policy == VIM_POOL_CONSISTENT_HASH && key
+            && pickByKey(pool, key, n, isUsable, data, &retval) == 0) {
+        if (retval)
+            apr_atomic_inc32(&retval->inflight);
+        return retval;
+    }
+
+    start = apr_atomic_inc32(&pool->next);
+
+    for (i = 0; i < n; i++) {
+        VimServerPool_Member *member = &pool->members[(start + i) % n];
+        if (!member->present)
+            continue;
+        if (isUsable && !isUsable(data, member->name))
+            continue;
+
+        if (pool->policy != VIM_POOL_LEAST_OUTSTANDING) {
+            retval = member;
+            break;
+        }
+
+        if (!retval || apr_atomic_read32(&member->inflight) < apr_atomic_read32(&retval->inflight))
+            retval = member;
+    }
+
+    if (retval)
+        apr_atomic_inc32(&retval->inflight);
+    return retval;
+}
+
+void VimServerPool_release(VimServerPool *pool, VimServerPool_Member *member)
+{
+    apr_atomic_dec32(&member->inflight);
+}
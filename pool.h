@@ -0,0 +1,57 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <apr_pools.h>
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+
+#define VIM_POOL_MAX_MEMBERS 64
+
+typedef enum VimServerPool_Policy {
+    VIM_POOL_ROUND_ROBIN,
+    VIM_POOL_LEAST_OUTSTANDING,
+    VIM_POOL_CONSISTENT_HASH
+} VimServerPool_Policy;
+
+typedef struct VimServerPool_Member {
+    const char *name;
+    /* Number of commands currently sent to this server by this child. */
+    volatile apr_uint32_t inflight;
+    /* FALSE when the server was not found in the registry last time. */
+    int present;
+} VimServerPool_Member;
+
+/*
+ * Returns a newline separated list of the registered server names in
+ * malloc'ed memory, or NULL.
+ */
+typedef char *(*VimServerPool_ListNames)(void *);
+
+/*
+ * Returns FALSE if no command should be sent to the server named by the
+ * second argument at the moment.
+ */
+typedef int (*VimServerPool_IsUsable)(void *, const char *);
+
+/* Points of the members on the hash ring; see VimServerPool_acquire() */
+typedef struct VimServerPool_Ring VimServerPool_Ring;
+
+typedef struct VimServerPool {
+    VimServerPool_Policy policy;
+    /* When set, members are discovered from the registry */
+    const char *prefix;
+    VimServerPool_Member members[VIM_POOL_MAX_MEMBERS];
+    volatile apr_uint32_t nmembers;
+    volatile apr_uint32_t next;
+    apr_time_t lastRefresh;
+    apr_thread_mutex_t *mutex;
+    /* Built on first use and again whenever members are added */
+    VimServerPool_Ring * volatile ring;
+} VimServerPool;
+
+VimServerPool *VimServerPool_new(apr_pool_t *pool);
+int VimServerPool_addMember(VimServerPool *pool, const char *name);
+VimServerPool_Member *VimServerPool_acquire(VimServerPool *pool, const char *key, VimServerPool_ListNames listNames, VimServerPool_IsUsable isUsable, void *data);
+void VimServerPool_release(VimServerPool *pool, VimServerPool_Member *member);
+
+#endif /* POOL_H */
@@ -1,3 +1,6 @@
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <http_log.h>
 #include "conv.h"
 #include "remote.h"
 
@@ -6,13 +9,63 @@ static char *serverConvert(VimRemotingClient *client, const char *client_enc, ch
 #ifdef WIN3264
 #include "remote_win32.c"
 #elif defined(USE_X11)
-#include "remote_x.c"
+#include "remote_x11.c"
 #endif
 
+static apr_status_t serverFreeConverters(void *data)
+{
+    VimRemotingClient *client = data;
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, client->converters); hi; hi = apr_hash_next(hi)) {
+        void *vcp;
+
+        apr_hash_this(hi, NULL, NULL, &vcp);
+        convert_setup((vimconv_T *)vcp, NULL, NULL);
+    }
+    client->converters = NULL;
+    return APR_SUCCESS;
+}
+
+/*
+ * Return the converter from "client_enc" to 'encoding', setting it up on
+ * first use.  Converters are kept until the client is deleted, so that
+ * iconv_open() is called once per encoding rather than once per reply.
+ * They are looked up by "client_enc" alone, as the encoding converted to,
+ * client->enc, is fixed when the client is created.
+ * An encoding that needs no conversion or cannot be converted is kept with
+ * CONV_NONE so that it is not looked up again either; the latter is logged
+ * then, once.
+ * Must be called with the client mutex held.
+ */
+static vimconv_T *serverGetConverter(VimRemotingClient *client, const char *client_enc)
+{
+    vimconv_T *vcp;
+
+    if (!client->converters) {
+        client->converters = apr_hash_make(client->pool);
+        apr_pool_cleanup_register(client->pool, client, serverFreeConverters, apr_pool_cleanup_null);
+    }
+
+    vcp = apr_hash_get(client->converters, client_enc, APR_HASH_KEY_STRING);
+    if (vcp) {
+        convert_reset(vcp);
+        return vcp;
+    }
+
+    vcp = apr_palloc(client->pool, sizeof(*vcp));
+    vcp->vc_type = CONV_NONE;
+    if (convert_setup(vcp, client_enc, client->enc))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, client->server_rec, "Cannot convert from %s to %s; replies in %s are passed through as is", client_enc, client->enc, client_enc);
+    apr_hash_set(client->converters, apr_pstrdup(client->pool, client_enc), APR_HASH_KEY_STRING, vcp);
+    return vcp;
+}
+
 /*
  * If conversion is needed, convert "data" from "client_enc" to 'encoding' and
  * return an allocated string.  Otherwise return "data".
  * "*tofree" is set to the result when it needs to be freed later.
+ * Must be called with the client mutex held.
  */
 static char *serverConvert(VimRemotingClient *client, const char *client_enc, char *data, char **tofree)
 {
@@ -20,19 +73,15 @@ static char *serverConvert(VimRemotingClient *client, const char *client_enc, ch
 
     *tofree = 0;
     if (client_enc && client->enc) {
-        vimconv_T vimconv;
+        vimconv_T *vcp = serverGetConverter(client, client_enc);
 
-        vimconv.vc_type = CONV_NONE;
-        if (!convert_setup(&vimconv, client_enc, client->enc) &&
-                vimconv.vc_type != CONV_NONE)
-        {
-            res = string_convert(&vimconv, data, NULL);
+        if (vcp->vc_type != CONV_NONE) {
+            res = string_convert(vcp, data, NULL);
             if (res == NULL)
                 res = data;
             else
                 *tofree = res;
         }
-        convert_setup(&vimconv, NULL, NULL);
     }
     return res;
 }
@@ -8,11 +8,46 @@ void VimRemotingClient_delete(VimRemotingClient *client);
 #ifdef WIN3264
 #else
 #include <httpd.h>
+#ifndef USE_XCB
 #include <X11/Intrinsic.h>
+#endif
 
-VimRemotingClient *VimRemotingClient_new(server_rec *server_rec, const char *vim_version, const char *enc, Display *dpy);
+VimRemotingClient *VimRemotingClient_new(server_rec *server_rec, const char *vim_version, const char *enc, const char *display);
+char *serverGetVimNames(VimRemotingClient *client);
+int VimRemotingClient_startDispatcher(VimRemotingClient *client);
 #endif
 
-int serverSendToVim(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result);
+/* Return values of serverSendToVim() */
+#define VIM_REMOTE_OK       0
+#define VIM_REMOTE_ERROR    (-1)
+#define VIM_REMOTE_TIMEOUT  (-2)
+/* Only when waiting with a VimRemotingClient_Cancel */
+#define VIM_REMOTE_CANCELLED (-3)
+/* The server answered, but evaluating the command failed or its result
+ * couldn't be used; sending it again wouldn't help */
+#define VIM_REMOTE_EVAL_ERROR (-4)
+
+/* Returns TRUE when the result of a command is no longer wanted */
+typedef int (*VimRemotingClient_Cancel)(void *data);
+
+int serverSendToVim(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout);
+
+#ifndef WIN3264
+/* A result sent piece by piece in notifications; see serverOpenStream() */
+typedef struct VimRemotingClient_Stream VimRemotingClient_Stream;
+
+VimRemotingClient_Stream *serverOpenStream(VimRemotingClient *client, const char **tag);
+int serverStreamSend(VimRemotingClient_Stream *stream, const char *name, const char *cmd, apr_size_t cmd_len);
+int serverReadStream(VimRemotingClient_Stream *stream, char **str, long timeout, VimRemotingClient_Cancel cancel, void *cancelData);
+void serverCloseStream(VimRemotingClient_Stream *stream);
+
+int serverSendToVimCancellable(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout, VimRemotingClient_Cancel cancel, void *cancelData);
+int serverSendExpr(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len);
+
+/* Returns the name of the server to send a command to as well, or NULL */
+typedef const char *(*VimRemotingClient_Hedge)(void *data);
+
+int serverSendToVimHedged(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout, long delay, VimRemotingClient_Hedge hedge, void *hedgeData, int *which, VimRemotingClient_Cancel cancel, void *cancelData);
+#endif
 
 #endif /* REMOTE_H */
@@ -0,0 +1,2458 @@
+/* vi:set ts=8 sts=4 sw=4:
+ *
+ * VIM - Vi IMproved        by Bram Moolenaar
+ * X command server by Flemming Madsen
+ *
+ * Do ":help uganda"  in Vim to read copying and usage conditions.
+ * Do ":help credits" in Vim to see a list of people who contributed.
+ * See README.txt for an overview of the Vim source code.
+ *
+ * if_xcmdsrv.c: Functions for passing commands through an X11 display.
+ *
+ * remote_x11.c: The part that doesn't depend on how the X server is talked
+ * to.  The requests themselves are made by remote_x.c through Xlib, or by
+ * remote_xcb.c through XCB when USE_XCB is defined.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <ctype.h>
+#ifdef USE_XCB
+#include <xcb/xcb.h>
+#else
+#include <X11/Intrinsic.h>
+#include <X11/Xatom.h>
+#include <X11/Xlibint.h>
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <httpd.h>
+#include <http_log.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_proc.h>
+#include <apr_atomic.h>
+#include "ga.h"
+#include "utils.h"
+
+#ifndef HAVE_SELECT
+#include <poll.h>
+#else
+#include <sys/types.h>
+#include <sys/select.h>
+#endif
+
+#ifdef USE_XCB
+/* XCB's types go by the names Xlib gives them */
+typedef xcb_window_t Window;
+typedef xcb_atom_t Atom;
+#define None XCB_NONE
+
+/* The number of a request; XCB only keeps the lower 32 bits */
+typedef unsigned int VimRemotingClient_Serial;
+#define SERIAL_DIFF(a, b) ((int)((a) - (b)))
+#else
+typedef unsigned long VimRemotingClient_Serial;
+#define SERIAL_DIFF(a, b) ((long)((a) - (b)))
+#endif
+
+
+/*
+ * This file provides procedures that implement the command server
+ * functionality of Vim when in contact with an X11 server.
+ *
+ * Everything here goes through the few functions declared below, which
+ * are all remote_x.c and remote_xcb.c have to provide.
+ *
+ * Adapted from TCL/TK's send command  in tkSend.c of the tk 3.6 distribution.
+ * Adapted for use in Vim by Flemming Madsen. Protocol changed to that of tk 4
+ */
+
+/*
+ * Copyright (c) 1989-1993 The Regents of the University of California.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, without written agreement and without
+ * license or royalty fees, to use, copy, modify, and distribute this
+ * software and its documentation for any purpose, provided that the
+ * above copyright notice and the following two paragraphs appear in
+ * all copies of this software.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE UNIVERSITY OF
+ * CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO OBLIGATION TO
+ * PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+ */
+
+
+/*
+ * When a result is being awaited from a sent command, one of
+ * the following structures is present on a list of all outstanding
+ * sent commands.  The information in the structure is used to
+ * process the result when it arrives.  Every request thread of the
+ * child registers its own entry here, so there are usually as many
+ * outstanding commands as there are threads talking to Vim.
+ */
+
+typedef struct VimRemotingClient_PendingCommand {
+    /* Serial number expected in result. */
+    int serial;
+    /* The window the command was sent to */
+    Window w;
+    /* Result Code. 0 is OK */
+    int code;
+    /* String result for command (malloc'ed).
+     * NULL means command still pending. */
+    char *result;
+    /* Set when the command couldn't be delivered or its window died */
+    int failed;
+    /* The X requests that appended the command, to tell whether an X
+     * error is about it.  Both 0 until it has been sent. */
+    VimRemotingClient_Serial firstRequest;
+    VimRemotingClient_Serial lastRequest;
+    /* Neighbours in list of all outstanding commands.
+     * NULL means end of list. */
+    struct VimRemotingClient_PendingCommand *prevPtr;
+    struct VimRemotingClient_PendingCommand *nextPtr;
+} VimRemotingClient_PendingCommand;
+
+#define MAX_PROP_WORDS 100000
+
+/*
+ * Milliseconds between active checks of a window we are waiting on.
+ * Normally its death is learned from DestroyNotify; this only catches
+ * editors that drop the Vim property without destroying the window.
+ */
+#define LIVENESS_PROBE_INTERVAL 10000
+
+/*
+ * Milliseconds between checks whether the one waiting for a command still
+ * cares for the result, when there is a way to tell.
+ */
+#define CANCEL_CHECK_INTERVAL 1000
+
+/*
+ * Notifications from a window that nobody read yet.  "strings" is a ring of
+ * "size" malloc'ed strings, the "count" oldest of which start at "head".
+ */
+typedef struct VimRemotingClient_ServerReply {
+    Window  id;
+    char **strings;
+    int head;
+    int count;
+    int size;
+} VimRemotingClient_ServerReply;
+
+enum VimRemotingClient_ServerReplyOp {
+    SROP_Find,
+    SROP_Add,
+    SROP_Delete
+};
+
+/*
+ * Registry entries looked up so far.  Entries that share a name (possible
+ * when a stale one is left behind by a dead editor) are chained in the
+ * order they appear in the registry.
+ */
+typedef struct VimRemotingClient_NameEntry {
+    Window w;
+    /* TRUE once the window was checked and is watched for DestroyNotify */
+    int validated;
+    char *key;
+    char *name;
+    struct VimRemotingClient_NameEntry *nextPtr;
+} VimRemotingClient_NameEntry;
+
+/*
+ * A window some thread is waiting on in serverWait().
+ */
+typedef struct VimRemotingClient_Watch {
+    Window w;
+    /* Set when DestroyNotify is received for the window */
+    int destroyed;
+    struct VimRemotingClient_Watch *nextPtr;
+} VimRemotingClient_Watch;
+
+/*
+ * Where the sender of a command learns how sending it went.
+ */
+typedef struct VimRemotingClient_Delivery {
+    /* The window the command was sent to */
+    Window w;
+    /* TRUE if it couldn't be sent */
+    int failed;
+} VimRemotingClient_Delivery;
+
+/*
+ * A command waiting to be sent.  Request threads push these onto a
+ * lock-free stack; whoever sends next (the dispatcher thread, or else the
+ * first thread to get the display) takes the whole stack at once and sends
+ * the commands in the order they were submitted, all the commands for the
+ * same window in a single append.
+ */
+typedef struct VimRemotingClient_Submission {
+    int serial;
+    /* TRUE if somebody waits for the result */
+    int wantResult;
+    char *name;
+    char *property;
+    int length;
+    Window w;
+    /* NULL if the sender doesn't stay around to know */
+    VimRemotingClient_Delivery *delivery;
+    /* Used by flushSubmissions() while grouping the commands by window */
+    int batched;
+    int unsent;
+    struct VimRemotingClient_Submission *nextPtr;
+} VimRemotingClient_Submission;
+
+/*
+ * Appends that went out without waiting for the X server to process them.
+ * Kept until the server is known to be past them, so that an X error that
+ * comes in meanwhile can be put down to the window it was about.
+ */
+typedef struct VimRemotingClient_InFlight {
+    VimRemotingClient_Serial firstRequest;
+    VimRemotingClient_Serial lastRequest;
+    Window w;
+} VimRemotingClient_InFlight;
+
+typedef int (*VimRemotingClient_EndCond)(void *);
+
+/* Private variables for the "server" functionality */
+struct VimRemotingClient {
+    server_rec *server_rec;
+    const char *vim_version;
+    const char *enc;
+
+    /* The connection this client owns; see VimRemotingClient_new() */
+#ifdef USE_XCB
+    xcb_connection_t *conn;
+    /* The screen our window is created on */
+    xcb_screen_t *screen;
+    /* The root window of the first screen, which holds the registry */
+    Window root;
+
+    /* Serializes the use of the connection, much like XLockDisplay() does
+     * for the Xlib version: XCB itself is thread-safe, but the events and
+     * the caches below must be handled by one thread at a time.  Referred
+     * to as the display lock throughout. */
+    apr_thread_mutex_t *xlock;
+
+    /* The largest property a single ChangeProperty request can carry */
+    long maxPropChunk;
+    /* The latest request the X server is known to have processed, as
+     * learned from the replies and events */
+    unsigned int lastSeenRequest;
+#else
+    Display *dpy;
+
+    /* Extension slot on dpy used to hook its X errors to this client */
+    XExtCodes *extCodes;
+
+    /* Serial number of the last X request reported failed, valid if
+     * anyXError is TRUE.  Compared with NextRequest() taken before issuing
+     * a request to know whether it failed, without an XSync. */
+    unsigned long lastXErrorRequest;
+    int anyXError;
+#endif
+    Window window;
+
+    /* Running count of sent commands.
+     * Used to give each command a different serial number.
+     */
+    volatile apr_uint32_t serial;
+
+    /* List of all commands currentlybeing waited for. */
+    VimRemotingClient_PendingCommand *pendingCommands;
+    /* The same commands by serial number */
+    apr_hash_t *pendingBySerial;
+
+    apr_pool_t *pool;
+
+    /* Windows being waited on */
+    VimRemotingClient_Watch *watches;
+
+    /* Replies sent by the Vims with remote_send() that nobody read yet,
+     * by window */
+    apr_hash_t *serverReply;
+
+    /* Open streams by id */
+    apr_hash_t *streams;
+
+    /* Guards pendingCommands, pendingBySerial, serverReply, streams,
+     * watches and reading.  The
+     * display lock may be taken first, but never the other way around. */
+    apr_thread_mutex_t *mutex;
+
+    /* Broadcast whenever events have been dispatched. */
+    apr_thread_cond_t *cond;
+
+    /* TRUE while some thread is polling the connection on behalf of
+     * everybody waiting in serverWait(). */
+    int reading;
+
+    /* Self-pipe used to wake up the reading thread when another thread
+     * dispatched the events it was waiting for, or the dispatcher thread
+     * when commands are submitted. */
+    int wakeupFds[2];
+
+    /* The thread owning the display, if VimRemotingClient_startDispatcher()
+     * was called.  Request threads then never talk to the X server to
+     * send. */
+    apr_thread_t *dispatcher;
+    volatile int stopping;
+    /* Commands submitted to the dispatcher, newest first */
+    VimRemotingClient_Submission * volatile submissions;
+
+    Atom registryProperty;
+    Atom commProperty;
+    Atom vimProperty;
+
+    /* Server name to window cache, filled from the registry property in
+     * one go and invalidated by PropertyNotify on the root window.  Guarded
+     * by the display lock. */
+    apr_hash_t *nameCache;
+    int nameCacheFilled;
+
+    /* Converters from the encodings of the Vims to ours, by name; set up
+     * on first use by serverConvert() and guarded by mutex */
+    apr_hash_t *converters;
+
+    /* Serial numbers of the requests failed since settleErrors() last
+     * ran, as handed to noteXError() */
+    garray_T xErrors;
+    /* Appends the X server may not have processed yet, oldest first */
+    garray_T inFlight;
+    int got_int;
+};
+
+typedef struct VimRemotingClient_WaitForReplyParams {
+    VimRemotingClient *client;
+    Window w;
+    VimRemotingClient_ServerReply *result;
+} VimRemotingClient_WaitForReplyParams;
+
+/*
+ * The commands waited on by serverSendToVimHedged(), the second one only
+ * once sent.
+ */
+typedef struct VimRemotingClient_Hedging {
+    VimRemotingClient_PendingCommand *first;
+    VimRemotingClient_PendingCommand *second;
+} VimRemotingClient_Hedging;
+
+/*
+ * Notifications tagged "mod_vim:<id>:" belong to the stream "id" rather
+ * than to the window that sent them.
+ */
+#define STREAM_TAG_PREFIX "mod_vim:"
+
+struct VimRemotingClient_Stream {
+    VimRemotingClient *client;
+    int id;
+    /* What the notifications for the stream start with */
+    char tag[sizeof(STREAM_TAG_PREFIX) + 12];
+    /* The command that produces the stream, once sent */
+    VimRemotingClient_PendingCommand pending;
+    int sent;
+    /* Notifications not read yet */
+    VimRemotingClient_ServerReply queue;
+    /* Set when the end marker came in */
+    int ended;
+    /* Set when a notification had to be dropped */
+    int lost;
+};
+
+static char *empty_prop = (char *)"";        /* empty getRegProp() result */
+
+/*
+ * The requests to the X server, made through Xlib by remote_x.c or through
+ * XCB by remote_xcb.c, either of which is included at the end of this file.
+ * Unless noted otherwise they must be called with the display locked.
+ */
+
+/* Connect to "display" (NULL for $DISPLAY).  Needs no lock */
+static int openDisplay(VimRemotingClient *client, const char *display);
+/* Needs no lock */
+static void closeDisplay(VimRemotingClient *client);
+/* Intern the atoms and set up the comm window.  Takes the lock itself */
+static int VimRemotingClient_init_internal(VimRemotingClient *client);
+static void destroyCommWindow(VimRemotingClient *client);
+/* Take and release the display lock */
+static void lockDisplay(VimRemotingClient *client);
+static void unlockDisplay(VimRemotingClient *client);
+/* The descriptor to poll for events.  Needs no lock */
+static int displayFd(VimRemotingClient *client);
+static void flushDisplay(VimRemotingClient *client);
+/* Hand the events already read to serverEventProc(), invalidateNameCache()
+ * and windowDestroyed(), then call eventsProcessed() */
+static void processEvents(VimRemotingClient *client);
+static void selectDestroyNotify(VimRemotingClient *client, Window w);
+static VimRemotingClient_Serial appendProp(VimRemotingClient *client, Window window, Atom property, char *value, int length, VimRemotingClient_Serial *firstp);
+static int checkWindows(VimRemotingClient *client, const Window *ws, int *valid, size_t n);
+static int readCommProperty(VimRemotingClient *client, char **data, unsigned long *len);
+static int getRegProp(VimRemotingClient *client, void **handlep, unsigned char **regPropp, unsigned long *numItemsp);
+static void freeRegProp(void *handle);
+static void replaceRegProp(VimRemotingClient *client, unsigned char *value, int length);
+
+static void prologue(VimRemotingClient *client)
+{
+    lockDisplay(client);
+}
+
+static void epilogue(VimRemotingClient *client)
+{
+    /* Whatever has been read into the event queue while we held the
+     * display must be dispatched before the lock is released, otherwise
+     * the thread polling the connection would never notice it. */
+    processEvents(client);
+    unlockDisplay(client);
+}
+
+static void clearReply(VimRemotingClient_ServerReply *p)
+{
+    while (p->count > 0) {
+        free(p->strings[p->head]);
+        p->head = (p->head + 1) % p->size;
+        p->count--;
+    }
+    free(p->strings);
+    p->strings = NULL;
+    p->size = 0;
+}
+
+static void freeReply(VimRemotingClient_ServerReply *p)
+{
+    clearReply(p);
+    free(p);
+}
+
+static VimRemotingClient_ServerReply *findReply(VimRemotingClient *client, Window w, enum VimRemotingClient_ServerReplyOp op)
+{
+    VimRemotingClient_ServerReply *p;
+
+    p = apr_hash_get(client->serverReply, &w, sizeof(w));
+
+    if (p == NULL && op == SROP_Add)
+    {
+        p = malloc(sizeof(*p));
+        if (p != NULL)
+        {
+            p->id = w;
+            p->strings = NULL;
+            p->head = 0;
+            p->count = 0;
+            p->size = 0;
+            apr_hash_set(client->serverReply, &p->id, sizeof(p->id), p);
+        }
+    }
+    else if (p != NULL && op == SROP_Delete)
+    {
+        apr_hash_set(client->serverReply, &p->id, sizeof(p->id), NULL);
+        freeReply(p);
+        p = NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Queue the malloc'ed string "str" after the other notifications from the
+ * same window.  Returns -1 when out of memory, in which case "str" is not
+ * taken.
+ */
+static int pushReply(VimRemotingClient_ServerReply *p, char *str)
+{
+    if (p->count == p->size) {
+        int size = p->size > 0 ? p->size * 2: 4;
+        char **strings = malloc(size * sizeof(*strings));
+        int i;
+
+        if (strings == NULL)
+            return -1;
+        for (i = 0; i < p->count; i++)
+            strings[i] = p->strings[(p->head + i) % p->size];
+        free(p->strings);
+        p->strings = strings;
+        p->head = 0;
+        p->size = size;
+    }
+    p->strings[(p->head + p->count) % p->size] = str;
+    p->count++;
+    return 0;
+}
+
+/*
+ * Take the oldest notification from "p", which must not be empty.
+ */
+static char *popReply(VimRemotingClient_ServerReply *p)
+{
+    char *str = p->strings[p->head];
+
+    p->head = (p->head + 1) % p->size;
+    p->count--;
+    return str;
+}
+
+/*
+ * Return the command with serial number "serial" being waited for, or NULL.
+ * Must be called with the mutex held.
+ */
+static VimRemotingClient_PendingCommand *findPending(VimRemotingClient *client, int serial)
+{
+    return apr_hash_get(client->pendingBySerial, &serial, sizeof(serial));
+}
+
+/*
+ * Queue the notification "str", stripped of STREAM_TAG_PREFIX, on the
+ * stream its tag names.  An empty notification ends the stream.  Those for
+ * streams no longer open are dropped.
+ * Must be called with the mutex held.
+ */
+static void queueOnStream(VimRemotingClient *client, const char *str)
+{
+    VimRemotingClient_Stream *stream;
+    char *end;
+    char *copy;
+    int id;
+
+    id = (int)strtol(str, &end, 10);
+    if (*end != ':')
+        return;
+    stream = apr_hash_get(client->streams, &id, sizeof(id));
+    if (stream == NULL || stream->ended)
+        return;
+    if (end[1] == '\0') {
+        stream->ended = TRUE;
+        return;
+    }
+    copy = strdup(end + 1);
+    if (copy == NULL || pushReply(&stream->queue, copy)) {
+        /* rather cut the response short than leave a hole in it */
+        free(copy);
+        stream->lost = TRUE;
+    }
+}
+
+
+static int waitForPend(void *p)
+{
+    VimRemotingClient_PendingCommand *pending = p;
+    return pending->result || pending->failed;
+}
+
+static int waitForReply(void *p)
+{
+    VimRemotingClient_WaitForReplyParams *params = p;
+    return !!(params->result = findReply(params->client, params->w, SROP_Find));
+}
+
+static int waitForEither(void *p)
+{
+    VimRemotingClient_Hedging *hedging = p;
+    return hedging->first->result || hedging->second->result
+            || (hedging->first->failed && hedging->second->failed);
+}
+
+/*
+ * Append a given property to a given window without waiting for the X
+ * server.  Should the append fail, settleErrors() learns about it from the
+ * numbers of the requests.
+ * Return: the number of the last request, the first one being
+ * stored in "*firstp" unless NULL.
+ */
+static VimRemotingClient_Serial appendPropAsync(VimRemotingClient *client, Window window, Atom property, char *value, int length, VimRemotingClient_Serial *firstp)
+{
+    VimRemotingClient_InFlight *inFlight;
+    VimRemotingClient_Serial first, last;
+
+    last = appendProp(client, window, property, value, length, &first);
+    if (firstp)
+        *firstp = first;
+    if (!ga_grow(&client->inFlight, 1)) {
+        inFlight = (VimRemotingClient_InFlight *)client->inFlight.ga_data + client->inFlight.ga_len++;
+        inFlight->firstRequest = first;
+        inFlight->lastRequest = last;
+        inFlight->w = window;
+    }
+    return last;
+}
+
+/*
+ * Return TRUE if window "w" exists and has a "Vim" property on it.
+ */
+static int isWindowValid(VimRemotingClient *client, Window w)
+{
+    int valid;
+
+    if (checkWindows(client, &w, &valid, 1))
+        return FALSE;
+    return valid;
+}
+
+/*
+ * Check if "str" looks like it had a serial number appended.
+ * Actually just checks if the name ends in a digit.
+ */
+static int isSerialName(char *str)
+{
+    int len = strlen(str);
+    return (len > 1 && isdigit(((unsigned char *)str)[len - 1]));
+}
+
+/*
+ * Convert string to windowid.
+ * Issue an error if the id is invalid.
+ */
+static Window serverStrToWin(VimRemotingClient *client, char *str)
+{
+    unsigned int id = None;
+
+    sscanf((char *)str, "0x%x", &id);
+    if (id == None) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Invalid server id used: %s", str);
+        return None;
+    }
+
+    return (Window)id;
+}
+
+/*
+ * This procedure is invoked by the various X event loops throughout Vims when
+ * a property changes on the communication window.  This procedure reads the
+ * property and handles command requests and responses.
+ */
+static void serverEventProc(VimRemotingClient *client)
+{
+    char *propInfo;
+    char *p;
+    int  code;
+    unsigned long numItems;
+    char *tofree;
+
+    /*
+     * Read the comm property and delete it.
+     */
+    if (readCommProperty(client, &propInfo, &numItems))
+        return;
+
+    apr_thread_mutex_lock(client->mutex);
+
+    /*
+     * Several commands and results could arrive in the property at
+     * one time;  each iteration through the outer loop handles a
+     * single command or result.
+     */
+    for (p = (char *)propInfo; (p - (char *)propInfo) < numItems; ) {
+        /*
+         * Ignore leading NULs; each command or result starts with a
+         * NUL so that no matter how badly formed a preceding command
+         * is, we'll be able to tell that a new command/result is
+         * starting.
+         */
+        if (*p == 0) {
+            p++;
+            continue;
+        }
+
+        if (*p == 'r' && p[1] == 0) {
+            int                    serial, gotSerial;
+            char            *res;
+            VimRemotingClient_PendingCommand  *pcPtr;
+            char            *enc;
+
+            /*
+             * This is a reply to some command that we sent out.  Iterate
+             * over all of its options.  Stop when we reach the end of the
+             * property or something that doesn't look like an option.
+             */
+            p += 2;
+            gotSerial = 0;
+            res = (char *)"";
+            code = 0;
+            enc = NULL;
+            while ((p - (char *)propInfo) < numItems && *p == '-') {
+                switch (p[1]) {
+                    case 'r':
+                        if (p[2] == ' ')
+                            res = p + 3;
+                        break;
+                    case 'E':
+                        if (p[2] == ' ')
+                            enc = p + 3;
+                        break;
+                    case 's':
+                        if (sscanf((char *)p + 2, " %d", &serial) == 1)
+                            gotSerial = 1;
+                        break;
+                    case 'c':
+                        if (sscanf((char *)p + 2, " %d", &code) != 1)
+                            code = 0;
+                        break;
+                }
+                while (*p != 0)
+                    p++;
+                p++;
+            }
+
+            if (!gotSerial)
+                continue;
+
+            /*
+             * Give the result information to anyone who's
+             * waiting for it.
+             */
+            pcPtr = findPending(client, serial);
+            if (pcPtr != NULL && pcPtr->result == NULL) {
+                pcPtr->code = code;
+                if (res != NULL) {
+                    res = serverConvert(client, enc, res, &tofree);
+                    if (tofree == NULL)
+                        res = strdup(res);
+                    pcPtr->result = res;
+                }
+                else
+                    pcPtr->result = strdup((char *)"");
+            }
+        } else if (*p == 'n' && p[1] == 0) {
+            Window        win = 0;
+            unsigned int u;
+            int gotWindow;
+            char *str;
+            VimRemotingClient_ServerReply *r;
+            char        *enc;
+
+            /*
+             * This is a (n)otification.  Sent with serverreply_send in VimL.
+             * Execute any autocommand and save it for later retrieval
+             */
+            p += 2;
+            gotWindow = 0;
+            str = (char *)"";
+            enc = NULL;
+            while ((p - (char *)propInfo) < numItems && *p == '-') {
+                switch (p[1]) {
+                    case 'n':
+                        if (p[2] == ' ')
+                            str = p + 3;
+                        break;
+                    case 'E':
+                        if (p[2] == ' ')
+                            enc = p + 3;
+                        break;
+                    case 'w':
+                        if (sscanf((char *)p + 2, " %x", &u) == 1) {
+                            win = u;
+                            gotWindow = 1;
+                        }
+                        break;
+                }
+                while (*p != 0)
+                    p++;
+                p++;
+            }
+
+            if (!gotWindow)
+                continue;
+            str = serverConvert(client, enc, str, &tofree);
+            if (strncmp(str, STREAM_TAG_PREFIX, sizeof(STREAM_TAG_PREFIX) - 1) == 0) {
+                queueOnStream(client, str + sizeof(STREAM_TAG_PREFIX) - 1);
+                free(tofree);
+                continue;
+            }
+            if (tofree == NULL)
+                str = strdup(str);
+            if (str != NULL) {
+                if ((r = findReply(client, win, SROP_Add)) == NULL
+                        || pushReply(r, str))
+                    free(str);
+            }
+        } else {
+            /*
+             * Didn't recognize this thing.  Just skip through the next
+             * null character and try again.
+             * Even if we get an 'r'(eply) we will throw it away as we
+             * never specify (and thus expect) one
+             */
+            while (*p != 0)
+                p++;
+            p++;
+        }
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    free(propInfo);
+}
+
+
+static void freeNameEntries(VimRemotingClient_NameEntry *entry)
+{
+    while (entry) {
+        VimRemotingClient_NameEntry *next = entry->nextPtr;
+        free(entry);
+        entry = next;
+    }
+}
+
+/*
+ * Forget everything learned from the registry.  The next lookup reads the
+ * registry property again.
+ */
+static void invalidateNameCache(VimRemotingClient *client)
+{
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, client->nameCache); hi; hi = apr_hash_next(hi))
+        freeNameEntries(apr_hash_this_val(hi));
+    apr_hash_clear(client->nameCache);
+    client->nameCacheFilled = FALSE;
+}
+
+/*
+ * Drop the cache entries that refer to window "w".
+ */
+static void forgetWindow(VimRemotingClient *client, Window w)
+{
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, client->nameCache); hi; ) {
+        VimRemotingClient_NameEntry *head = apr_hash_this_val(hi), *entry, **pp;
+
+        /* advance first, as the current entry may be deleted */
+        hi = apr_hash_next(hi);
+
+        for (pp = &head; (entry = *pp) != NULL; ) {
+            if (entry->w == w) {
+                *pp = entry->nextPtr;
+                entry->nextPtr = NULL;
+                /* the key is owned by the head; re-insert under the new one */
+                apr_hash_set(client->nameCache, entry->key, APR_HASH_KEY_STRING, NULL);
+                if (head)
+                    apr_hash_set(client->nameCache, head->key, APR_HASH_KEY_STRING, head);
+                free(entry);
+            } else {
+                pp = &entry->nextPtr;
+            }
+        }
+    }
+}
+
+/*
+ * Read the registry property and put every entry into the cache.
+ * Return 0 for OK, -1 for error.
+ */
+static int fillNameCache(VimRemotingClient *client)
+{
+    void *handle;
+    unsigned char *regProp;
+    char *entry;
+    char *p;
+    unsigned long numItems;
+
+    invalidateNameCache(client);
+
+    if (getRegProp(client, &handle, &regProp, &numItems))
+        return -1;
+
+    for (p = (char *)regProp; (p - (char *)regProp) < numItems; ) {
+        entry = p;
+        while (*p != 0 && !isspace(*(unsigned char *)p))
+            p++;
+        if (*p != 0) {
+            unsigned int w = None;
+            size_t name_len = strlen(p + 1);
+            VimRemotingClient_NameEntry *e = malloc(sizeof(*e) + (name_len + 1) * 2);
+
+            sscanf((char *)entry, "%x", &w);
+            if (e && w != None) {
+                VimRemotingClient_NameEntry *head, **pp;
+                size_t i;
+
+                e->w = (Window)w;
+                e->validated = FALSE;
+                e->name = (char *)(e + 1);
+                e->key = e->name + name_len + 1;
+                memcpy(e->name, p + 1, name_len + 1);
+                for (i = 0; i <= name_len; i++)
+                    e->key[i] = tolower(((unsigned char *)e->name)[i]);
+                e->nextPtr = NULL;
+
+                head = apr_hash_get(client->nameCache, e->key, APR_HASH_KEY_STRING);
+                if (head) {
+                    for (pp = &head->nextPtr; *pp; pp = &(*pp)->nextPtr)
+                        ;
+                    *pp = e;
+                } else {
+                    apr_hash_set(client->nameCache, e->key, APR_HASH_KEY_STRING, e);
+                }
+            } else {
+                free(e);
+            }
+        }
+        while (*p != 0)
+            p++;
+        p++;
+    }
+
+    freeRegProp(handle);
+
+    client->nameCacheFilled = TRUE;
+    return 0;
+}
+
+/*
+ * Make sure the windows "ws" of some cache entries are alive, and from
+ * then on have the X server tell us when they go away.  The entries of the
+ * dead ones are dropped from the cache.  The windows are all checked at
+ * once by checkWindows().
+ * Return -1 when out of memory, 0 otherwise.
+ */
+static int validateWindows(VimRemotingClient *client, const Window *ws, size_t n)
+{
+    apr_hash_index_t *hi;
+    int *valid;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+    valid = malloc(sizeof(*valid) * n);
+    if (!valid)
+        return -1;
+    if (checkWindows(client, ws, valid, n)) {
+        free(valid);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!valid[i]) {
+            /* A lingering name from a dead editor */
+            forgetWindow(client, ws[i]);
+            continue;
+        }
+        selectDestroyNotify(client, ws[i]);
+        for (hi = apr_hash_first(NULL, client->nameCache); hi; hi = apr_hash_next(hi)) {
+            VimRemotingClient_NameEntry *entry;
+
+            for (entry = apr_hash_this_val(hi); entry; entry = entry->nextPtr) {
+                if (entry->w == ws[i])
+                    entry->validated = TRUE;
+            }
+        }
+    }
+    free(valid);
+    return 0;
+}
+
+static int pollFor(int fd, int wakeupFd, int msec)
+{
+#ifndef HAVE_SELECT
+    struct pollfd   fds[2];
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeupFd;
+    fds[1].events = POLLIN;
+    return poll(fds, 2, msec) < 0;
+#else
+    fd_set fds;
+    struct timeval tv;
+
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    FD_SET(wakeupFd, &fds);
+    return select((fd > wakeupFd ? fd: wakeupFd) + 1, &fds, NULL, NULL, msec < 0 ? NULL: &tv) < 0;
+#endif
+}
+
+/*
+ * Drain the self-pipe after pollFor() returned.
+ */
+static void drainWakeup(VimRemotingClient *client)
+{
+    char buf[64];
+
+    while (read(client->wakeupFds[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * Put the X errors that came in down to the appends that caused them: the
+ * windows they were sent to are forgotten and the commands waiting for a
+ * result are failed.  Then drop the appends up to request "processed",
+ * which the X server is known to be past, as no error can come for them
+ * any more.
+ * Returns TRUE if some command was failed.
+ * Must be called with the display locked.
+ */
+static int settleErrors(VimRemotingClient *client, VimRemotingClient_Serial processed)
+{
+    VimRemotingClient_InFlight *inFlight = (VimRemotingClient_InFlight *)client->inFlight.ga_data;
+    int failed = FALSE;
+    size_t i, j;
+
+    for (i = 0; i < client->xErrors.ga_len; i++) {
+        VimRemotingClient_Serial request = ((VimRemotingClient_Serial *)client->xErrors.ga_data)[i];
+        VimRemotingClient_PendingCommand *pcPtr;
+
+        for (j = 0; j < client->inFlight.ga_len; j++) {
+            if (SERIAL_DIFF(request, inFlight[j].firstRequest) >= 0
+                    && SERIAL_DIFF(inFlight[j].lastRequest, request) >= 0)
+                break;
+        }
+        /* Not an append; nobody is interested */
+        if (j == client->inFlight.ga_len)
+            continue;
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Failed to send command to the destination program");
+        forgetWindow(client, inFlight[j].w);
+
+        apr_thread_mutex_lock(client->mutex);
+        for (pcPtr = client->pendingCommands; pcPtr; pcPtr = pcPtr->nextPtr) {
+            if (pcPtr->lastRequest != 0 && !pcPtr->result
+                    && SERIAL_DIFF(request, pcPtr->firstRequest) >= 0
+                    && SERIAL_DIFF(pcPtr->lastRequest, request) >= 0) {
+                pcPtr->failed = TRUE;
+                failed = TRUE;
+            }
+        }
+        apr_thread_mutex_unlock(client->mutex);
+    }
+    client->xErrors.ga_len = 0;
+
+    for (i = 0; i < client->inFlight.ga_len; i++) {
+        if (SERIAL_DIFF(inFlight[i].lastRequest, processed) > 0)
+            break;
+    }
+    if (i > 0) {
+        memmove(inFlight, inFlight + i, (client->inFlight.ga_len - i) * sizeof(*inFlight));
+        client->inFlight.ga_len -= i;
+    }
+    return failed;
+}
+
+/*
+ * Record that the X server reported request "request" failed, for
+ * settleErrors() to deal with.  Must be called with the display locked.
+ */
+static void noteXError(VimRemotingClient *client, VimRemotingClient_Serial request)
+{
+    if (!ga_grow(&client->xErrors, 1))
+        ((VimRemotingClient_Serial *)client->xErrors.ga_data)[client->xErrors.ga_len++] = request;
+}
+
+/*
+ * Handle the DestroyNotify of window "w": fail the commands sent to it and
+ * end the waits on it.
+ * Returns TRUE if anybody needs waking.
+ * Must be called with the display locked.
+ */
+static int windowDestroyed(VimRemotingClient *client, Window w)
+{
+    VimRemotingClient_Watch *watch;
+    VimRemotingClient_PendingCommand *pcPtr;
+    int dispatched = FALSE;
+
+    forgetWindow(client, w);
+
+    apr_thread_mutex_lock(client->mutex);
+    for (watch = client->watches; watch; watch = watch->nextPtr) {
+        if (watch->w == w) {
+            watch->destroyed = TRUE;
+            dispatched = TRUE;
+        }
+    }
+    for (pcPtr = client->pendingCommands; pcPtr; pcPtr = pcPtr->nextPtr) {
+        if (pcPtr->w == w && !pcPtr->result) {
+            pcPtr->failed = TRUE;
+            dispatched = TRUE;
+        }
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    return dispatched;
+}
+
+/*
+ * Called by processEvents() once the events are dispatched, "processed"
+ * being the latest request the X server is known to be past.  Settles the
+ * X errors that came in and, if "dispatched" is TRUE or some command
+ * failed, wakes up everybody waiting.
+ * Must be called with the display locked.
+ */
+static void eventsProcessed(VimRemotingClient *client, VimRemotingClient_Serial processed, int dispatched)
+{
+    if (settleErrors(client, processed))
+        dispatched = TRUE;
+
+    if (!dispatched)
+        return;
+
+    apr_thread_mutex_lock(client->mutex);
+    if (client->reading)
+        (void)write(client->wakeupFds[1], "", 1);
+    apr_thread_cond_broadcast(client->cond);
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+/*
+ * Enter a loop processing X events & polling chars until we see a result
+ *
+ * Any number of threads may be waiting here at the same time.  One of them
+ * polls the connection and dispatches the events for everyone else, who
+ * sleep on the condition variable until their own command completes or the
+ * reading thread steps down.
+ *
+ * The wait ends early when the window "w" is destroyed, which is learned
+ * from DestroyNotify; the window is only probed actively every
+ * LIVENESS_PROBE_INTERVAL milliseconds.
+ *
+ * "msec" is the longest time to wait; negative means forever.  "cancel",
+ * unless NULL, is asked every CANCEL_CHECK_INTERVAL milliseconds whether
+ * to give up.
+ * Returns VIM_REMOTE_OK when "endCond" is met, VIM_REMOTE_TIMEOUT when the
+ * time is up, VIM_REMOTE_CANCELLED when given up and VIM_REMOTE_ERROR when
+ * the window went away.
+ */
+static int serverWait(VimRemotingClient *client, Window w, VimRemotingClient_EndCond endCond, void *endData, long msec, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    long long         deadline;
+    long long         now;
+    long long         lastProbe;
+    int fd = displayFd(client);
+    int alive = TRUE;
+    int retval = VIM_REMOTE_OK;
+    VimRemotingClient_Watch watch;
+
+    now = lastProbe = monotonic_msec();
+    deadline = msec >= 0 ? now + msec: -1;
+
+    /* Have the X server tell us when the window goes away.  This does not
+     * need a round-trip; should the window be gone already the periodic
+     * probe below will notice. */
+    prologue(client);
+    selectDestroyNotify(client, w);
+    epilogue(client);
+
+    watch.w = w;
+    watch.destroyed = FALSE;
+
+    apr_thread_mutex_lock(client->mutex);
+    watch.nextPtr = client->watches;
+    client->watches = &watch;
+
+    while (!endCond(endData)) {
+        long long timeout;
+
+        if (watch.destroyed || !alive) {
+            retval = VIM_REMOTE_ERROR;
+            break;
+        }
+
+        if (cancel && cancel(cancelData)) {
+            retval = VIM_REMOTE_CANCELLED;
+            break;
+        }
+
+        now = monotonic_msec();
+        if (deadline >= 0 && now >= deadline) {
+            retval = VIM_REMOTE_TIMEOUT;
+            break;
+        }
+
+        if (client->reading) {
+            timeout = deadline >= 0 ? deadline - now: LIVENESS_PROBE_INTERVAL;
+            if (cancel && timeout > CANCEL_CHECK_INTERVAL)
+                timeout = CANCEL_CHECK_INTERVAL;
+            apr_thread_cond_timedwait(client->cond, client->mutex,
+                                      apr_time_from_msec(timeout));
+            continue;
+        }
+
+        client->reading = TRUE;
+        apr_thread_mutex_unlock(client->mutex);
+
+        timeout = lastProbe + LIVENESS_PROBE_INTERVAL - now;
+        if (deadline >= 0 && deadline - now < timeout)
+            timeout = deadline - now;
+        if (cancel && timeout > CANCEL_CHECK_INTERVAL)
+            timeout = CANCEL_CHECK_INTERVAL;
+        if (timeout < 0)
+            timeout = 0;
+
+        /* Just look out for the answer without calling back into Vim */
+        pollFor(fd, client->wakeupFds[0], (int)timeout);
+        drainWakeup(client);
+
+        now = monotonic_msec();
+        prologue(client);
+        if (now - lastProbe >= LIVENESS_PROBE_INTERVAL) {
+            alive = isWindowValid(client, w);
+            lastProbe = now;
+        }
+        epilogue(client);
+
+        apr_thread_mutex_lock(client->mutex);
+        client->reading = FALSE;
+        apr_thread_cond_broadcast(client->cond);
+    }
+
+    {
+        VimRemotingClient_Watch **pp;
+        for (pp = &client->watches; *pp; pp = &(*pp)->nextPtr) {
+            if (*pp == &watch) {
+                *pp = watch.nextPtr;
+                break;
+            }
+        }
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    return retval;
+}
+
+/*
+ * Fetch a list of all the Vim instance names currently registered for the
+ * display.
+ *
+ * Returns a newline separated list in allocated memory or NULL.
+ */
+char *serverGetVimNames(VimRemotingClient *client)
+{
+    apr_hash_index_t *hi;
+    garray_T        ga;
+    garray_T        windows;
+
+    prologue(client);
+
+    processEvents(client);
+
+    if (!client->nameCacheFilled && fillNameCache(client)) {
+        epilogue(client);
+        return NULL;
+    }
+
+    /*
+     * Check all the windows not known to be alive at once.
+     */
+    ga_init2(&windows, sizeof(Window), 16);
+    for (hi = apr_hash_first(NULL, client->nameCache); hi; hi = apr_hash_next(hi)) {
+        VimRemotingClient_NameEntry *entry;
+        for (entry = apr_hash_this_val(hi); entry; entry = entry->nextPtr) {
+            if (!entry->validated && !ga_grow(&windows, 1))
+                ((Window *)windows.ga_data)[windows.ga_len++] = entry->w;
+        }
+    }
+    validateWindows(client, windows.ga_data, windows.ga_len);
+    ga_clear(&windows);
+
+    /*
+     * Collect the names whose windows are alive.
+     */
+    ga_init2(&ga, 1, 100);
+    for (hi = apr_hash_first(NULL, client->nameCache); hi; hi = apr_hash_next(hi)) {
+        VimRemotingClient_NameEntry *entry;
+        for (entry = apr_hash_this_val(hi); entry; entry = entry->nextPtr) {
+            if (entry->validated) {
+                ga_concat(&ga, entry->name);
+                ga_concat(&ga, (char *)"\n");
+                break;
+            }
+        }
+    }
+    epilogue(client);
+    ga_append(&ga, '\0');
+    return ga.ga_data;
+}
+
+/*
+ * Send a reply string (notification) to client with id "name".
+ * Return -1 if the window is invalid.
+ */
+int serverSendReply(VimRemotingClient *client, char *name, char *str)
+{
+    char    *property;
+    int     length;
+    int     res = 0;
+    Window  win = serverStrToWin(client, name);
+
+    prologue(client);
+    if (!isWindowValid(client, win)) {
+        epilogue(client);
+        return -1;
+    }
+
+#ifdef FEAT_MBYTE
+    length = strlen(p_enc) + strlen(str) + 14;
+#else
+    length = strlen(str) + 10;
+#endif
+    if (!(property = malloc((unsigned)length + 30))) {
+        epilogue(client);
+        return -1;
+    }
+
+#ifdef FEAT_MBYTE
+    sprintf(property, "%cn%c-E %s%c-n %s%c-w %x",
+            0, 0, p_enc, 0, str, 0, (unsigned int)client->window);
+#else
+    sprintf(property, "%cn%c-n %s%c-w %x",
+            0, 0, str, 0, (unsigned int)client->window);
+#endif
+        /* Add length of what "%x" resulted in. */
+    length += strlen(property + length);
+    appendPropAsync(client, win, client->commProperty, property, length + 1, NULL);
+    epilogue(client);
+    free(property);
+    return res;
+}
+
+/*
+ * Wait for replies from id (win) for "timeout" milliseconds at most, or
+ * forever if negative.
+ * Return 0 and the malloc'ed string when a reply is available.
+ * Return -1 if the window becomes invalid while waiting.
+ */
+int serverReadReply(VimRemotingClient *client, Window w, char **str, long timeout)
+{
+    VimRemotingClient_WaitForReplyParams params = { client, w, NULL };
+
+    serverWait(client, w, waitForReply, &params, timeout, NULL, NULL);
+
+    apr_thread_mutex_lock(client->mutex);
+    params.result = findReply(client, w, SROP_Find);
+    if (params.result && params.result->count > 0) {
+        *str = popReply(params.result);
+        /* Last string read.  Remove from list */
+        if (params.result->count == 0)
+            findReply(client, w, SROP_Delete);
+        apr_thread_mutex_unlock(client->mutex);
+        return 0;
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    return -1;
+}
+
+/*
+ * Check for replies from id (win).
+ * Return TRUE and a non-malloc'ed string if there is.  Else return FALSE.
+ */
+static int serverPeekReply(VimRemotingClient *client, Window win, char **str)
+{
+    VimRemotingClient_ServerReply *p;
+    int valid;
+
+    apr_thread_mutex_lock(client->mutex);
+    if ((p = findReply(client, win, SROP_Find)) != NULL &&
+            p->count > 0) {
+        if (str != NULL)
+            *str = p->strings[p->head];
+        apr_thread_mutex_unlock(client->mutex);
+        return 1;
+    }
+    apr_thread_mutex_unlock(client->mutex);
+
+    prologue(client);
+    valid = isWindowValid(client, win);
+    epilogue(client);
+    return valid ? 0: -1;
+}
+
+/*
+ * Return the first cache entry for the server name "name", or NULL.
+ */
+static VimRemotingClient_NameEntry *findNameEntry(VimRemotingClient *client, const char *name)
+{
+    VimRemotingClient_NameEntry *entry;
+    char *key;
+    size_t i, name_len = strlen(name);
+
+    key = malloc(name_len + 1);
+    if (!key)
+        return NULL;
+    for (i = 0; i <= name_len; i++)
+        key[i] = tolower(((unsigned char *)name)[i]);
+    entry = apr_hash_get(client->nameCache, key, APR_HASH_KEY_STRING);
+    free(key);
+    return entry;
+}
+
+/*
+ * Given the server names of the submissions in "list", see if the names
+ * exist in the registry for a particular display.
+ *
+ * If a name is registered and its window is alive, the ID of the window
+ * associated with the name is stored in the "w" of the submission.
+ * Otherwise it is left None.
+ *
+ * The registry is only read when the cache is cold; after that the answer
+ * comes from the cache, which is kept up to date by the events processed
+ * here without any round-trip.  The windows not checked yet are checked
+ * all at once, so with XCB this takes a single round-trip whatever the
+ * number of names, unless some turn out to be lingering names of dead
+ * editors.
+ *
+ * Side effects:
+ *        If the registry property is improperly formed, then it is deleted.
+ */
+static void lookupNames(VimRemotingClient *client, VimRemotingClient_Submission *list)
+{
+    VimRemotingClient_Submission *sub;
+    garray_T windows;
+
+    for (sub = list; sub; sub = sub->nextPtr)
+        sub->w = None;
+
+    /* Catch up with registry changes and destroyed windows */
+    processEvents(client);
+
+    if (!client->nameCacheFilled && fillNameCache(client))
+        return;
+
+    ga_init2(&windows, sizeof(Window), 16);
+    for (;;) {
+        windows.ga_len = 0;
+        for (sub = list; sub; sub = sub->nextPtr) {
+            VimRemotingClient_NameEntry *entry;
+            size_t i;
+
+            if (sub->w != None)
+                continue;
+            entry = findNameEntry(client, sub->name);
+            if (!entry)
+                continue;
+            if (entry->validated) {
+                sub->w = entry->w;
+                continue;
+            }
+            for (i = 0; i < windows.ga_len; i++) {
+                if (((Window *)windows.ga_data)[i] == entry->w)
+                    break;
+            }
+            if (i == windows.ga_len && !ga_grow(&windows, 1))
+                ((Window *)windows.ga_data)[windows.ga_len++] = entry->w;
+        }
+        /* Every window checked either gets validated or dropped, so this
+         * ends once all the names are resolved or known to be gone */
+        if (windows.ga_len == 0 || validateWindows(client, windows.ga_data, windows.ga_len))
+            break;
+    }
+    ga_clear(&windows);
+}
+
+/*
+ * Delete any lingering occurrence of window id.  We promise that any
+ * occurrence is not ours since it is not yet put into the registry (by us)
+ *
+ * This is necessary in the following scenario:
+ * 1. There is an old windowid for an exit'ed vim in the registry
+ * 2. We get that id for our commWindow but only want to send, not register.
+ * 3. The window will mistakenly be regarded valid because of own commWindow
+ */
+static void deleteAnyLingerer(VimRemotingClient *client)
+{
+    void *handle;
+    unsigned char *regProp;
+    char *entry = NULL;
+    char *p;
+    unsigned long numItems;
+    unsigned int wwin;
+
+    /*
+     * Read the registry property.
+     */
+    if (getRegProp(client, &handle, &regProp, &numItems))
+        return;
+
+    /* Scan the property for the window id.  */
+    for (p = (char *)regProp; (p - (char *)regProp) < numItems; ) {
+        if (*p != 0) {
+            sscanf((char *)p, "%x", &wwin);
+            if ((Window)wwin == client->window) {
+                int lastHalf;
+
+                /* Copy down the remainder to delete entry */
+                entry = p;
+                while (*p != 0)
+                    p++;
+                p++;
+                lastHalf = numItems - (p - (char *)regProp);
+                if (lastHalf > 0)
+                    memmove(entry, p, lastHalf);
+                numItems = (entry - (char *)regProp) + lastHalf;
+                p = entry;
+                continue;
+            }
+        }
+        while (*p != 0)
+            p++;
+        p++;
+    }
+
+    if (entry != NULL)
+        replaceRegProp(client, regProp, p - (char *)regProp);
+
+    freeRegProp(handle);
+}
+
+static void registerPending(VimRemotingClient *client, VimRemotingClient_PendingCommand *pending)
+{
+    apr_thread_mutex_lock(client->mutex);
+    pending->prevPtr = NULL;
+    pending->nextPtr = client->pendingCommands;
+    if (pending->nextPtr)
+        pending->nextPtr->prevPtr = pending;
+    client->pendingCommands = pending;
+    apr_hash_set(client->pendingBySerial, &pending->serial, sizeof(pending->serial), pending);
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+static void unregisterPending(VimRemotingClient *client, VimRemotingClient_PendingCommand *pending)
+{
+    apr_thread_mutex_lock(client->mutex);
+    if (pending->prevPtr)
+        pending->prevPtr->nextPtr = pending->nextPtr;
+    else
+        client->pendingCommands = pending->nextPtr;
+    if (pending->nextPtr)
+        pending->nextPtr->prevPtr = pending->prevPtr;
+    apr_hash_set(client->pendingBySerial, &pending->serial, sizeof(pending->serial), NULL);
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+/*
+ * Build the property sending "cmd" to the server "name" as a command with
+ * serial number "serial", expecting a result if "wantResult" is TRUE.
+ * Returns the malloc'ed property and stores its length, not counting the
+ * trailing NUL, in "*lengthp".  Returns NULL when out of memory.
+ */
+static char *buildCommand(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, int wantResult, int serial, int *lengthp)
+{
+    char *property;
+    int length;
+    int n;
+
+    /*
+     * Length must be computed exactly!
+     */
+#ifdef FEAT_MBYTE
+    length = strlen(name) + strlen(p_enc) + cmd_len + 14;
+#else
+    length = strlen(name) + cmd_len + 10;
+#endif
+    property = (char *)malloc((unsigned)length + 30);
+    if (!property)
+        return NULL;
+
+#ifdef FEAT_MBYTE
+    n = sprintf((char *)property, "%c%c%c-n %s%c-E %s%c-s ",
+                      0, wantResult ? 'c' : 'k', 0, name, 0, p_enc, 0);
+#else
+    n = sprintf((char *)property, "%c%c%c-n %s%c-s ",
+                      0, wantResult ? 'c' : 'k', 0, name, 0);
+#endif
+    {
+        memcpy(property + n, cmd, cmd_len);
+        property[n + cmd_len] = '\0';
+    }
+
+    /* Add a back reference to our comm window */
+    sprintf((char *)property + length, "%c-r %x %d",
+            0, (unsigned int)client->window, serial);
+    /* Add length of what "-r %x %d" resulted in, skipping the NUL. */
+    length += strlen(property + length + 1) + 1;
+
+    *lengthp = length;
+    return property;
+}
+
+/*
+ * Mark the command with serial number "serial" as failed.
+ * Must be called with the mutex held.
+ */
+static void failPending(VimRemotingClient *client, int serial)
+{
+    VimRemotingClient_PendingCommand *pcPtr = findPending(client, serial);
+
+    if (pcPtr)
+        pcPtr->failed = TRUE;
+}
+
+static void freeSubmission(VimRemotingClient_Submission *sub)
+{
+    free(sub->name);
+    free(sub->property);
+    free(sub);
+}
+
+/*
+ * Record that "sub" couldn't be sent, and wake whoever waits for its
+ * result on the dispatcher's behalf.
+ */
+static void failSubmission(VimRemotingClient *client, VimRemotingClient_Submission *sub)
+{
+    if (sub->delivery)
+        sub->delivery->failed = TRUE;
+    apr_thread_mutex_lock(client->mutex);
+    failPending(client, sub->serial);
+    apr_thread_cond_broadcast(client->cond);
+    apr_thread_mutex_unlock(client->mutex);
+}
+
+/*
+ * Send every command submitted so far.  The commands for the same window
+ * are concatenated into a single append, which the receiving end already
+ * splits at the NULs, and the whole batch is flushed without waiting for
+ * the X server; failures are dealt with by settleErrors() once known.
+ * Must be called with the display locked.
+ */
+static void flushSubmissions(VimRemotingClient *client)
+{
+    VimRemotingClient_Submission *list, *sub, *next, **tail;
+    garray_T batch;
+
+    /* Take the whole stack and put it back in submission order */
+    list = apr_atomic_xchgptr((volatile void **)&client->submissions, NULL);
+    for (sub = list, list = NULL; sub; sub = next) {
+        next = sub->nextPtr;
+        sub->nextPtr = list;
+        list = sub;
+    }
+    if (!list)
+        return;
+
+    /* Resolve the names, dropping the commands for unknown servers */
+    lookupNames(client, list);
+    for (tail = &list; (sub = *tail) != NULL; ) {
+        if (sub->w == None) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Failed to connect the server %s", sub->name);
+            failSubmission(client, sub);
+            *tail = sub->nextPtr;
+            freeSubmission(sub);
+            continue;
+        }
+        if (sub->delivery)
+            sub->delivery->w = sub->w;
+        if (sub->wantResult) {
+            VimRemotingClient_PendingCommand *pcPtr;
+
+            apr_thread_mutex_lock(client->mutex);
+            if ((pcPtr = findPending(client, sub->serial)) != NULL)
+                pcPtr->w = sub->w;
+            apr_thread_mutex_unlock(client->mutex);
+        }
+        tail = &sub->nextPtr;
+    }
+
+    /* One append per window, keeping the order of its commands */
+    for (sub = list; sub; sub = sub->nextPtr) {
+        sub->batched = FALSE;
+        sub->unsent = FALSE;
+    }
+    ga_init2(&batch, 1, 4096);
+    for (sub = list; sub; sub = sub->nextPtr) {
+        VimRemotingClient_Submission *other;
+        VimRemotingClient_PendingCommand *pcPtr;
+        VimRemotingClient_Serial first, last;
+        int oom = FALSE;
+
+        if (sub->batched)
+            continue;
+        batch.ga_len = 0;
+        for (other = sub; other; other = other->nextPtr) {
+            if (other->w != sub->w)
+                continue;
+            other->batched = TRUE;
+            if (oom || ga_grow(&batch, other->length + 1)) {
+                oom = TRUE;
+                continue;
+            }
+            memcpy((char *)batch.ga_data + batch.ga_len, other->property, other->length + 1);
+            batch.ga_len += other->length + 1;
+        }
+        if (oom) {
+            /* send none of the group rather than guess what went out */
+            for (other = sub; other; other = other->nextPtr) {
+                if (other->w == sub->w)
+                    other->unsent = TRUE;
+            }
+            continue;
+        }
+        last = appendPropAsync(client, sub->w, client->commProperty, batch.ga_data, (int)batch.ga_len, &first);
+
+        /* Let settleErrors() find the commands should the append fail */
+        apr_thread_mutex_lock(client->mutex);
+        for (other = sub; other; other = other->nextPtr) {
+            if (other->w != sub->w || !other->wantResult)
+                continue;
+            if ((pcPtr = findPending(client, other->serial)) != NULL) {
+                pcPtr->firstRequest = first;
+                pcPtr->lastRequest = last;
+            }
+        }
+        apr_thread_mutex_unlock(client->mutex);
+    }
+    ga_clear(&batch);
+
+    /* Errors, if any, come in with the events */
+    flushDisplay(client);
+
+    for (sub = list; sub; sub = next) {
+        next = sub->nextPtr;
+        if (sub->unsent) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Failed to send command to the destination program");
+            failSubmission(client, sub);
+        }
+        freeSubmission(sub);
+    }
+}
+
+/*
+ * Check the windows of the commands still awaiting their results, for the
+ * editors that vanish without destroying their window.
+ * Must be called by the dispatcher thread with the display locked.
+ */
+static void probePending(VimRemotingClient *client)
+{
+    VimRemotingClient_PendingCommand *pcPtr;
+    garray_T windows;
+    int *valid;
+    size_t i;
+
+    ga_init2(&windows, sizeof(Window), 16);
+    apr_thread_mutex_lock(client->mutex);
+    for (pcPtr = client->pendingCommands; pcPtr; pcPtr = pcPtr->nextPtr) {
+        if (pcPtr->w != None && !pcPtr->result && !ga_grow(&windows, 1))
+            ((Window *)windows.ga_data)[windows.ga_len++] = pcPtr->w;
+    }
+    apr_thread_mutex_unlock(client->mutex);
+
+    /* All checked at once */
+    valid = malloc(sizeof(*valid) * (windows.ga_len ? windows.ga_len: 1));
+    if (!valid || checkWindows(client, windows.ga_data, valid, windows.ga_len)) {
+        free(valid);
+        ga_clear(&windows);
+        return;
+    }
+
+    for (i = 0; i < windows.ga_len; i++) {
+        Window w = ((Window *)windows.ga_data)[i];
+
+        if (valid[i])
+            continue;
+        forgetWindow(client, w);
+        apr_thread_mutex_lock(client->mutex);
+        for (pcPtr = client->pendingCommands; pcPtr; pcPtr = pcPtr->nextPtr) {
+            if (pcPtr->w == w)
+                pcPtr->failed = TRUE;
+        }
+        apr_thread_cond_broadcast(client->cond);
+        apr_thread_mutex_unlock(client->mutex);
+    }
+    free(valid);
+    ga_clear(&windows);
+}
+
+/*
+ * The thread owning the display when the dispatcher is enabled.  It sends
+ * the submitted commands and dispatches the events for everybody, so the
+ * request threads only ever wait on the condition variable.
+ */
+static void *APR_THREAD_FUNC dispatcherThread(apr_thread_t *thread, void *data)
+{
+    VimRemotingClient *client = data;
+    int fd = displayFd(client);
+    long long lastProbe = monotonic_msec();
+
+    while (!client->stopping) {
+        long long now = monotonic_msec();
+        long long timeout = lastProbe + LIVENESS_PROBE_INTERVAL - now;
+
+        pollFor(fd, client->wakeupFds[0], timeout > 0 ? (int)timeout: 0);
+        drainWakeup(client);
+
+        prologue(client);
+        flushSubmissions(client);
+        now = monotonic_msec();
+        if (now - lastProbe >= LIVENESS_PROBE_INTERVAL) {
+            probePending(client);
+            lastProbe = now;
+        }
+        epilogue(client);
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * Prepare the submission of "cmd" to the server "name".
+ * Returns NULL when out of memory.
+ */
+static VimRemotingClient_Submission *newSubmission(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, int wantResult)
+{
+    VimRemotingClient_Submission *sub = malloc(sizeof(*sub));
+
+    if (!sub)
+        return NULL;
+    sub->serial = (int)(apr_atomic_inc32(&client->serial) + 1);
+    sub->wantResult = wantResult;
+    sub->w = None;
+    sub->delivery = NULL;
+    sub->name = strdup(name);
+    sub->property = buildCommand(client, name, cmd, cmd_len, wantResult, sub->serial, &sub->length);
+    if (!sub->name || !sub->property) {
+        freeSubmission(sub);
+        return NULL;
+    }
+    return sub;
+}
+
+/*
+ * Push "sub" onto the stack of submissions.
+ * Returns TRUE if the stack was empty.
+ */
+static int pushSubmission(VimRemotingClient *client, VimRemotingClient_Submission *sub)
+{
+    do {
+        sub->nextPtr = client->submissions;
+    } while (apr_atomic_casptr((volatile void **)&client->submissions, sub, sub->nextPtr) != sub->nextPtr);
+    return !sub->nextPtr;
+}
+
+/*
+ * Wait for the events dispatched by the dispatcher thread to meet
+ * "endCond", until "deadline" at the latest; -1 means forever.  "cancel"
+ * is as for serverWait().
+ * Returns VIM_REMOTE_OK, VIM_REMOTE_TIMEOUT or VIM_REMOTE_CANCELLED.
+ */
+static int waitForDispatcher(VimRemotingClient *client, VimRemotingClient_EndCond endCond, void *endData, long long deadline, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    int retval = VIM_REMOTE_OK;
+
+    apr_thread_mutex_lock(client->mutex);
+    while (!endCond(endData)) {
+        long long now = monotonic_msec();
+        long long timeout;
+
+        if (cancel && cancel(cancelData)) {
+            retval = VIM_REMOTE_CANCELLED;
+            break;
+        }
+        if (deadline >= 0 && now >= deadline) {
+            retval = VIM_REMOTE_TIMEOUT;
+            break;
+        }
+        timeout = deadline >= 0 ? deadline - now: LIVENESS_PROBE_INTERVAL;
+        if (cancel && timeout > CANCEL_CHECK_INTERVAL)
+            timeout = CANCEL_CHECK_INTERVAL;
+        apr_thread_cond_timedwait(client->cond, client->mutex,
+                                  apr_time_from_msec(timeout));
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    return retval;
+}
+
+/*
+ * Hand the command over to the dispatcher thread and wait for the result.
+ */
+static int submitToVim(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    VimRemotingClient_Submission *sub;
+    VimRemotingClient_PendingCommand pending;
+    long long deadline = timeout >= 0 ? monotonic_msec() + timeout: -1;
+    int retval;
+
+    sub = newSubmission(client, name, cmd, cmd_len, result != NULL);
+    if (!sub)
+        return VIM_REMOTE_ERROR;
+
+    if (result) {
+        pending.serial = sub->serial;
+        pending.w = None;
+        pending.code = 0;
+        pending.result = NULL;
+        pending.failed = FALSE;
+        pending.firstRequest = pending.lastRequest = 0;
+        registerPending(client, &pending);
+    }
+
+    /* The dispatcher only needs waking when the stack was empty, as it
+     * takes everything there at once */
+    if (pushSubmission(client, sub))
+        (void)write(client->wakeupFds[1], "", 1);
+
+    if (!result) {
+        /* There is no answer for this - Keys are sent async */
+        return VIM_REMOTE_OK;
+    }
+
+    retval = waitForDispatcher(client, waitForPend, &pending, deadline, cancel, cancelData);
+
+    unregisterPending(client, &pending);
+    *result = pending.result;
+
+    if (pending.result == NULL)
+        return retval == VIM_REMOTE_OK ? VIM_REMOTE_ERROR: retval;
+    return pending.code == 0 ? VIM_REMOTE_OK: VIM_REMOTE_EVAL_ERROR;
+}
+
+/*
+ * Send to an instance of Vim via the X display and wait "timeout"
+ * milliseconds at most for the result, or forever if negative.
+ * Returns VIM_REMOTE_OK, or VIM_REMOTE_TIMEOUT if no result arrived in time,
+ * VIM_REMOTE_EVAL_ERROR if Vim failed to evaluate the command and
+ * VIM_REMOTE_ERROR for any other error.
+ *
+ * Commands sent by several threads at about the same time are combined:
+ * each thread queues its command and then flushes the queue once it has
+ * the display, so the first one in sends everything queued so far and the
+ * others find their commands already gone.
+ */
+int serverSendToVim(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout)
+{
+    return serverSendToVimCancellable(client, name, cmd, cmd_len, result, timeout, NULL, NULL);
+}
+
+/*
+ * As serverSendToVim(), but stop waiting and return VIM_REMOTE_CANCELLED
+ * once "cancel" says the result is no longer wanted.  A result that comes
+ * in later is thrown away.
+ */
+int serverSendToVimCancellable(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    int res;
+    VimRemotingClient_Submission *sub;
+    VimRemotingClient_Delivery delivery;
+    VimRemotingClient_PendingCommand pending;
+
+    if (result != NULL)
+        *result = NULL;
+
+    if (client->dispatcher)
+        return submitToVim(client, name, cmd, cmd_len, result, timeout, cancel, cancelData);
+
+    sub = newSubmission(client, name, cmd, cmd_len, result != NULL);
+    if (!sub)
+        return VIM_REMOTE_ERROR;
+    delivery.w = None;
+    delivery.failed = FALSE;
+    sub->delivery = &delivery;
+
+    /*
+     * Register the fact that we're waiting for a command to
+     * complete (this is needed by SendEventProc and by
+     * AppendErrorProc to pass back the command's results).
+     * This has to happen before the command goes out, as the reply
+     * may well be dispatched by another thread before we get to wait.
+     */
+    if (result) {
+        pending.serial = sub->serial;
+        pending.w = None;
+        pending.code = 0;
+        pending.result = NULL;
+        pending.failed = FALSE;
+        pending.firstRequest = pending.lastRequest = 0;
+        registerPending(client, &pending);
+    }
+
+    pushSubmission(client, sub);
+
+    /*
+     * Send the command to target interpreter by appending it to the
+     * comm window in the communication window, unless another thread
+     * already did while we were waiting for the display.  Either way
+     * "delivery" tells how it went once we have the display.
+     */
+    prologue(client);
+    flushSubmissions(client);
+    epilogue(client);
+
+    if (delivery.failed) {
+        if (result)
+            unregisterPending(client, &pending);
+        return -1;
+    }
+
+    if (!result) {
+        /* There is no answer for this - Keys are sent async */
+        return VIM_REMOTE_OK;
+    }
+
+    /*
+     * The display is not held while waiting, so that any number of
+     * commands can be in flight at the same time.
+     */
+    res = serverWait(client, delivery.w, waitForPend, &pending, timeout, cancel, cancelData);
+
+    /*
+     * Unregister the information about the pending command
+     * and return the result.
+     */
+    unregisterPending(client, &pending);
+    *result = pending.result;
+
+    if (pending.result == NULL)
+        return res == VIM_REMOTE_OK ? VIM_REMOTE_ERROR: res;
+    return pending.code == 0 ? VIM_REMOTE_OK: VIM_REMOTE_EVAL_ERROR;
+}
+
+/*
+ * Send "cmd" to be evaluated by the server "name" without waiting; the
+ * result is thrown away when it comes in.
+ * Returns VIM_REMOTE_OK or VIM_REMOTE_ERROR.
+ */
+int serverSendExpr(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len)
+{
+    VimRemotingClient_Submission *sub;
+    VimRemotingClient_Delivery delivery;
+
+    sub = newSubmission(client, name, cmd, cmd_len, TRUE);
+    if (!sub)
+        return VIM_REMOTE_ERROR;
+
+    if (client->dispatcher) {
+        if (pushSubmission(client, sub))
+            (void)write(client->wakeupFds[1], "", 1);
+        return VIM_REMOTE_OK;
+    }
+
+    delivery.w = None;
+    delivery.failed = FALSE;
+    sub->delivery = &delivery;
+    pushSubmission(client, sub);
+
+    prologue(client);
+    flushSubmissions(client);
+    epilogue(client);
+
+    return delivery.failed ? VIM_REMOTE_ERROR: VIM_REMOTE_OK;
+}
+
+/*
+ * Register "pending" for the result of "cmd" and send it to the server
+ * "name", through the dispatcher thread if there is one.  "*w" is set to
+ * the window it went to, or None if the dispatcher sends it.
+ * Returns 0 for OK, -1 if it couldn't be sent; "pending" is then left
+ * unregistered.
+ */
+static int sendPending(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, VimRemotingClient_PendingCommand *pending, Window *w)
+{
+    VimRemotingClient_Submission *sub;
+    VimRemotingClient_Delivery delivery;
+
+    sub = newSubmission(client, name, cmd, cmd_len, TRUE);
+    if (!sub)
+        return -1;
+
+    pending->serial = sub->serial;
+    pending->w = None;
+    pending->code = 0;
+    pending->result = NULL;
+    pending->failed = FALSE;
+    pending->firstRequest = pending->lastRequest = 0;
+    registerPending(client, pending);
+    *w = None;
+
+    if (client->dispatcher) {
+        if (pushSubmission(client, sub))
+            (void)write(client->wakeupFds[1], "", 1);
+        return 0;
+    }
+
+    delivery.w = None;
+    delivery.failed = FALSE;
+    sub->delivery = &delivery;
+    pushSubmission(client, sub);
+
+    prologue(client);
+    flushSubmissions(client);
+    epilogue(client);
+
+    if (delivery.failed) {
+        unregisterPending(client, pending);
+        return -1;
+    }
+    *w = delivery.w;
+    return 0;
+}
+
+/*
+ * Wait for "endCond" until "deadline" at the latest, -1 meaning forever,
+ * on the window "w" unless the dispatcher thread reads the events.
+ */
+static int waitPending(VimRemotingClient *client, Window w, VimRemotingClient_EndCond endCond, void *endData, long long deadline, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    long long msec;
+
+    if (client->dispatcher)
+        return waitForDispatcher(client, endCond, endData, deadline, cancel, cancelData);
+    msec = deadline >= 0 ? deadline - monotonic_msec(): -1;
+    return serverWait(client, w, endCond, endData, deadline >= 0 && msec < 0 ? 0: (long)msec, cancel, cancelData);
+}
+
+/*
+ * As serverSendToVimCancellable(), but should the result take longer than
+ * "delay" milliseconds, send the command to the server "hedge" names as
+ * well, if any, and take whichever result comes in first.  The other
+ * command is forgotten, so its result is thrown away when it comes in.
+ * "*which" is set to 1 if the result came from the second server, 0
+ * otherwise.
+ */
+int serverSendToVimHedged(VimRemotingClient *client, const char *name, const char *cmd, apr_size_t cmd_len, char **result, long timeout, long delay, VimRemotingClient_Hedge hedge, void *hedgeData, int *which, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    VimRemotingClient_PendingCommand pendings[2], *winner;
+    VimRemotingClient_Hedging hedging;
+    Window w[2];
+    long long now = monotonic_msec();
+    long long deadline = timeout >= 0 ? now + timeout: -1;
+    long long hedgeAt = now + delay;
+    const char *hedgeName;
+    int res, n = 1, i;
+
+    *result = NULL;
+    *which = 0;
+
+    if (sendPending(client, name, cmd, cmd_len, &pendings[0], &w[0]))
+        return VIM_REMOTE_ERROR;
+
+    res = waitPending(client, w[0], waitForPend, &pendings[0],
+                      deadline >= 0 && deadline < hedgeAt ? deadline: hedgeAt, cancel, cancelData);
+    if (res == VIM_REMOTE_TIMEOUT && (deadline < 0 || hedgeAt < deadline)) {
+        if ((hedgeName = hedge(hedgeData)) != NULL
+                && sendPending(client, hedgeName, cmd, cmd_len, &pendings[1], &w[1]) == 0) {
+            n = 2;
+            hedging.first = &pendings[0];
+            hedging.second = &pendings[1];
+            res = waitPending(client, w[1], waitForEither, &hedging, deadline, cancel, cancelData);
+        }
+        /* Nothing else to go on, or the second server went away */
+        if (!pendings[0].result && !pendings[0].failed
+                && (n == 1 || (res == VIM_REMOTE_ERROR && !pendings[1].result)))
+            res = waitPending(client, w[0], waitForPend, &pendings[0], deadline, cancel, cancelData);
+    }
+
+    winner = &pendings[0];
+    if (n == 2 && !pendings[0].result && pendings[1].result) {
+        winner = &pendings[1];
+        *which = 1;
+    }
+    for (i = 0; i < n; i++) {
+        unregisterPending(client, &pendings[i]);
+        if (&pendings[i] != winner)
+            free(pendings[i].result);
+    }
+    *result = winner->result;
+
+    if (winner->result == NULL)
+        return res == VIM_REMOTE_OK ? VIM_REMOTE_ERROR: res;
+    return winner->code == 0 ? VIM_REMOTE_OK: VIM_REMOTE_EVAL_ERROR;
+}
+
+/*
+ * Open a stream, through which a Vim can send a result piece by piece with
+ * server2client() while still working on the rest.  Every piece must start
+ * with the tag stored in "*tag", and an empty piece, just the tag, ends the
+ * stream.  The stream must be closed with serverCloseStream().
+ * Returns NULL when out of memory.
+ */
+VimRemotingClient_Stream *serverOpenStream(VimRemotingClient *client, const char **tag)
+{
+    VimRemotingClient_Stream *stream = malloc(sizeof(*stream));
+
+    if (!stream)
+        return NULL;
+    stream->client = client;
+    stream->id = (int)(apr_atomic_inc32(&client->serial) + 1);
+    sprintf(stream->tag, STREAM_TAG_PREFIX "%d:", stream->id);
+    stream->sent = FALSE;
+    stream->queue.id = None;
+    stream->queue.strings = NULL;
+    stream->queue.head = 0;
+    stream->queue.count = 0;
+    stream->queue.size = 0;
+    stream->ended = FALSE;
+    stream->lost = FALSE;
+
+    apr_thread_mutex_lock(client->mutex);
+    apr_hash_set(client->streams, &stream->id, sizeof(stream->id), stream);
+    apr_thread_mutex_unlock(client->mutex);
+
+    *tag = stream->tag;
+    return stream;
+}
+
+/*
+ * Send "cmd", which is expected to feed "stream", to the server "name"
+ * without waiting for anything.
+ * Returns VIM_REMOTE_OK or VIM_REMOTE_ERROR.
+ */
+int serverStreamSend(VimRemotingClient_Stream *stream, const char *name, const char *cmd, apr_size_t cmd_len)
+{
+    VimRemotingClient *client = stream->client;
+    VimRemotingClient_Submission *sub;
+    VimRemotingClient_Delivery delivery;
+
+    if (stream->sent)
+        return VIM_REMOTE_ERROR;
+
+    sub = newSubmission(client, name, cmd, cmd_len, TRUE);
+    if (!sub)
+        return VIM_REMOTE_ERROR;
+
+    /* The result tells whether the command failed */
+    stream->pending.serial = sub->serial;
+    stream->pending.w = None;
+    stream->pending.code = 0;
+    stream->pending.result = NULL;
+    stream->pending.failed = FALSE;
+    stream->pending.firstRequest = stream->pending.lastRequest = 0;
+    registerPending(client, &stream->pending);
+    stream->sent = TRUE;
+
+    if (client->dispatcher) {
+        if (pushSubmission(client, sub))
+            (void)write(client->wakeupFds[1], "", 1);
+        return VIM_REMOTE_OK;
+    }
+
+    delivery.w = None;
+    delivery.failed = FALSE;
+    sub->delivery = &delivery;
+    pushSubmission(client, sub);
+
+    prologue(client);
+    flushSubmissions(client);
+    epilogue(client);
+
+    return delivery.failed ? VIM_REMOTE_ERROR: VIM_REMOTE_OK;
+}
+
+static int waitForStream(void *p)
+{
+    VimRemotingClient_Stream *stream = p;
+    return stream->queue.count > 0 || stream->ended || stream->lost
+            || stream->pending.failed
+            || (stream->pending.result && stream->pending.code != 0);
+}
+
+/*
+ * Wait "timeout" milliseconds at most, or forever if negative, for the
+ * next piece of "stream", or until "cancel", unless NULL, gives up.
+ * Returns VIM_REMOTE_OK and the malloc'ed piece, without its tag, in
+ * "*str", which is NULL once the stream ended.  Returns VIM_REMOTE_TIMEOUT
+ * if nothing came in time, VIM_REMOTE_EVAL_ERROR if Vim failed to evaluate
+ * the command, VIM_REMOTE_ERROR if it couldn't be sent or its window went
+ * away before the end of the stream, and VIM_REMOTE_CANCELLED when given
+ * up.
+ */
+int serverReadStream(VimRemotingClient_Stream *stream, char **str, long timeout, VimRemotingClient_Cancel cancel, void *cancelData)
+{
+    VimRemotingClient *client = stream->client;
+    int retval;
+
+    *str = NULL;
+    if (!stream->sent)
+        return VIM_REMOTE_ERROR;
+
+    if (client->dispatcher)
+        retval = waitForDispatcher(client, waitForStream, stream,
+                                   timeout >= 0 ? monotonic_msec() + timeout: -1,
+                                   cancel, cancelData);
+    else
+        retval = serverWait(client, stream->pending.w, waitForStream, stream, timeout, cancel, cancelData);
+
+    apr_thread_mutex_lock(client->mutex);
+    if (stream->queue.count > 0) {
+        *str = popReply(&stream->queue);
+        retval = VIM_REMOTE_OK;
+    } else if (stream->ended) {
+        retval = VIM_REMOTE_OK;
+    } else if (retval == VIM_REMOTE_OK) {
+        retval = stream->pending.result && stream->pending.code != 0 ?
+                VIM_REMOTE_EVAL_ERROR: VIM_REMOTE_ERROR;
+    }
+    apr_thread_mutex_unlock(client->mutex);
+    return retval;
+}
+
+/*
+ * Close "stream", dropping whatever it still has in store.
+ */
+void serverCloseStream(VimRemotingClient_Stream *stream)
+{
+    VimRemotingClient *client = stream->client;
+
+    if (stream->sent)
+        unregisterPending(client, &stream->pending);
+
+    apr_thread_mutex_lock(client->mutex);
+    apr_hash_set(client->streams, &stream->id, sizeof(stream->id), NULL);
+    clearReply(&stream->queue);
+    apr_thread_mutex_unlock(client->mutex);
+
+    if (stream->sent)
+        free(stream->pending.result);
+    free(stream);
+}
+
+/*
+ * Start a thread owning the display, which from then on sends the commands
+ * and dispatches the events for everybody.  Request threads only queue
+ * their commands and wait for the results.
+ * Return 0 for OK, -1 for error.
+ */
+int VimRemotingClient_startDispatcher(VimRemotingClient *client)
+{
+    if (client->dispatcher)
+        return 0;
+    if (apr_thread_create(&client->dispatcher, NULL, dispatcherThread, client, client->pool)) {
+        client->dispatcher = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "Cannot start the X dispatcher thread");
+        return -1;
+    }
+    return 0;
+}
+
+static void VimRemotingClient_destory(VimRemotingClient *client)
+{
+    apr_hash_index_t *hi;
+
+    if (client->dispatcher) {
+        apr_status_t rv;
+        VimRemotingClient_Submission *sub;
+
+        client->stopping = TRUE;
+        (void)write(client->wakeupFds[1], "", 1);
+        apr_thread_join(&rv, client->dispatcher);
+        client->dispatcher = NULL;
+
+        /* whatever was submitted too late is never sent */
+        while ((sub = client->submissions) != NULL) {
+            client->submissions = sub->nextPtr;
+            freeSubmission(sub);
+        }
+    }
+
+    prologue(client);
+    destroyCommWindow(client);
+    invalidateNameCache(client);
+    epilogue(client);
+    closeDisplay(client);
+    for (hi = apr_hash_first(NULL, client->serverReply); hi; hi = apr_hash_next(hi)) {
+        void *reply;
+
+        apr_hash_this(hi, NULL, NULL, &reply);
+        freeReply(reply);
+    }
+    ga_clear(&client->xErrors);
+    ga_clear(&client->inFlight);
+    close(client->wakeupFds[0]);
+    close(client->wakeupFds[1]);
+    apr_pool_destroy(client->pool);
+}
+
+static int VimRemotingClient_init(VimRemotingClient *client, server_rec *server_rec, const char *vim_version, const char *enc)
+{
+    client->server_rec = server_rec;
+    client->vim_version = vim_version;
+    client->enc = enc;
+    client->window = None;
+    client->serial = 0;
+    client->dispatcher = NULL;
+    client->stopping = FALSE;
+    client->submissions = NULL;
+    client->pendingCommands = NULL;
+    client->watches = NULL;
+    ga_init2(&client->xErrors, sizeof(VimRemotingClient_Serial), 16);
+    ga_init2(&client->inFlight, sizeof(VimRemotingClient_InFlight), 16);
+    client->got_int = 0;
+    client->commProperty = None;
+    client->registryProperty = None;
+    client->vimProperty = None;
+    client->reading = FALSE;
+    client->nameCacheFilled = FALSE;
+    client->converters = NULL;
+
+    if (apr_pool_create(&client->pool, NULL))
+        return -1;
+
+    client->nameCache = apr_hash_make(client->pool);
+    client->pendingBySerial = apr_hash_make(client->pool);
+    client->serverReply = apr_hash_make(client->pool);
+    client->streams = apr_hash_make(client->pool);
+
+    if (apr_thread_mutex_create(&client->mutex, APR_THREAD_MUTEX_DEFAULT, client->pool)
+            || apr_thread_cond_create(&client->cond, client->pool)) {
+        apr_pool_destroy(client->pool);
+        return -1;
+    }
+
+    if (pipe(client->wakeupFds)) {
+        apr_pool_destroy(client->pool);
+        return -1;
+    }
+    fcntl(client->wakeupFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(client->wakeupFds[1], F_SETFL, O_NONBLOCK);
+
+    if (VimRemotingClient_init_internal(client)) {
+        ga_clear(&client->xErrors);
+        ga_clear(&client->inFlight);
+        close(client->wakeupFds[0]);
+        close(client->wakeupFds[1]);
+        apr_pool_destroy(client->pool);
+        return -1;
+    }
+    return 0;
+}
+
+void VimRemotingClient_delete(VimRemotingClient *client)
+{
+    if (!client)
+        return;
+    VimRemotingClient_destory(client);
+    free(client);
+}
+
+/*
+ * Create a client on its own connection to "display" (NULL for $DISPLAY),
+ * which is closed when the client is deleted.  A client may be used from
+ * any number of threads, but threads using distinct clients never contend
+ * with each other.
+ */
+VimRemotingClient *VimRemotingClient_new(server_rec *server_rec, const char *vim_version, const char *enc, const char *display)
+{
+    VimRemotingClient *client = malloc(sizeof(*client));
+    if (!client) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server_rec, "Cannot allocate space for VimRemotingClient");
+        return NULL;
+    }
+    if (openDisplay(client, display)) {
+        free(client);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server_rec, "Cannot open display %s", display ? display: "(default)");
+        return NULL;
+    }
+    if (VimRemotingClient_init(client, server_rec, vim_version, enc)) {
+        closeDisplay(client);
+        free(client);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, server_rec, "Cannot create a VimRemotingClient");
+        return NULL;
+    }
+    return client;
+}
+
+#ifdef USE_XCB
+#include "remote_xcb.c"
+#else
+#include "remote_x.c"
+#endif
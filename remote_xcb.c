@@ -0,0 +1,448 @@
+/* vi:set ts=8 sts=4 sw=4:
+ *
+ * VIM - Vi IMproved        by Bram Moolenaar
+ * X command server by Flemming Madsen
+ *
+ * Do ":help uganda"  in Vim to read copying and usage conditions.
+ * Do ":help credits" in Vim to see a list of people who contributed.
+ * See README.txt for an overview of the Vim source code.
+ *
+ * remote_xcb.c: The requests of remote_x11.c, made through XCB.  Included
+ * by remote_x11.c instead of remote_x.c when USE_XCB is defined.
+ *
+ * Unlike Xlib, XCB hands out a cookie for every request and lets the reply
+ * be collected later, so requests that don't depend on each other are
+ * issued together and their replies collected in one go: the atoms at
+ * start-up, the liveness checks of all the windows looked up at once, and
+ * the appends, which are never waited for at all.
+ *
+ */
+
+/*
+ * Note that the X server got past request "sequence", which is known from
+ * a reply or an event.  Must be called with the display locked.
+ */
+static void sawRequest(VimRemotingClient *client, unsigned int sequence)
+{
+    if ((int)(sequence - client->lastSeenRequest) > 0)
+        client->lastSeenRequest = sequence;
+}
+
+static void lockDisplay(VimRemotingClient *client)
+{
+    apr_thread_mutex_lock(client->xlock);
+}
+
+static void unlockDisplay(VimRemotingClient *client)
+{
+    apr_thread_mutex_unlock(client->xlock);
+}
+
+static int displayFd(VimRemotingClient *client)
+{
+    return xcb_get_file_descriptor(client->conn);
+}
+
+static void flushDisplay(VimRemotingClient *client)
+{
+    xcb_flush(client->conn);
+}
+
+/*
+ * Have the X server send us the events in "mask" about window "w".
+ */
+static void selectInput(VimRemotingClient *client, xcb_window_t w, uint32_t mask)
+{
+    xcb_change_window_attributes(client->conn, w, XCB_CW_EVENT_MASK, &mask);
+}
+
+static void selectDestroyNotify(VimRemotingClient *client, xcb_window_t w)
+{
+    selectInput(client, w, XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+}
+
+/*
+ * The largest number of bytes a single ChangeProperty request can carry.
+ * BIG-REQUESTS is enabled by XCB if the server has it.
+ */
+static long maxPropChunk(VimRemotingClient *client)
+{
+    long max = xcb_get_maximum_request_length(client->conn);
+
+    /* request sizes are in 4-byte units; leave room for the header */
+    return (max - 8) * 4;
+}
+
+/*
+ * Queue the requests appending a given property to a given window.  Errors
+ * are only known after the next round-trip.
+ * Return: the sequence number of the last request, the first one being
+ * stored in "*firstp".
+ */
+static unsigned int appendProp(VimRemotingClient *client, xcb_window_t window, xcb_atom_t property, char *value, int length, unsigned int *firstp)
+{
+    long chunk = client->maxPropChunk;
+    xcb_void_cookie_t cookie;
+
+    if (length <= chunk) {
+        cookie = xcb_change_property(client->conn, XCB_PROP_MODE_APPEND,
+                                     window, property, XCB_ATOM_STRING, 8,
+                                     length, value);
+        *firstp = cookie.sequence;
+    } else {
+        int offset;
+
+        /*
+         * The value doesn't fit in a single request.  Vim reads and deletes
+         * the property on every PropertyNotify and parses whatever it got,
+         * so a command cut in two would be taken as two broken ones.  The
+         * chunks are therefore appended while the server is grabbed, which
+         * holds Vim's read until the last one is in.
+         * Nothing between the grab and the ungrab waits for the server or
+         * can bail out, errors being only reported later by sequence, and
+         * the ungrab is flushed at once rather than left in the output
+         * buffer, which the chunks may already have pushed the grab out of.
+         */
+        cookie = xcb_grab_server(client->conn);
+        *firstp = cookie.sequence;
+        for (offset = 0; offset < length; offset += chunk) {
+            xcb_change_property(client->conn, XCB_PROP_MODE_APPEND,
+                                window, property, XCB_ATOM_STRING, 8,
+                                length - offset < chunk ? length - offset: chunk,
+                                value + offset);
+        }
+        cookie = xcb_ungrab_server(client->conn);
+        xcb_flush(client->conn);
+    }
+    return cookie.sequence;
+}
+
+/*
+ * Check whether the windows "ws" exist and have a "Vim" property on them,
+ * storing TRUE or FALSE into "valid" for each.  The requests all go out
+ * before the first reply is waited for, so this costs a single round-trip
+ * however many windows there are.
+ * Return -1 when out of memory, 0 otherwise.
+ */
+static int checkWindows(VimRemotingClient *client, const xcb_window_t *ws, int *valid, size_t n)
+{
+    xcb_list_properties_cookie_t *cookies;
+    size_t i;
+
+    cookies = malloc(sizeof(*cookies) * (n ? n: 1));
+    if (!cookies)
+        return -1;
+    for (i = 0; i < n; i++)
+        cookies[i] = xcb_list_properties(client->conn, ws[i]);
+
+    for (i = 0; i < n; i++) {
+        xcb_list_properties_reply_t *reply;
+        xcb_generic_error_t *error = NULL;
+
+        valid[i] = FALSE;
+        reply = xcb_list_properties_reply(client->conn, cookies[i], &error);
+        sawRequest(client, cookies[i].sequence);
+        if (reply) {
+            xcb_atom_t *plist = xcb_list_properties_atoms(reply);
+            int numProp = xcb_list_properties_atoms_length(reply);
+            int j;
+
+            for (j = 0; j < numProp; j++) {
+                if (plist[j] == client->vimProperty) {
+                    valid[i] = TRUE;
+                    break;
+                }
+            }
+            free(reply);
+        }
+        free(error);
+    }
+    free(cookies);
+    return 0;
+}
+
+/*
+ * Read the whole comm property of our window, MAX_PROP_WORDS at a time, and
+ * delete it.  Replies of any size are reassembled into a single buffer that
+ * is allocated once the total size is known.
+ * Return 0 and the malloc'ed, NUL terminated data in "*data" for OK, -1 if
+ * the property doesn't exist or is improperly formed.
+ */
+static int readCommProperty(VimRemotingClient *client, char **data, unsigned long *len)
+{
+    garray_T buf;
+    long offset = 0;
+
+    ga_init2(&buf, 1, 1);
+
+    for (;;) {
+        xcb_get_property_cookie_t cookie;
+        xcb_get_property_reply_t *reply;
+        unsigned long numItems;
+
+        /* The property is only deleted by the read that reaches its end */
+        cookie = xcb_get_property(client->conn, 1, client->window,
+                                  client->commProperty, XCB_ATOM_STRING,
+                                  offset, MAX_PROP_WORDS);
+        reply = xcb_get_property_reply(client->conn, cookie, NULL);
+        sawRequest(client, cookie.sequence);
+
+        if (!reply || reply->type != XCB_ATOM_STRING || reply->format != 8) {
+            free(reply);
+            ga_clear(&buf);
+            return -1;
+        }
+        numItems = xcb_get_property_value_length(reply);
+
+        /* Reserve room for the rest of the property plus the NUL */
+        if (ga_grow(&buf, numItems + reply->bytes_after + 1)) {
+            free(reply);
+            ga_clear(&buf);
+            return -1;
+        }
+        memcpy((char *)buf.ga_data + buf.ga_len, xcb_get_property_value(reply), numItems);
+        buf.ga_len += numItems;
+
+        if (reply->bytes_after == 0) {
+            free(reply);
+            break;
+        }
+        free(reply);
+
+        /* Offsets are in 32-bit units; full chunks are always aligned */
+        offset += numItems / 4;
+    }
+
+    if (!buf.ga_data) {
+        ga_clear(&buf);
+        return -1;
+    }
+    ((char *)buf.ga_data)[buf.ga_len] = '\0';
+    *data = buf.ga_data;
+    *len = buf.ga_len;
+    return 0;
+}
+
+/*
+ * Read the registry property.  Delete it when it's formatted wrong.
+ * Return the property in "regPropp".  "empty_prop" is used when it doesn't
+ * exist yet.  "*handlep" is set to the reply holding it, to be freed by the
+ * caller with freeRegProp().
+ * Return OK when successful.
+ */
+static int getRegProp(VimRemotingClient *client, void **handlep, unsigned char **regPropp, unsigned long *numItemsp)
+{
+    xcb_get_property_cookie_t cookie;
+    xcb_get_property_reply_t *reply;
+
+    *regPropp = NULL;
+    *handlep = NULL;
+
+    cookie = xcb_get_property(client->conn, 0, client->root,
+                              client->registryProperty, XCB_ATOM_STRING,
+                              0, MAX_PROP_WORDS);
+    reply = xcb_get_property_reply(client->conn, cookie, NULL);
+    sawRequest(client, cookie.sequence);
+    if (!reply)
+        return -1;
+
+    if (reply->type == XCB_NONE) {
+        /* No prop yet. Logically equal to the empty list */
+        free(reply);
+        *numItemsp = 0;
+        *regPropp = (unsigned char *)empty_prop;
+        return 0;
+    }
+
+    /* If the property is improperly formed, then delete it. */
+    if (reply->format != 8 || reply->type != XCB_ATOM_STRING) {
+        free(reply);
+
+        xcb_delete_property(client->conn, client->root, client->registryProperty);
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, client->server_rec, "VIM instance registry property is badly formed.  Deleted!");
+
+        return -1;
+    }
+
+    *handlep = reply;
+    *regPropp = xcb_get_property_value(reply);
+    *numItemsp = xcb_get_property_value_length(reply);
+    return 0;
+}
+
+static void freeRegProp(void *handle)
+{
+    free(handle);
+}
+
+/*
+ * Replace the registry property with "length" bytes of "value".
+ */
+static void replaceRegProp(VimRemotingClient *client, unsigned char *value, int length)
+{
+    xcb_change_property(client->conn, XCB_PROP_MODE_REPLACE, client->root,
+                        client->registryProperty, XCB_ATOM_STRING, 8,
+                        length, value);
+}
+
+/*
+ * Dispatch every event that is already available on the connection.
+ * Must be called with the display locked.
+ */
+static void processEvents(VimRemotingClient *client)
+{
+    xcb_generic_event_t *event;
+    /* The errors of the requests up to here are queued by now, as XCB
+     * reads everything in order */
+    unsigned int processed = client->lastSeenRequest;
+    int dispatched = FALSE;
+
+    while ((event = xcb_poll_for_event(client->conn)) != NULL) {
+        switch (event->response_type & ~0x80) {
+            case 0: {
+                xcb_generic_error_t *error = (xcb_generic_error_t *)event;
+
+                sawRequest(client, error->full_sequence);
+                noteXError(client, error->full_sequence);
+                break;
+            }
+            case XCB_PROPERTY_NOTIFY: {
+                xcb_property_notify_event_t *e = (xcb_property_notify_event_t *)event;
+
+                sawRequest(client, event->full_sequence);
+                if (e->window == client->window) {
+                    if (e->atom == client->commProperty
+                            && e->state == XCB_PROPERTY_NEW_VALUE)
+                        serverEventProc(client);
+                    dispatched = TRUE;
+                } else if (e->atom == client->registryProperty) {
+                    /* Some editor came or went */
+                    invalidateNameCache(client);
+                }
+                break;
+            }
+            case XCB_DESTROY_NOTIFY: {
+                xcb_destroy_notify_event_t *e = (xcb_destroy_notify_event_t *)event;
+
+                sawRequest(client, event->full_sequence);
+                if (windowDestroyed(client, e->window))
+                    dispatched = TRUE;
+                break;
+            }
+        }
+        free(event);
+    }
+
+    eventsProcessed(client, processed, dispatched);
+}
+
+static int VimRemotingClient_init_internal(VimRemotingClient *client)
+{
+    static const char *const names[] = { "Comm", "Vim", "VimRegistry" };
+    xcb_atom_t *atoms[3];
+    xcb_intern_atom_cookie_t cookies[3];
+    xcb_void_cookie_t created, marked;
+    xcb_generic_error_t *error;
+    uint32_t values[3];
+    int retval = 0;
+    int i;
+
+    if (apr_thread_mutex_create(&client->xlock, APR_THREAD_MUTEX_DEFAULT, client->pool))
+        return -1;
+
+    atoms[0] = &client->commProperty;
+    atoms[1] = &client->vimProperty;
+    atoms[2] = &client->registryProperty;
+
+    prologue(client);
+
+    /* All the atoms are interned with a single round-trip */
+    for (i = 0; i < 3; i++)
+        cookies[i] = xcb_intern_atom(client->conn, 0, strlen(names[i]), names[i]);
+    for (i = 0; i < 3; i++) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(client->conn, cookies[i], NULL);
+
+        sawRequest(client, cookies[i].sequence);
+        if (!reply) {
+            retval = -1;
+            continue;
+        }
+        *atoms[i] = reply->atom;
+        free(reply);
+    }
+    if (retval) {
+        epilogue(client);
+        return retval;
+    }
+
+    client->window = xcb_generate_id(client->conn);
+    values[0] = client->screen->white_pixel;
+    values[1] = client->screen->white_pixel;
+    values[2] = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    created = xcb_create_window_checked(
+            client->conn, XCB_COPY_FROM_PARENT, client->window,
+            client->screen->root, (int16_t)getpid(), 0, 10, 10, 0,
+            XCB_WINDOW_CLASS_INPUT_OUTPUT, client->screen->root_visual,
+            XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK,
+            values);
+
+    /* Get notified of changes to the registry */
+    selectInput(client, client->root, XCB_EVENT_MASK_PROPERTY_CHANGE);
+
+    /* WARNING: Do not step through this while debugging, it will hangup
+     * the X server! */
+    xcb_grab_server(client->conn);
+    deleteAnyLingerer(client);
+    xcb_ungrab_server(client->conn);
+
+    /* Make window recognizable as a vim window */
+    marked = xcb_change_property_checked(
+            client->conn, XCB_PROP_MODE_REPLACE, client->window,
+            client->vimProperty, XCB_ATOM_STRING, 8,
+            (uint32_t)strlen(client->vim_version) + 1, client->vim_version);
+
+    /* Only the last check needs a round-trip */
+    if ((error = xcb_request_check(client->conn, created)) != NULL) {
+        free(error);
+        retval = -1;
+    }
+    if ((error = xcb_request_check(client->conn, marked)) != NULL) {
+        free(error);
+        retval = -1;
+    }
+    sawRequest(client, marked.sequence);
+
+    epilogue(client);
+    return retval;
+}
+
+static void destroyCommWindow(VimRemotingClient *client)
+{
+    xcb_destroy_window(client->conn, client->window);
+}
+
+static int openDisplay(VimRemotingClient *client, const char *display)
+{
+    xcb_screen_iterator_t it;
+    int screen;
+
+    client->conn = xcb_connect(display, &screen);
+    if (xcb_connection_has_error(client->conn)) {
+        xcb_disconnect(client->conn);
+        return -1;
+    }
+    it = xcb_setup_roots_iterator(xcb_get_setup(client->conn));
+    client->root = it.data->root;
+    for (; screen > 0 && it.rem > 1; screen--)
+        xcb_screen_next(&it);
+    client->screen = it.data;
+    client->maxPropChunk = maxPropChunk(client);
+    client->lastSeenRequest = 0;
+    return 0;
+}
+
+static void closeDisplay(VimRemotingClient *client)
+{
+    xcb_disconnect(client->conn);
+}
@@ -0,0 +1,84 @@
+#include <httpd.h>
+#include <apr_atomic.h>
+#include <apr_general.h>
+#include "utils.h"
+#include "retry.h"
+
+/* A retry, in the units the balance is kept in */
+#define RETRY_COST 100
+
+/* Retries the balance may hold, which is also what it starts with */
+#define RETRY_BUDGET_RESERVE 10
+
+/* Longest wait before the random part, however many attempts there were */
+#define RETRY_MAX_BACKOFF apr_time_from_sec(5)
+
+struct VimRetryBudget {
+    /* Hundredths of a retry */
+    volatile apr_uint32_t balance;
+    apr_uint32_t deposit;
+    apr_uint32_t limit;
+};
+
+VimRetryBudget *VimRetryBudget_new(apr_pool_t *pool, int percent)
+{
+    VimRetryBudget *budget = apr_palloc(pool, sizeof(*budget));
+
+    budget->deposit = percent;
+    budget->limit = RETRY_BUDGET_RESERVE * RETRY_COST;
+    budget->balance = budget->limit;
+    return budget;
+}
+
+/*
+ * Account for a request that may be retried.
+ */
+void VimRetryBudget_deposit(VimRetryBudget *budget)
+{
+    apr_uint32_t balance, newBalance;
+
+    do {
+        balance = apr_atomic_read32(&budget->balance);
+        newBalance = balance + budget->deposit;
+        if (newBalance > budget->limit)
+            newBalance = budget->limit;
+        if (newBalance == balance)
+            return;
+    } while (apr_atomic_cas32(&budget->balance, newBalance, balance) != balance);
+}
+
+/*
+ * Return TRUE if a retry may be made, taking it out of the budget.
+ */
+int VimRetryBudget_withdraw(VimRetryBudget *budget)
+{
+    apr_uint32_t balance;
+
+    do {
+        balance = apr_atomic_read32(&budget->balance);
+        if (balance < RETRY_COST)
+            return FALSE;
+    } while (apr_atomic_cas32(&budget->balance, balance - RETRY_COST, balance) != balance);
+    return TRUE;
+}
+
+/*
+ * Return how long to wait before the retry "attempt", counted from 0:
+ * "base" doubled for every attempt, plus a random part up to as much again,
+ * so that the children that saw the same failure don't all come back at
+ * once.
+ */
+apr_interval_time_t VimRetry_backoff(apr_interval_time_t base, int attempt)
+{
+    apr_interval_time_t ceiling = base;
+    apr_uint32_t random = 0;
+
+    while (attempt-- > 0 && ceiling < RETRY_MAX_BACKOFF)
+        ceiling *= 2;
+    if (ceiling > RETRY_MAX_BACKOFF)
+        ceiling = RETRY_MAX_BACKOFF;
+    if (ceiling <= 0)
+        return 0;
+    apr_generate_random_bytes((unsigned char *)&random, sizeof(random));
+    return ceiling + (apr_interval_time_t)(random % (apr_uint32_t)(ceiling + 1));
+}
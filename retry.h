@@ -0,0 +1,20 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include <httpd.h>
+
+/*
+ * Bounds the retries of a child to a share of its requests, so that when
+ * every server is failing the retries don't multiply the load.  Every
+ * request puts "percent" hundredths of a retry in; every retry takes one
+ * out.  A few retries are kept in reserve for when traffic is light.
+ * Hedged requests are bounded the same way.
+ */
+typedef struct VimRetryBudget VimRetryBudget;
+
+VimRetryBudget *VimRetryBudget_new(apr_pool_t *pool, int percent);
+void VimRetryBudget_deposit(VimRetryBudget *budget);
+int VimRetryBudget_withdraw(VimRetryBudget *budget);
+apr_interval_time_t VimRetry_backoff(apr_interval_time_t base, int attempt);
+
+#endif /* RETRY_H */
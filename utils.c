@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 
 static int iswhite(int c)
 {
@@ -31,3 +32,15 @@ int hex2nr(int c)
         return c - 'A' + 10;
     return c - '0';
 }
+
+/*
+ * Milliseconds on a clock that never goes backwards.  Only differences
+ * between two values are meaningful.
+ */
+long long monotonic_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -1,7 +1,16 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+/* Xlib defines these, but neither XCB nor APR does */
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
 char *skipwhite(char *q);
 int hex2nr(int c);
+long long monotonic_msec(void);
 
 #endif /* UTILS_H */